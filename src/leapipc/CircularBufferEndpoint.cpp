@@ -1,14 +1,29 @@
 // Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
 #include "stdafx.h"
 #include "CircularBufferEndpoint.h"
+#include <algorithm>
+#include <cstring>
 #include <system_error>
 
 using namespace leap::ipc;
 
-CircularBufferEndpoint::CircularBufferEndpoint(size_t bufferSize) :
-  m_data{new uint8_t[bufferSize]},
-  m_capacity{bufferSize}
+namespace {
+  size_t roundUpToPowerOfTwo(size_t size) {
+    size_t retVal = 1;
+    while (retVal < size)
+      retVal <<= 1;
+    return retVal;
+  }
+}
+
+CircularBufferEndpoint::CircularBufferEndpoint(size_t bufferSize, Mode mode) :
+  m_mode{mode},
+  m_capacity{mode == Mode::SingleProducerSingleConsumer ? roundUpToPowerOfTwo(bufferSize) : bufferSize}
 {
+  m_data.reset(new uint8_t[m_capacity]);
+
+  // Both ends of the connection are this endpoint, so everything it can do is agreed
+  m_capabilities = SupportedCapabilities();
 }
 
 CircularBufferEndpoint::~CircularBufferEndpoint(void) {
@@ -17,6 +32,9 @@ CircularBufferEndpoint::~CircularBufferEndpoint(void) {
 
 std::streamsize CircularBufferEndpoint::ReadRaw(void* buffer, std::streamsize size)
 {
+  if (m_mode == Mode::SingleProducerSingleConsumer)
+    return readLockFree(buffer, static_cast<size_t>(size));
+
   {
     std::unique_lock<std::mutex> lock(m_dataMutex);
     m_lastReadSize = size;
@@ -43,6 +61,9 @@ std::streamsize CircularBufferEndpoint::ReadRaw(void* buffer, std::streamsize si
 
 bool CircularBufferEndpoint::WriteRaw(const void* pBuf, std::streamsize nBytes)
 {
+  if (m_mode == Mode::SingleProducerSingleConsumer)
+    return writeLockFree(pBuf, static_cast<size_t>(nBytes));
+
   {
     std::unique_lock<std::mutex> lock(m_dataMutex);
     m_lastWriteSize = nBytes;
@@ -70,6 +91,10 @@ bool CircularBufferEndpoint::WriteRaw(const void* pBuf, std::streamsize nBytes)
 
 bool CircularBufferEndpoint::Abort(Reason reason) {
   Close(reason);
+  {
+    // Parked sides check for closure under the lock, so take it to be sure they either see it or get notified
+    std::lock_guard<std::mutex> lock(m_dataMutex);
+  }
   m_dataCV.notify_all();
   return true;
 }
@@ -79,6 +104,232 @@ void CircularBufferEndpoint::clear()
   std::lock_guard<std::mutex> lock(m_dataMutex);
   m_readIdx = 0;
   m_writeIdx = 0;
+  m_head = 0;
+  m_tail = 0;
+  m_wrapIdx = std::numeric_limits<size_t>::max();
+}
+
+std::streamsize CircularBufferEndpoint::readLockFree(void* buffer, size_t size) {
+  Span spans[2];
+  if (!peekLockFree(spans))
+    return 0;
+
+  const size_t first = std::min(size, spans[0].size);
+  const size_t second = std::min(size - first, spans[1].size);
+  memcpy(buffer, spans[0].data, first);
+  if (second)
+    memcpy(static_cast<uint8_t*>(buffer) + first, spans[1].data, second);
+  consumeLockFree(first + second);
+  return static_cast<std::streamsize>(first + second);
+}
+
+size_t CircularBufferEndpoint::peekLockFree(Span (&spans)[2]) {
+  const size_t mask = m_capacity - 1;
+  size_t tail = m_tail.load(std::memory_order_relaxed);
+  size_t head;
+  for (;;) {
+    head = m_head.load(std::memory_order_acquire);
+    if (head != tail) {
+      if (tail != m_wrapIdx.load(std::memory_order_relaxed))
+        break;
+
+      // Reserve left the rest of the ring empty, skip to the start
+      tail = (tail | mask) + 1;
+      m_tail.store(tail);
+      wakeParked(m_writerParked);
+      continue;
+    }
+    if (IsClosed())
+      return 0;
+
+    // Buffer is empty, wait for the writer
+    std::unique_lock<std::mutex> lock(m_dataMutex);
+    m_readerParked = true;
+    m_dataCV.wait(lock, [this, tail] { return m_head.load() != tail || IsClosed(); });
+    m_readerParked = false;
+  }
+
+  // The data runs to the end of the ring, or to where Reserve left it empty, and then continues from the start
+  const size_t end = (tail | mask) + 1;
+  const size_t wrapIdx = m_wrapIdx.load(std::memory_order_relaxed);
+  const size_t firstEnd = std::min(head, tail < wrapIdx && wrapIdx < end ? wrapIdx : end);
+  spans[0] = { m_data.get() + (tail & mask), firstEnd - tail };
+  spans[1] = { m_data.get(), head > end ? head - end : 0 };
+  m_peekFirst = spans[0].size;
+  return spans[0].size + spans[1].size;
+}
+
+void CircularBufferEndpoint::consumeLockFree(size_t nBytes) {
+  const size_t tail = m_tail.load(std::memory_order_relaxed);
+  const size_t end = (tail | (m_capacity - 1)) + 1;
+
+  // Sequentially consistent so it is ordered against our load of the writer's parked flag
+  m_tail.store(nBytes <= m_peekFirst ? tail + nBytes : end + (nBytes - m_peekFirst));
+  m_peekFirst = 0;
+  wakeParked(m_writerParked);
+}
+
+bool CircularBufferEndpoint::writeLockFree(const void* buffer, size_t size) {
+  const uint8_t* data = static_cast<const uint8_t*>(buffer);
+  size_t head = m_head.load(std::memory_order_relaxed);
+  while (size) {
+    if (IsClosed())
+      return false;
+
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    const size_t space = m_capacity - (head - tail);
+    if (!space) {
+      // Buffer is full, wait for the reader
+      std::unique_lock<std::mutex> lock(m_dataMutex);
+      m_writerParked = true;
+      m_dataCV.wait(lock, [this, tail] { return m_tail.load() != tail || IsClosed(); });
+      m_writerParked = false;
+      continue;
+    }
+
+    const size_t n = std::min(size, space);
+    const size_t offset = head & (m_capacity - 1);
+    const size_t first = std::min(n, m_capacity - offset);
+    memcpy(m_data.get() + offset, data, first);
+    if (first < n)
+      memcpy(m_data.get(), data + first, n - first);
+    head += n;
+    data += n;
+    size -= n;
+
+    m_head.store(head);
+    wakeParked(m_readerParked);
+  }
+  return true;
+}
+
+void CircularBufferEndpoint::wakeParked(const std::atomic<bool>& parked) {
+  if (!parked.load())
+    return;
+
+  // The parked side raised its flag under the lock before checking its condition, so once we have been through
+  // the lock it is either waiting and will get this notification, or has yet to check and will see our update
+  {
+    std::lock_guard<std::mutex> lock(m_dataMutex);
+  }
+  m_dataCV.notify_all();
+}
+
+uint8_t* CircularBufferEndpoint::Reserve(size_t nBytes) {
+  if (m_mode == Mode::SingleProducerSingleConsumer) {
+    if (nBytes > m_capacity)
+      return nullptr;
+
+    const size_t mask = m_capacity - 1;
+    for (;;) {
+      if (IsClosed())
+        return nullptr;
+
+      const size_t head = m_head.load(std::memory_order_relaxed);
+      const size_t offset = head & mask;
+      const size_t tail = m_tail.load(std::memory_order_acquire);
+      const size_t space = m_capacity - (head - tail);
+      if (m_capacity - offset < nBytes) {
+        // Not enough room before the end of the ring.  Leave the rest of it empty so the reservation can start
+        // at the beginning, and let the reader know so it can skip over it.
+        if (space >= m_capacity - offset) {
+          m_wrapIdx.store(head, std::memory_order_relaxed);
+          m_head.store(head + m_capacity - offset);
+          wakeParked(m_readerParked);
+          continue;
+        }
+      }
+      else if (space >= nBytes)
+        return m_data.get() + offset;
+
+      // Buffer is too full, wait for the reader
+      std::unique_lock<std::mutex> lock(m_dataMutex);
+      m_writerParked = true;
+      m_dataCV.wait(lock, [this, tail] { return m_tail.load() != tail || IsClosed(); });
+      m_writerParked = false;
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(m_dataMutex);
+  for (;;) {
+    if (IsClosed())
+      return nullptr;
+    if (writeContiguousUnsafe() >= nBytes)
+      return m_data.get() + m_writeIdx;
+
+    if (m_readIdx == m_writeIdx) {
+      // Nothing to move, start over at the beginning
+      m_readIdx = 0;
+      m_writeIdx = 0;
+      if (writeContiguousUnsafe() >= nBytes)
+        return m_data.get();
+    }
+
+    if (!m_peeked) {
+      // Move what's there to the start of the buffer, growing it if there still wouldn't be enough room
+      resizeUnsafe(std::max(m_capacity, readAvailable() + nBytes + 1));
+      continue;
+    }
+
+    // The reader is looking at the buffer in place, it can't be moved until the reader is done
+    m_dataCV.wait(lock);
+  }
+}
+
+void CircularBufferEndpoint::Commit(size_t nBytes) {
+  if (m_mode == Mode::SingleProducerSingleConsumer) {
+    m_head.store(m_head.load(std::memory_order_relaxed) + nBytes);
+    wakeParked(m_readerParked);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_dataMutex);
+    m_writeIdx = (m_writeIdx + nBytes) % m_capacity;
+  }
+  m_dataCV.notify_all();
+}
+
+size_t CircularBufferEndpoint::Peek(Span (&spans)[2]) {
+  spans[0] = {};
+  spans[1] = {};
+  if (m_mode == Mode::SingleProducerSingleConsumer)
+    return peekLockFree(spans);
+
+  std::unique_lock<std::mutex> lock(m_dataMutex);
+  m_dataCV.wait(lock, [this] { return readAvailable() > 0 || IsClosed(); });
+  if (IsClosed())
+    return 0;
+
+  if (m_writeIdx >= m_readIdx)
+    spans[0] = { m_data.get() + m_readIdx, m_writeIdx - m_readIdx };
+  else {
+    spans[0] = { m_data.get() + m_readIdx, m_capacity - m_readIdx };
+    spans[1] = { m_data.get(), m_writeIdx };
+  }
+  m_peeked = spans[0].size + spans[1].size;
+  return m_peeked;
+}
+
+void CircularBufferEndpoint::Consume(size_t nBytes) {
+  if (m_mode == Mode::SingleProducerSingleConsumer) {
+    consumeLockFree(nBytes);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_dataMutex);
+    m_readIdx = (m_readIdx + nBytes) % m_capacity;
+    m_peeked = 0;
+  }
+  m_dataCV.notify_all();
+}
+
+size_t CircularBufferEndpoint::writeContiguousUnsafe() {
+  // One byte always stays free, a full buffer would otherwise look the same as an empty one
+  if (m_writeIdx >= m_readIdx)
+    return m_capacity - m_writeIdx - (m_readIdx ? 0 : 1);
+  return m_readIdx - m_writeIdx - 1;
 }
 
 size_t CircularBufferEndpoint::readAvailable() {
@@ -1,9 +1,11 @@
 // Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
 #pragma once
 #include "RawIPCEndpoint.h"
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <limits>
 #include <vector>
 
 namespace leap { 
@@ -13,7 +15,17 @@ class CircularBufferEndpoint :
   public leap::ipc::RawIPCEndpoint
 {
 public:
-  explicit CircularBufferEndpoint(size_t bufferSize);
+  enum class Mode {
+    // Reads and writes of any size from any number of threads, the buffer grows as needed
+    Locked,
+
+    // Exactly one reading thread and one writing thread.  The buffer has a fixed capacity, rounded up to a
+    // power of two; reads return whatever is available and writes block while the buffer is full.  The two
+    // sides only synchronize through the buffer indices and only wait when there is nothing to do.
+    SingleProducerSingleConsumer,
+  };
+
+  explicit CircularBufferEndpoint(size_t bufferSize, Mode mode = Mode::Locked);
   ~CircularBufferEndpoint(void);
 
   // IPCEndpoint overrides:
@@ -23,7 +35,49 @@ public:
 
   void clear();
 
+  /// <summary>
+  /// A contiguous region of memory inside the buffer
+  /// </summary>
+  struct Span {
+    uint8_t* data;
+    size_t size;
+  };
+
+  /// <summary>
+  /// Reserves a contiguous region of the buffer for the writer to fill in place
+  /// </summary>
+  /// <returns>A pointer to nBytes of writable memory, or nullptr if the endpoint was closed</returns>
+  /// <remarks>
+  /// This blocks until there is room.  Nothing is visible to the reader until Commit is called, and the writer
+  /// must not make any other writes in the meantime.  In single producer/single consumer mode nBytes may not
+  /// exceed the capacity of the buffer.
+  /// </remarks>
+  uint8_t* Reserve(size_t nBytes);
+
+  /// <summary>
+  /// Publishes the first nBytes of the region returned by the last call to Reserve
+  /// </summary>
+  void Commit(size_t nBytes);
+
+  /// <summary>
+  /// Exposes the data that is ready to be read without copying it out
+  /// </summary>
+  /// <param name="spans">Receives the data, the second span is only used when the data wraps around</param>
+  /// <returns>The total number of bytes in the spans, or zero if the endpoint was closed</returns>
+  /// <remarks>
+  /// This blocks until at least one byte is available.  The spans remain valid until Consume is called, and the
+  /// reader must not make any other reads in the meantime.
+  /// </remarks>
+  size_t Peek(Span (&spans)[2]);
+
+  /// <summary>
+  /// Releases the first nBytes of the data returned by the last call to Peek
+  /// </summary>
+  void Consume(size_t nBytes);
+
 private:
+  const Mode m_mode;
+
   std::mutex m_dataMutex;
   std::condition_variable m_dataCV;
 
@@ -33,12 +87,40 @@ private:
   size_t m_readIdx = 0;
   size_t m_lastReadSize = 0;
   size_t m_lastWriteSize = 0;
+  size_t m_peeked = 0;
+
+  // Single producer/single consumer state.  The indices count bytes since the buffer was last cleared, and each
+  // is only ever advanced by its own side.  The parked flags are raised by a side that is about to wait on
+  // m_dataCV, so that the other side knows it has to notify.
+  std::atomic<size_t> m_head{ 0 };
+  std::atomic<size_t> m_tail{ 0 };
+  std::atomic<bool> m_readerParked{ false };
+  std::atomic<bool> m_writerParked{ false };
+
+  // Position where Reserve last left the rest of the ring empty so that a reservation would be contiguous.  The
+  // reader skips from here to the start of the ring.
+  std::atomic<size_t> m_wrapIdx{ std::numeric_limits<size_t>::max() };
+
+  // Size of the first span handed out by the last Peek, only touched by the reader
+  size_t m_peekFirst = 0;
 
   size_t readAvailable();
+  size_t writeContiguousUnsafe();
   void resizeUnsafe(size_t newCapacity);
 
   void readUnsafe(void* buffer, size_t size);
   void writeUnsafe(const void* buffer, size_t size);
+
+  std::streamsize readLockFree(void* buffer, size_t size);
+  bool writeLockFree(const void* buffer, size_t size);
+  void wakeParked(const std::atomic<bool>& parked);
+
+  // Waits for data to be available to the reader and fills in the spans where it can be found, returns the
+  // total number of bytes in the spans or zero if the endpoint was closed
+  size_t peekLockFree(Span (&spans)[2]);
+
+  // Advances the reader past nBytes of the data returned by peekLockFree
+  void consumeLockFree(size_t nBytes);
 };
 
 }
@@ -0,0 +1,30 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include "FileDescriptor.h"
+
+#if _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace leap::ipc;
+
+void FileDescriptor::Reset(int fd) {
+  if (m_fd >= 0)
+#if _WIN32
+    _close(m_fd);
+#else
+    ::close(m_fd);
+#endif
+  m_fd = fd;
+}
+
+FileDescriptor FileDescriptor::Duplicate(int fd) {
+#if _WIN32
+  return FileDescriptor{ _dup(fd) };
+#else
+  return FileDescriptor{ ::fcntl(fd, F_DUPFD_CLOEXEC, 0) };
+#endif
+}
@@ -0,0 +1,63 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#pragma once
+
+namespace leap {
+namespace ipc {
+
+/// <summary>
+/// An owned file descriptor, closed when this object is destroyed
+/// </summary>
+class FileDescriptor
+{
+public:
+  explicit FileDescriptor(int fd = -1) :
+    m_fd(fd)
+  {}
+
+  FileDescriptor(FileDescriptor&& rhs) :
+    m_fd(rhs.Release())
+  {}
+
+  ~FileDescriptor(void) {
+    Reset();
+  }
+
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+  FileDescriptor& operator=(FileDescriptor&& rhs) {
+    if (this != &rhs)
+      Reset(rhs.Release());
+    return *this;
+  }
+
+  /// <returns>The descriptor, or -1 if this object is empty</returns>
+  int Get(void) const { return m_fd; }
+
+  /// <summary>
+  /// Gives up ownership of the descriptor without closing it
+  /// </summary>
+  int Release(void) {
+    const int fd = m_fd;
+    m_fd = -1;
+    return fd;
+  }
+
+  /// <summary>
+  /// Closes the current descriptor, if any, and takes ownership of the passed one
+  /// </summary>
+  void Reset(int fd = -1);
+
+  explicit operator bool(void) const { return m_fd >= 0; }
+
+  /// <summary>
+  /// Creates a new descriptor that refers to the same file as the passed one
+  /// </summary>
+  /// <returns>The new descriptor, empty if it could not be created</returns>
+  static FileDescriptor Duplicate(int fd);
+
+private:
+  int m_fd;
+};
+
+}}
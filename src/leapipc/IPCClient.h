@@ -3,6 +3,7 @@
 #include <autowiring/CoreObject.h>
 #include <autowiring/CoreRunnable.h>
 #include <chrono>
+#include <cstddef>
 #include <memory>
 
 namespace leap {
@@ -50,8 +51,37 @@ public:
   /// </summary>
   virtual std::shared_ptr<IPCEndpoint> Connect(std::chrono::microseconds dt) = 0;
 
+  /// <summary>
+  /// Exchanges capabilities with the listener as part of every connection
+  /// </summary>
+  /// <remarks>
+  /// Off by default, in which case the client puts nothing on the wire but its own traffic and connections have
+  /// no capabilities.  A listener that predates the handshake can lose the first message on a channel to it, so
+  /// this must only be enabled against listeners that have enabled it as well.  Where the platform has no
+  /// handshake this has no effect.
+  /// </remarks>
+  void EnableHandshake(bool enable = true) { m_isHandshakeEnabled = enable; }
+
+  /// <summary>
+  /// Requests that connections move their data through shared memory rather than through the socket
+  /// </summary>
+  /// <param name="ringSize">The size of the ring in each direction, in bytes, or zero to disable</param>
+  /// <remarks>
+  /// The rings are negotiated as part of the handshake, see EnableHandshake.  Shared memory is only used where
+  /// the platform supports it and the listener has requested it as well, otherwise the connection falls back to
+  /// the socket.  The returned endpoint behaves identically either way.
+  /// </remarks>
+  void SetSharedMemoryRingSize(size_t ringSize) { m_sharedMemoryRingSize = ringSize; }
+
   // CoreRunnable overrides:
   bool OnStart(void) override { return true; }
+
+protected:
+  // True if connections begin with the capabilities handshake
+  bool m_isHandshakeEnabled = false;
+
+  // Size of the shared memory rings to offer to the listener, zero if disabled
+  size_t m_sharedMemoryRingSize = 0;
 };
 
 }}
\ No newline at end of file
@@ -2,10 +2,12 @@
 #include "stdafx.h"
 #include "IPCClientUnix.h"
 #include "IPCEndpointUnix.h"
+#include "IPCHandshakeUnix.h"
 #include <autowiring/autowiring.h>
 #include <autowiring/ContextEnumerator.h>
 #include <algorithm>
 
+#include <sys/socket.h>
 #include <unistd.h>
 #if USE_NETWORK_SOCKETS
 #include <arpa/inet.h>
@@ -50,10 +52,16 @@ std::shared_ptr<IPCEndpoint> IPCClientUnix::Connect(std::chrono::microseconds dt
   while (!ShouldStop()) {
     int socket = ::socket(domain, SOCK_STREAM, 0);
 
-    if (::connect(socket, (struct sockaddr*)&addr, sizeof(addr)) != -1) {
-      if (socket >= 0)
+    if (::connect(socket, (struct sockaddr*)&addr, sizeof(addr)) != -1 && socket >= 0) {
+      // Agree on capabilities with the listener, including shared memory if we want it.  A failed handshake is
+      // handled like a failed connection.
+      auto endpoint =
+        m_isHandshakeEnabled ?
+        IPCHandshakeUnix::Connect(socket, m_sharedMemoryRingSize) :
+        std::make_shared<IPCEndpointUnix>(socket);
+      if (endpoint)
         // Success, break out here
-        return std::make_shared<IPCEndpointUnix>(socket);
+        return endpoint;
     }
 
     // Unsuccessful, kill this socket, we will need to regenerate it
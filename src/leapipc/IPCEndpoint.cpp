@@ -1,10 +1,26 @@
 // Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
 #include "stdafx.h"
 #include "IPCEndpoint.h"
+#include <cstring>
 #include <stdexcept>
 
 using namespace leap::ipc;
 
+#if USE_IPC_COUNTERS
+#define IPC_COUNT(counter, n) ((counter).fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed))
+#define IPC_TIME_BEGIN(name) const auto name = std::chrono::steady_clock::now()
+#define IPC_TIME_END(name, counter) \
+  IPC_COUNT(counter, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - name).count())
+#define IPC_COUNT_SENT(handler, nFrames, nBytes, isEndOfMessage) CountSent(handler, nFrames, nBytes, isEndOfMessage)
+#define IPC_COUNT_RECEIVED(handler, nBytes, isEndOfMessage) CountReceived(handler, nBytes, isEndOfMessage)
+#else
+#define IPC_COUNT(counter, n) ((void)0)
+#define IPC_TIME_BEGIN(name) ((void)0)
+#define IPC_TIME_END(name, counter) ((void)0)
+#define IPC_COUNT_SENT(handler, nFrames, nBytes, isEndOfMessage) ((void)0)
+#define IPC_COUNT_RECEIVED(handler, nBytes, isEndOfMessage) ((void)0)
+#endif
+
 //
 // IPCEndpoint::Channel
 //
@@ -23,11 +39,27 @@ IPCEndpoint::Channel::~Channel()
 }
 
 MessageBuffers::Buffers IPCEndpoint::Channel::ReadMessageBuffers() {
-  return m_endpoint->ReadMessageBuffers(m_channel);
+  return m_endpoint->ReadMessageBuffers(m_channel, nullptr);
 }
 
 bool IPCEndpoint::Channel::WriteMessageBuffers(const MessageBuffers::Buffers& messageBuffers) {
-  return m_endpoint->WriteMessageBuffers(m_channel, messageBuffers);
+  return m_endpoint->WriteMessageBuffers(m_channel, messageBuffers, nullptr, 0);
+}
+
+MessageBuffers::Buffers IPCEndpoint::Channel::ReadMessageBuffers(std::vector<FileDescriptor>& fds) {
+  return m_endpoint->ReadMessageBuffers(m_channel, &fds);
+}
+
+bool IPCEndpoint::Channel::WriteMessageBuffers(const MessageBuffers::Buffers& messageBuffers, const std::vector<int>& fds) {
+  return m_endpoint->WriteMessageBuffers(m_channel, messageBuffers, fds.data(), fds.size());
+}
+
+MessageBuffers::SharedBuffer IPCEndpoint::Channel::ReadMessage(size_t sizeHint) {
+  return m_endpoint->ReadMessage(m_channel, sizeHint, nullptr);
+}
+
+MessageBuffers::SharedBuffer IPCEndpoint::Channel::ReadMessage(std::vector<FileDescriptor>& fds, size_t sizeHint) {
+  return m_endpoint->ReadMessage(m_channel, sizeHint, &fds);
 }
 
 std::streamsize IPCEndpoint::Channel::Read(void* buffer, std::streamsize size) {
@@ -35,7 +67,19 @@ std::streamsize IPCEndpoint::Channel::Read(void* buffer, std::streamsize size) {
 }
 
 bool IPCEndpoint::Channel::Write(const void* pBuf, std::streamsize nBytes) {
-  return m_endpoint->Write(m_channel, pBuf, nBytes, false);
+  if (!m_writeBuffer)
+    return m_endpoint->Write(m_channel, pBuf, nBytes, false);
+
+  const size_t n = static_cast<size_t>(nBytes);
+  if (m_nWriteBuffered + n > m_writeBuffer->Size()) {
+    if (!FlushWrites(false))
+      return false;
+    if (n > m_writeBuffer->Size())
+      return m_endpoint->Write(m_channel, pBuf, nBytes, false);
+  }
+  memcpy(m_writeBuffer->Data() + m_nWriteBuffered, pBuf, n);
+  m_nWriteBuffered += n;
+  return true;
 }
 
 std::streamsize IPCEndpoint::Channel::Skip(std::streamsize count) {
@@ -47,9 +91,31 @@ void IPCEndpoint::Channel::ReadMessageComplete() {
 }
 
 bool IPCEndpoint::Channel::WriteMessageComplete() {
+  if (m_nWriteBuffered)
+    // The buffered bytes and the end of the message go out as one frame
+    return FlushWrites(true);
   return m_endpoint->WriteMessageComplete(m_channel);
 }
 
+void IPCEndpoint::Channel::SetWriteBuffering(size_t threshold) {
+  FlushWrites(false);
+  m_writeBuffer.reset();
+  if (!threshold)
+    return;
+
+  m_writeBuffer = m_endpoint->m_sharedBufferPool ?
+                  m_endpoint->m_sharedBufferPool->Get(threshold) :
+                  MessageBuffers::MakeBuffer(threshold);
+}
+
+bool IPCEndpoint::Channel::FlushWrites(bool isComplete) {
+  if (!m_nWriteBuffered)
+    return true;
+  const size_t n = m_nWriteBuffered;
+  m_nWriteBuffered = 0;
+  return m_endpoint->Write(m_channel, m_writeBuffer->Data(), static_cast<std::streamsize>(n), isComplete);
+}
+
 //
 // IPCEndpoint
 //
@@ -58,26 +124,46 @@ IPCEndpoint::IPCEndpoint(void) :
   m_blockSize{ 0x7FFFFFFF },
   m_drain(DRAIN_SIZE, 0)
 {
-  for (uint32_t channel = 0; channel < Header::NUMBER_OF_CHANNELS; channel++) {
-    auto& handler = m_handler[channel];
-    handler.pending = false;
-    handler.reading = false;
-    handler.writing = false;
-    handler.eom = true;
-  }
 }
 
-IPCEndpoint::~IPCEndpoint(void) {}
+IPCEndpoint::~IPCEndpoint(void) {
+  if (!m_asyncWriter.joinable())
+    return;
+
+  StopAsyncSend();
+  if (m_asyncWriter.get_id() == std::this_thread::get_id())
+    // The writer held the last reference, and only returns once it finds the endpoint gone
+    m_asyncWriter.detach();
+  else
+    m_asyncWriter.join();
+}
+
+IPCEndpoint::Handlers& IPCEndpoint::Handler(uint32_t channel) {
+  if (channel < Header::NUMBER_OF_CHANNELS)
+    return m_handler[channel];
+
+  std::lock_guard<std::mutex> lock(m_pendingMutex);
+  return m_extendedHandlers[channel];
+}
+
+IPCEndpoint::Handlers& IPCEndpoint::HandlerUnsafe(uint32_t channel) {
+  if (channel < Header::NUMBER_OF_CHANNELS)
+    return m_handler[channel];
+  return m_extendedHandlers[channel];
+}
 
 std::unique_ptr<IPCEndpoint::Channel> IPCEndpoint::AcquireChannel(uint32_t channel, Channel::Mode mode) {
-  if (channel >= Header::NUMBER_OF_CHANNELS)
+  if (channel > Header::MAX_CHANNEL)
+    return nullptr;
+  if (channel >= Header::NUMBER_OF_CHANNELS && !HasCapability(CAPABILITY_EXTENDED_CHANNELS))
+    // An older peer would take the frames for traffic on one of the base channels
     return nullptr;
 
   // Verify we aren't already checked out:
   std::lock_guard<std::mutex> lock(m_pendingMutex);
 
   // Decide what to do based on the mode, and do a permissions check so we don't check out a handler twice
-  auto& handler = m_handler[channel];
+  auto& handler = HandlerUnsafe(channel);
   switch (mode) {
   case Channel::READ_ONLY:
     if (handler.pending || handler.reading)
@@ -108,46 +194,75 @@ std::unique_ptr<IPCEndpoint::Channel> IPCEndpoint::AcquireChannel(uint32_t chann
 }
 
 void IPCEndpoint::ReleaseChannel(uint32_t channel, Channel::Mode mode) {
-  if (channel >= Header::NUMBER_OF_CHANNELS) {
+  if (channel > Header::MAX_CHANNEL) {
     return;
   }
-  std::lock_guard<std::mutex> lock(m_pendingMutex);
-  auto& handler = m_handler[channel];
-  switch (mode) {
-  case Channel::WRITE_ONLY:
-    handler.writing = false;
-    break;
-  case Channel::READ_ONLY:
-    handler.reading = false;
-    handler.pending = false;
-    break;
-  case Channel::READ_WRITE:
-    handler.writing = false;
-    handler.reading = false;
-    handler.pending = false;
-    break;
+  {
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    auto& handler = HandlerUnsafe(channel);
+    switch (mode) {
+    case Channel::WRITE_ONLY:
+      handler.writing = false;
+      return;
+    case Channel::READ_ONLY:
+      handler.reading = false;
+      handler.pending = false;
+      break;
+    case Channel::READ_WRITE:
+      handler.writing = false;
+      handler.reading = false;
+      handler.pending = false;
+      break;
+    }
   }
+
+  if (m_readAheadLimit) {
+    // Nobody is left to read what was queued, and the receiver may be waiting for room in this queue.  The
+    // receive lock is never held across a blocking read in this mode.
+    std::lock_guard<std::mutex> lock(m_recvMutex);
+    auto& handler = Handler(channel);
+    handler.queue.clear();
+    handler.queuedBytes = 0;
+    handler.fds.clear();
+    m_recvCondition.notify_all();
+    return;
+  }
+
+  // Any payload that was waiting for this reader must now be drained by someone else.  If the receive lock is
+  // busy, its holder is reading and will wake everyone when it reaches the next header.
+  std::unique_lock<std::mutex> lock(m_recvMutex, std::try_to_lock);
+  m_recvCondition.notify_all();
 }
 
 void IPCEndpoint::HandlePendingUnsafe() {
   bool hasPending = false;
-  std::lock_guard<std::mutex> pendingLock(m_pendingMutex);
-  for (uint32_t channel = 0; channel < Header::NUMBER_OF_CHANNELS; channel++) {
-    if (m_handler[channel].pending) {
+  auto promote = [&hasPending](Handlers& handler) {
+    if (handler.pending) {
       // Channel must be in the EOM state when we move it to an actual handler
-      if (m_handler[channel].eom) {
-        m_handler[channel].reading = true;
-        m_handler[channel].pending = false;
-        m_handler[channel].eom = false;
+      if (handler.eom) {
+        handler.reading = true;
+        handler.pending = false;
+        handler.eom = false;
+        handler.fds.clear();
       } else {
         hasPending = true; // We still have pending handlers
       }
     }
-  }
+  };
+
+  std::lock_guard<std::mutex> pendingLock(m_pendingMutex);
+  for (auto& handler : m_handler)
+    promote(handler);
+  for (auto& entry : m_extendedHandlers)
+    promote(entry.second);
   m_hasPending = hasPending;
 }
 
-std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsize size, MessageBuffers::SharedBuffer* sharedBuffer) {
+std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsize size, MessageBuffers::SharedBuffer* sharedBuffer, bool isWholeMessage) {
+  if (m_readAheadLimit) {
+    return ReadQueued(channel, buffer, size, sharedBuffer, isWholeMessage);
+  }
+
   uint8_t* data = reinterpret_cast<uint8_t*>(buffer);
   std::streamsize nRemaining = size;
 
@@ -160,11 +275,15 @@ std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsiz
     HandlePendingUnsafe();
   }
 
-  while (!m_handler[channel].eom && nRemaining > 0) {
+  auto& handler = Handler(channel);
+  while (!handler.eom && nRemaining > 0) {
+    IPC_TIME_BEGIN(lockStart);
     std::unique_lock<std::mutex> lock(m_recvMutex);
+    IPC_TIME_END(lockStart, m_counters.recvLockWait);
 
     if (m_recvMessage.isProcessingHeader) { // Process Header
       while (m_recvMessage.position < sizeof(Header)) {
+        IPC_COUNT(m_counters.readCalls, 1);
         std::streamsize length = ReadRaw((uint8_t*)&m_recvMessage.header + m_recvMessage.position,
                              m_recvMessage.length - m_recvMessage.position);
         if (length <= 0) {
@@ -176,27 +295,37 @@ std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsiz
       if (!m_recvMessage.header.Validate()) {
         throw std::runtime_error("Received invalid message header");
       }
-      // Skip any extra header content
+      // Extra header content holds extensions
+      FrameExtensions extensions;
       const uint32_t headerLength = m_recvMessage.header.Size();
       if (headerLength > sizeof(Header)) {
-        const int skipBytes = static_cast<int>(headerLength - sizeof(Header));
-        if (ReadRaw(m_drain.data(), skipBytes) != skipBytes) {
+        const size_t nExtensions = headerLength - sizeof(Header);
+        if (!ReadRawN(m_recvExtensions, nExtensions)) {
           Close(Reason::ReadFailure);
           return -1;
         }
+        ParseExtensions(m_recvExtensions, nExtensions, extensions);
+        ClaimDescriptors(extensions, m_recvMessage.fds);
       }
+      m_recvMessage.channel = ResolveChannel(m_recvMessage.header, extensions);
       if (m_hasPending) {
         HandlePendingUnsafe();
       }
-      const uint32_t messageChannel = m_recvMessage.header.Channel();
-      const bool hasHandler = m_handler[messageChannel].reading;
+      const uint32_t messageChannel = m_recvMessage.channel;
+      auto& messageHandler = Handler(messageChannel);
+      const bool hasHandler = messageHandler.reading;
+      if (hasHandler && extensions.hasTimestamp)
+        messageHandler.recvTimestamp = extensions.timestamp;
+      if (hasHandler && extensions.messageLength)
+        messageHandler.recvMessageLength = extensions.messageLength;
+      IPC_COUNT_RECEIVED(messageHandler, headerLength + m_recvMessage.header.PayloadSize(), m_recvMessage.header.IsEndOfMessage());
 
-      // This is an EOM marker
-      if (m_recvMessage.header.IsEndOfMessage()) {
-        m_handler[messageChannel].eom = true;
-      } else if (!hasHandler) {
-        // Only if there isn't a handler for a channel will we reset the EOM state
-        m_handler[messageChannel].eom = false;
+      // Only if there isn't a handler for a channel will we update the EOM state here.  A channel that is being
+      // read reaches the end of its message once the payload of this frame has been consumed, and its reader may
+      // not be the one that took the header.  Handshake frames left over from the connection are empty and
+      // don't end anything, but they mustn't leave the channel looking like it is in the middle of a message.
+      if (!hasHandler && !extensions.isHandshake) {
+        messageHandler.eom = m_recvMessage.header.IsEndOfMessage();
       }
 
       // Done with header, now handle the payload
@@ -207,11 +336,19 @@ std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsiz
         m_recvCondition.notify_all();
         continue;
       }
-    } else if (m_handler[m_recvMessage.header.Channel()].reading) { // Is there a handler for this channel?
+    } else if (Handler(m_recvMessage.channel).reading) { // Is there a handler for this channel?
+      IPC_TIME_BEGIN(waitStart);
       m_recvCondition.wait(lock, [this, channel] {
-        const uint32_t messageChannel = m_recvMessage.header.Channel();
-        return (messageChannel == channel && m_handler[messageChannel].reading) || m_isClosed;
+        // Wake up when the payload is ours, when it has been consumed and the next header is up for grabs, or
+        // when the reader it was destined for has gone away and it has to be drained
+        const uint32_t messageChannel = m_recvMessage.channel;
+        return
+          m_recvMessage.isProcessingHeader ||
+          messageChannel == channel ||
+          !Handler(messageChannel).reading ||
+          m_isClosed;
       });
+      IPC_TIME_END(waitStart, m_counters.recvConditionWait);
       if (m_isClosed) {
         m_recvCondition.notify_all(); // Inform any remaining readers that the endpoint has been closed
         return -1;
@@ -221,14 +358,22 @@ std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsiz
       }
     }
     // Process Payload
-    const uint32_t messageChannel = m_recvMessage.header.Channel();
-    if (messageChannel == channel && m_handler[messageChannel].reading) {
+    const uint32_t messageChannel = m_recvMessage.channel;
+    if (messageChannel == channel && handler.reading) {
+      auto& fds = handler.fds;
+      for (auto& fd : m_recvMessage.fds)
+        fds.push_back(std::move(fd));
+      m_recvMessage.fds.clear();
+
       std::streamsize available = std::min<std::streamsize>(nRemaining, m_recvMessage.length - m_recvMessage.position);
       if (data == nullptr && available > 0) {
         if (sharedBuffer) {
+          const size_t nAllocate = isWholeMessage ?
+                                   std::max<size_t>((size_t)available, AnnouncedLength(handler, (size_t)available)) : (size_t)available;
           auto sb = m_sharedBufferPool ?
-                    m_sharedBufferPool->Get((size_t)available) : std::make_shared<MessageBuffers::Buffer>((size_t)available);
+                    m_sharedBufferPool->Get(nAllocate) : MessageBuffers::MakeBuffer(nAllocate);
           if (sb) {
+            sb->Resize((size_t)available);
             data = sb->Data();
             if (data) {
               *sharedBuffer = sb;
@@ -241,6 +386,7 @@ std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsiz
         }
       }
       while (available > 0) {
+        IPC_COUNT(m_counters.readCalls, 1);
         const std::streamsize length = ReadRaw(data, available);
         if (length <= 0) {
           Close(Reason::ReadFailure);
@@ -255,18 +401,24 @@ std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsiz
       // If there isn't a handler, then we will just drain the data
       std::streamsize available = m_recvMessage.length - m_recvMessage.position;
       while (available > 0) {
+        IPC_COUNT(m_counters.readCalls, 1);
         const std::streamsize length = ReadRaw(m_drain.data(), std::min<std::streamsize>(static_cast<uint32_t>(m_drain.size()), available));
         if (length <= 0) {
           Close(Reason::ReadFailure);
           return -1;
         }
+        IPC_COUNT(m_counters.bytesDrained, length);
         available -= length;
         m_recvMessage.position += static_cast<uint32_t>(length);
       }
     }
     // If we have reached the end of the payload, get ready for the next header
     if (m_recvMessage.length == m_recvMessage.position) {
+      if (m_recvMessage.header.IsEndOfMessage()) {
+        Handler(m_recvMessage.channel).eom = true;
+      }
       m_recvMessage.BeginHeader();
+      m_recvCondition.notify_all(); // Readers waiting on this payload may now read the next header
     }
     if (m_hasPending) {
       HandlePendingUnsafe();
@@ -275,10 +427,177 @@ std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsiz
   return size - nRemaining;
 }
 
-MessageBuffers::Buffers IPCEndpoint::ReadMessageBuffers(uint32_t channel) {
+std::streamsize IPCEndpoint::ReadQueued(uint32_t channel, void* buffer, std::streamsize size, MessageBuffers::SharedBuffer* sharedBuffer, bool isWholeMessage) {
+  uint8_t* data = reinterpret_cast<uint8_t*>(buffer);
+  std::streamsize nRemaining = size;
+  auto& handler = Handler(channel);
+
+  IPC_TIME_BEGIN(lockStart);
+  std::unique_lock<std::mutex> lock(m_recvMutex);
+  IPC_TIME_END(lockStart, m_counters.recvLockWait);
+  if (m_hasPending) {
+    HandlePendingUnsafe();
+  }
+
+  while (!handler.eom && nRemaining > 0) {
+    if (handler.queue.empty()) {
+      if (m_isClosed) {
+        m_recvCondition.notify_all(); // Inform any remaining readers that the endpoint has been closed
+        return -1;
+      }
+      if (m_isPumping) {
+        // Someone else is receiving, they will wake us when they have filed their frame
+        IPC_TIME_BEGIN(waitStart);
+        m_recvCondition.wait(lock);
+        IPC_TIME_END(waitStart, m_counters.recvConditionWait);
+      } else if (!PumpFrame(lock)) {
+        return -1;
+      }
+      continue;
+    }
+
+    auto& frame = handler.queue.front();
+    for (auto& fd : frame.fds)
+      handler.fds.push_back(std::move(fd));
+    frame.fds.clear();
+    if (frame.timestamp) {
+      handler.recvTimestamp = frame.timestamp;
+      frame.timestamp = 0;
+    }
+    if (frame.messageLength) {
+      handler.recvMessageLength = frame.messageLength;
+      frame.messageLength = 0;
+    }
+
+    std::streamsize available = std::min<std::streamsize>(nRemaining, frame.length - frame.position);
+    if (data == nullptr && available > 0) {
+      if (!sharedBuffer) {
+        throw std::exception(); // We are in big trouble if we still have a null pointer
+      }
+      nRemaining = size = available;
+      const size_t nAllocate = isWholeMessage ?
+                               std::max<size_t>((size_t)available, AnnouncedLength(handler, (size_t)available)) : (size_t)available;
+      if (frame.position == 0 && available == frame.length && nAllocate == (size_t)available) {
+        // The caller wants the whole frame and nothing more, hand over the buffer it was received into
+        *sharedBuffer = frame.payload;
+        frame.position = frame.length;
+        nRemaining = available = 0;
+      } else {
+        auto sb = m_sharedBufferPool ?
+                  m_sharedBufferPool->Get(nAllocate) : MessageBuffers::MakeBuffer(nAllocate);
+        if (!sb || !sb->Data()) {
+          throw std::exception();
+        }
+        sb->Resize((size_t)available);
+        data = sb->Data();
+        *sharedBuffer = sb;
+      }
+    }
+    if (available > 0) {
+      memcpy(data, frame.payload->Data() + frame.position, static_cast<size_t>(available));
+      data += available;
+      frame.position += static_cast<uint32_t>(available);
+      nRemaining -= available;
+    }
+
+    if (frame.position == frame.length) {
+      if (frame.eom) {
+        handler.eom = true;
+      }
+      handler.queuedBytes -= frame.length;
+      handler.queue.pop_front();
+      m_recvCondition.notify_all(); // The receiver may be waiting for room in this queue
+    }
+  }
+  return size - nRemaining;
+}
+
+bool IPCEndpoint::PumpFrame(std::unique_lock<std::mutex>& lock) {
+  // Nobody else touches the stream while we are receiving, so the lock can be let go
+  m_isPumping = true;
+  lock.unlock();
+
+  Header header;
+  FrameExtensions extensions;
+  QueuedFrame frame;
+  bool received = ReadRawN(&header, sizeof(header));
+  if (received && !header.Validate()) {
+    Close(Reason::StreamIntegrityViolation);
+    received = false;
+  }
+  if (received && header.Size() > sizeof(Header)) {
+    const size_t nExtensions = header.Size() - sizeof(Header);
+    received = ReadRawN(m_recvExtensions, nExtensions);
+    if (received) {
+      ParseExtensions(m_recvExtensions, nExtensions, extensions);
+      ClaimDescriptors(extensions, frame.fds);
+    }
+  }
+  if (received && header.PayloadSize()) {
+    frame.length = header.PayloadSize();
+    frame.payload = m_sharedBufferPool ?
+                    m_sharedBufferPool->Get(frame.length) :
+                    MessageBuffers::MakeBuffer(frame.length);
+    received = frame.payload && ReadRawN(frame.payload->Data(), frame.length);
+  }
+  frame.eom = header.IsEndOfMessage();
+  if (extensions.hasTimestamp)
+    frame.timestamp = extensions.timestamp;
+  frame.messageLength = extensions.messageLength;
+
+  lock.lock();
+  if (!received) {
+    m_isPumping = false;
+    Close(Reason::ReadFailure);
+    return false;
+  }
+
+  if (extensions.isHandshake) {
+    // Left over from the connection handshake, it isn't anyone's traffic
+    m_isPumping = false;
+    m_recvCondition.notify_all();
+    return true;
+  }
+
+  if (m_hasPending) {
+    HandlePendingUnsafe();
+  }
+  auto& target = Handler(ResolveChannel(header, extensions));
+  IPC_COUNT_RECEIVED(target, header.Size() + frame.length, frame.eom);
+
+  // Hold the frame, and with it the rest of the stream, until its reader has room for it.  Our own queue is
+  // always empty here, so we never wait on ourselves.
+  IPC_TIME_BEGIN(waitStart);
+  m_recvCondition.wait(lock, [this, &target, &frame] {
+    return
+      !target.reading ||
+      target.queue.empty() ||
+      target.queuedBytes + frame.length <= m_readAheadLimit ||
+      m_isClosed;
+  });
+  IPC_TIME_END(waitStart, m_counters.recvConditionWait);
+
+  if (target.reading) {
+    target.queuedBytes += frame.length;
+    target.queue.push_back(std::move(frame));
+  } else {
+    // Nobody to give it to.  Track message boundaries so that a pending reader starts on one.
+    IPC_COUNT(m_counters.bytesDrained, frame.length);
+    target.eom = frame.eom;
+    if (m_hasPending) {
+      HandlePendingUnsafe();
+    }
+  }
+  m_isPumping = false;
+  m_recvCondition.notify_all();
+  return true;
+}
+
+MessageBuffers::Buffers IPCEndpoint::ReadMessageBuffers(uint32_t channel, std::vector<FileDescriptor>* fds) {
   MessageBuffers::Buffers messageBuffers;
   MessageBuffers::SharedBuffer sharedBuffer;
   std::streamsize n;
+  auto& handler = Handler(channel);
 
   while ((n = Read(channel, nullptr, m_blockSize, &sharedBuffer)) >= 0) {
     if (sharedBuffer) {
@@ -289,38 +608,217 @@ MessageBuffers::Buffers IPCEndpoint::ReadMessageBuffers(uint32_t channel) {
         throw std::exception();
       }
     }
-    if (m_handler[channel].eom) {
+    if (handler.eom) {
       break;
     }
   }
-  if (m_isClosed && !m_handler[channel].eom) {
+  if (m_isClosed && !handler.eom) {
     // If we didn't receive a complete message and we are closed, drop the partial message
+    handler.fds.clear();
+    handler.recvTimestamp = 0;
+    handler.recvMessageLength = 0;
     return MessageBuffers::Buffers();
   }
-  m_handler[channel].eom = false;
+  if (fds)
+    *fds = std::move(handler.fds);
+  handler.fds.clear();
+  handler.eom = false;
+  handler.recvMessageLength = 0;
+  RecordLatency(channel, handler);
   return messageBuffers;
 }
 
-bool IPCEndpoint::WriteMessageBuffers(uint32_t channel, const MessageBuffers::Buffers& messageBuffers) {
-  if (messageBuffers.empty()) {
+MessageBuffers::SharedBuffer IPCEndpoint::ReadMessage(uint32_t channel, size_t sizeHint, std::vector<FileDescriptor>* fds) {
+  MessageBuffers::SharedBuffer message;
+  size_t nBytes = 0;
+  auto& handler = Handler(channel);
+
+  if (sizeHint) {
+    message = m_sharedBufferPool ? m_sharedBufferPool->Get(sizeHint) : MessageBuffers::MakeBuffer(sizeHint);
+  }
+  for (;;) {
+    std::streamsize n;
+    if (!message) {
+      // Without a hint, the first fragment decides how much to start with.  With read-ahead, a message that fits
+      // in a single fragment is handed over in the buffer it was received into.
+      n = Read(channel, nullptr, m_blockSize, &message, true);
+    } else {
+      if (nBytes == message->Size()) {
+        // Use up whatever the buffer was rounded up to before moving it
+        message->Resize(message->AllocatedSize());
+      }
+      if (nBytes == message->Size()) {
+        // Out of room, move to a buffer big enough for what the sender announced, or else twice the size
+        const size_t announced = AnnouncedLength(handler, nBytes);
+        const size_t size = announced ? announced : std::max<size_t>(2 * nBytes, 64);
+        auto grown = m_sharedBufferPool ? m_sharedBufferPool->Get(size) : MessageBuffers::MakeBuffer(size);
+        memcpy(grown->Data(), message->Data(), nBytes);
+        message = std::move(grown);
+      }
+      n = Read(channel, message->Data() + nBytes, static_cast<std::streamsize>(message->Size() - nBytes));
+    }
+    if (n < 0) {
+      break;
+    }
+    nBytes += static_cast<size_t>(n);
+    if (handler.eom) {
+      break;
+    }
+  }
+  if (m_isClosed && !handler.eom) {
+    // If we didn't receive a complete message and we are closed, drop the partial message
+    handler.fds.clear();
+    handler.recvTimestamp = 0;
+    handler.recvMessageLength = 0;
+    return nullptr;
+  }
+  if (!message) {
+    message = MessageBuffers::MakeBuffer(0);
+  }
+  message->Resize(nBytes);
+  if (fds)
+    *fds = std::move(handler.fds);
+  handler.fds.clear();
+  handler.eom = false;
+  handler.recvMessageLength = 0;
+  RecordLatency(channel, handler);
+  return message;
+}
+
+bool IPCEndpoint::WriteMessageBuffers(uint32_t channel, const MessageBuffers::Buffers& messageBuffers, const int* fds, size_t nFds) {
+  if (messageBuffers.empty() && !nFds) {
     return false;
   }
-  for (size_t i = 0; i < messageBuffers.size(); i++) {
-    const auto& sharedBuffer = messageBuffers[i];
-    if (!sharedBuffer) {
-      continue;
+  if (nFds && !HasCapability(CAPABILITY_FILE_DESCRIPTORS)) {
+    // Refused before anything is written, the connection is still good
+    return false;
+  }
+  if (m_async) {
+    return EnqueueMessage(channel, messageBuffers, fds, nFds);
+  }
+  return SendMessage(channel, messageBuffers, fds, nFds, 0);
+}
+
+bool IPCEndpoint::SendMessage(uint32_t channel, const MessageBuffers::Buffers& messageBuffers, const int* fds, size_t nFds, uint64_t timestamp) {
+  if (nFds > MAX_DESCRIPTORS) {
+    return false;
+  }
+  if (m_isClosed) {
+    return false;
+  }
+
+  auto& handler = Handler(channel);
+  const size_t fragmentSize = m_maxFragmentSize;
+  const uint64_t maxPayload =
+    fragmentSize - sizeof(Header) -
+    sizeof(handler.sendChannelExtension) - sizeof(handler.sendDescriptorExtension) - sizeof(handler.sendTimestampExtension) -
+    sizeof(handler.sendMessageLengthExtension);
+
+  // Count the frames up front, the header array must not reallocate once the gather list points into it
+  size_t nFrames = 0;
+  uint64_t messageLength = 0;
+  for (const auto& sharedBuffer : messageBuffers) {
+    if (sharedBuffer && sharedBuffer->Data() && sharedBuffer->Size()) {
+      nFrames += static_cast<size_t>((sharedBuffer->Size() + maxPayload - 1) / maxPayload);
+      messageLength += sharedBuffer->Size();
+    }
+  }
+  handler.sendHeaders.resize(std::max<size_t>(nFrames, 1));
+  handler.sendBuffers.clear();
+  handler.sendFrames.clear();
+
+  if (nFds) {
+    handler.sendDescriptorExtension[0] = Header::EXTENSION_FILE_DESCRIPTORS;
+    handler.sendDescriptorExtension[1] = 1;
+    handler.sendDescriptorExtension[2] = static_cast<uint8_t>(nFds);
+  }
+  if (!m_sendTimestamps) {
+    timestamp = 0;
+  } else {
+    if (!timestamp)
+      timestamp = Timestamp();
+    WriteTimestampExtension(handler.sendTimestampExtension, timestamp);
+  }
+
+  // The first frame tells the receiver how much is coming, when it isn't the whole message by itself
+  const bool sendMessageLength = m_sendMessageLengths && nFrames > 1;
+  if (sendMessageLength)
+    WriteMessageLengthExtension(handler.sendMessageLengthExtension, messageLength);
+
+  size_t iFrame = 0;
+  auto addFrame = [&](const uint8_t* data, uint64_t nBytes) {
+    Header& header = handler.sendHeaders[iFrame];
+    header.ClearEndOfMessage();
+    header.SetPayloadSize(static_cast<uint32_t>(nBytes));
+
+    ConstBuffer frameHeader[2];
+    const size_t nFrameHeader = AddressFrame(header, channel, handler.sendChannelExtension, frameHeader);
+    handler.sendBuffers.insert(handler.sendBuffers.end(), frameHeader, frameHeader + nFrameHeader);
+    if (!iFrame && nFds) {
+      // Descriptors are announced by the first frame, and travel with its first byte
+      header.size += sizeof(handler.sendDescriptorExtension);
+      handler.sendBuffers.push_back({ handler.sendDescriptorExtension, sizeof(handler.sendDescriptorExtension) });
+    }
+    if (!iFrame && timestamp) {
+      header.size += sizeof(handler.sendTimestampExtension);
+      handler.sendBuffers.push_back({ handler.sendTimestampExtension, sizeof(handler.sendTimestampExtension) });
+    }
+    if (!iFrame && sendMessageLength) {
+      header.size += sizeof(handler.sendMessageLengthExtension);
+      handler.sendBuffers.push_back({ handler.sendMessageLengthExtension, sizeof(handler.sendMessageLengthExtension) });
     }
-    const auto buffer = sharedBuffer->Data();
-    const auto size = sharedBuffer->Size();
+    if (nBytes)
+      handler.sendBuffers.push_back({ data, static_cast<std::streamsize>(nBytes) });
+    handler.sendFrames.emplace_back(handler.sendBuffers.size(), static_cast<size_t>(header.Size() + nBytes));
+    iFrame++;
+  };
 
-    if (!buffer || size <= 0) {
+  for (const auto& sharedBuffer : messageBuffers) {
+    if (!sharedBuffer || !sharedBuffer->Data()) {
       continue;
     }
-    if (!Write(channel, buffer, static_cast<uint32_t>(size), i == messageBuffers.size() - 1)) { // Failed to write, must be closed
+    const uint8_t* data = sharedBuffer->Data();
+    uint64_t nRemaining = sharedBuffer->Size();
+
+    while (nRemaining > 0) {
+      const uint64_t available = std::min<uint64_t>(nRemaining, maxPayload);
+      addFrame(data, available);
+      data += available;
+      nRemaining -= available;
+    }
+  }
+
+  // The last fragment carries the EOM bit itself, so no trailing zero-length frame is needed.  A message
+  // that turned out to have no payload at all is sent as a lone EOM marker.
+  if (!nFrames)
+    addFrame(nullptr, 0);
+  handler.sendHeaders.back().SetEndOfMessage();
+
+  // Each turn on the wire sends as many whole frames as fit in one fragment, and always at least one
+  size_t iBuffer = 0;
+  for (size_t iFirst = 0, iNext; iFirst < handler.sendFrames.size(); iFirst = iNext) {
+    size_t nBytes = handler.sendFrames[iFirst].second;
+    size_t end = handler.sendFrames[iFirst].first;
+    for (iNext = iFirst + 1; iNext < handler.sendFrames.size() && nBytes + handler.sendFrames[iNext].second <= fragmentSize; iNext++) {
+      nBytes += handler.sendFrames[iNext].second;
+      end = handler.sendFrames[iNext].first;
+    }
+
+    if (!AcquireSendTurn(handler))
+      return false;
+    IPC_COUNT(m_counters.writeCalls, 1);
+    const bool sent = WriteRawFds(handler.sendBuffers.data() + iBuffer, end - iBuffer, fds, nFds);
+    ReleaseSendTurn();
+    if (!sent) {
+      Close(Reason::WriteFailure);
       return false;
     }
+    IPC_COUNT_SENT(handler, iNext - iFirst, nBytes, iNext == handler.sendFrames.size());
+    iBuffer = end;
+    fds = nullptr;
+    nFds = 0;
   }
-  return WriteMessageComplete(channel);
+  return true;
 }
 
 std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsize size) {
@@ -330,62 +828,409 @@ std::streamsize IPCEndpoint::Read(uint32_t channel, void* buffer, std::streamsiz
 bool IPCEndpoint::Write(uint32_t channel, const void* pBuf, std::streamsize nBytes, bool isComplete) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(pBuf);
   uint64_t nRemaining = nBytes;
+  auto& handler = Handler(channel);
 
-  while (nRemaining > 0) {
-    std::streamsize available = std::min<std::streamsize>(nRemaining, m_blockSize - sizeof(Header));
+  if (m_async) {
+    // Collected until the message is complete, only whole messages are ever queued.  The message was sent as
+    // far as the caller is concerned once it starts writing it, so that is when it gets stamped.
+    if (m_sendTimestamps && !handler.sendTimestamp)
+      handler.sendTimestamp = Timestamp();
+    if (nBytes > 0) {
+      auto buffer = m_sharedBufferPool ?
+                    m_sharedBufferPool->Get(static_cast<size_t>(nBytes)) :
+                    MessageBuffers::MakeBuffer(static_cast<size_t>(nBytes));
+      if (!buffer) {
+        return false;
+      }
+      memcpy(buffer->Data(), pBuf, static_cast<size_t>(nBytes));
+      handler.asyncBuffers.push_back(std::move(buffer));
+    }
+    if (!isComplete) {
+      return true;
+    }
+    MessageBuffers::Buffers buffers;
+    buffers.swap(handler.asyncBuffers);
+    const uint64_t timestamp = handler.sendTimestamp;
+    handler.sendTimestamp = 0;
+    return EnqueueMessage(channel, std::move(buffers), nullptr, 0, timestamp);
+  }
 
-    std::lock_guard<std::mutex> lock(m_sendMutex);
+  // Every fragment is a separate turn on the wire, so other channels can get a word in between them
+  while (nRemaining > 0) {
+    std::streamsize available = std::min<std::streamsize>(
+      nRemaining,
+      m_maxFragmentSize - sizeof(Header) - sizeof(handler.sendChannelExtension) - sizeof(handler.sendTimestampExtension)
+    );
 
-    if (m_isClosed) {
-      return false;
-    }
     if(isComplete)
-      m_sendHeader.SetEndOfMessage();
+      handler.sendHeader.SetEndOfMessage();
     else
-      m_sendHeader.ClearEndOfMessage();
-    m_sendHeader.SetChannel(channel);
-    m_sendHeader.SetPayloadSize(static_cast<uint32_t>(available));
+      handler.sendHeader.ClearEndOfMessage();
+    handler.sendHeader.SetPayloadSize(static_cast<uint32_t>(available));
 
-    if (!WriteRaw(&m_sendHeader, sizeof(m_sendHeader)) ||
-        !WriteRaw(data, available)) {
+    ConstBuffer buffers[4];
+    size_t count = AddressFrame(handler.sendHeader, channel, handler.sendChannelExtension, buffers);
+    if (m_sendTimestamps && !handler.sendTimestamp) {
+      // Only the first fragment of a message carries the stamp
+      handler.sendTimestamp = Timestamp();
+      WriteTimestampExtension(handler.sendTimestampExtension, handler.sendTimestamp);
+      handler.sendHeader.size += sizeof(handler.sendTimestampExtension);
+      buffers[count++] = { handler.sendTimestampExtension, sizeof(handler.sendTimestampExtension) };
+    }
+    buffers[count++] = { data, available };
+    if (!AcquireSendTurn(handler))
+      return false;
+    IPC_COUNT(m_counters.writeCalls, 1);
+    const bool sent = WriteRawV(buffers, count);
+    ReleaseSendTurn();
+    if (!sent) {
       Close(Reason::WriteFailure);
       return false;
     }
+    IPC_COUNT_SENT(handler, 1, handler.sendHeader.Size() + available, isComplete && nRemaining == static_cast<uint64_t>(available));
     data += available;
     nRemaining -= available;
   }
+  if (isComplete)
+    handler.sendTimestamp = 0;
   return true;
 }
 
 std::streamsize IPCEndpoint::Skip(uint32_t channel, std::streamsize count) {
   // Loop until the number of bytes skipped is the number requested:
   std::streamsize nRemaining = count;
-  while (!m_isClosed && !m_handler[channel].eom && nRemaining > 0)
+  auto& handler = Handler(channel);
+  while (!m_isClosed && !handler.eom && nRemaining > 0)
     nRemaining -= Read(channel, m_drain.data(), std::min<std::streamsize>(static_cast<std::streamsize>(m_drain.size()), nRemaining));
   return count - nRemaining;
 }
 
 void IPCEndpoint::ReadMessageComplete(uint32_t channel) {
-  m_handler[channel].eom = false;
+  auto& handler = Handler(channel);
+  handler.fds.clear();
+  handler.eom = false;
+  handler.recvMessageLength = 0;
+  RecordLatency(channel, handler);
 }
 
 bool IPCEndpoint::WriteMessageComplete(uint32_t channel) {
-  std::lock_guard<std::mutex> lock(m_sendMutex);
+  auto& handler = Handler(channel);
+  if (m_async) {
+    MessageBuffers::Buffers buffers;
+    buffers.swap(handler.asyncBuffers);
+    const uint64_t timestamp = handler.sendTimestamp;
+    handler.sendTimestamp = 0;
+    return EnqueueMessage(channel, std::move(buffers), nullptr, 0, timestamp);
+  }
 
-  m_sendHeader.SetEndOfMessage();
-  m_sendHeader.SetChannel(channel);
-  m_sendHeader.SetPayloadSize(0);
+  handler.sendHeader.SetEndOfMessage();
+  handler.sendHeader.SetPayloadSize(0);
 
-  if (!WriteRaw(&m_sendHeader, sizeof(m_sendHeader))) {
+  ConstBuffer buffers[3];
+  size_t count = AddressFrame(handler.sendHeader, channel, handler.sendChannelExtension, buffers);
+  if (m_sendTimestamps && !handler.sendTimestamp) {
+    WriteTimestampExtension(handler.sendTimestampExtension, Timestamp());
+    handler.sendHeader.size += sizeof(handler.sendTimestampExtension);
+    buffers[count++] = { handler.sendTimestampExtension, sizeof(handler.sendTimestampExtension) };
+  }
+  handler.sendTimestamp = 0;
+  if (!AcquireSendTurn(handler))
+    return false;
+  IPC_COUNT(m_counters.writeCalls, 1);
+  const bool sent = WriteRawV(buffers, count);
+  ReleaseSendTurn();
+  if (!sent) {
     Close(Reason::WriteFailure);
     return false;
   }
+  IPC_COUNT_SENT(handler, 1, handler.sendHeader.Size(), true);
+  return true;
+}
+
+bool IPCEndpoint::AcquireSendTurn(const Handlers& handler) {
+  IPC_TIME_BEGIN(start);
+  std::unique_lock<std::mutex> lock(m_sendMutex);
+  if (m_isClosed)
+    return false;
+  if (!m_isSending) {
+    m_isSending = true;
+    IPC_TIME_END(start, m_counters.sendWait);
+    return true;
+  }
+
+  const uint64_t ticket = m_nextSendTicket++;
+  m_sendQueue.push_back({ ticket, handler.sendPriority });
+  m_sendCondition.wait(lock, [this, ticket] {
+    return m_isClosed || m_sendGranted == ticket;
+  });
+  IPC_TIME_END(start, m_counters.sendWait);
+  return !m_isClosed;
+}
+
+void IPCEndpoint::ReleaseSendTurn(void) {
+  {
+    std::lock_guard<std::mutex> lock(m_sendMutex);
+    if (m_sendQueue.empty()) {
+      m_isSending = false;
+      return;
+    }
+
+    // Highest priority goes first.  Tickets only ever increase, so the first of several waiters with the same
+    // priority is the one that has waited longest, and channels of equal priority take turns.
+    auto next = m_sendQueue.begin();
+    for (auto q = next + 1; q != m_sendQueue.end(); ++q)
+      if (q->priority > next->priority)
+        next = q;
+    m_sendGranted = next->ticket;
+    m_sendQueue.erase(next);
+  }
+  m_sendCondition.notify_all();
+}
+
+void IPCEndpoint::SetChannelPriority(uint32_t channel, int priority) {
+  auto& handler = Handler(channel);
+  std::lock_guard<std::mutex> lock(m_sendMutex);
+  handler.sendPriority = priority;
+}
+
+size_t IPCEndpoint::GetWritersInLine(void) {
+  std::lock_guard<std::mutex> lock(m_sendMutex);
+  return (m_isSending ? 1 : 0) + m_sendQueue.size();
+}
+
+void IPCEndpoint::EnableAsyncSend(size_t capacity, SendOverflow overflow, size_t highWatermark, size_t lowWatermark) {
+  auto async = std::make_shared<AsyncSend>();
+  async->capacity = capacity;
+  async->overflow = overflow;
+  async->highWatermark = highWatermark;
+  async->lowWatermark = lowWatermark;
+  m_async = async;
+  m_asyncWriter = std::thread(&IPCEndpoint::AsyncWriterProc, std::weak_ptr<IPCEndpoint>(shared_from_this()), async);
+  if (m_isClosed)
+    StopAsyncSend();
+}
+
+bool IPCEndpoint::EnqueueMessage(uint32_t channel, MessageBuffers::Buffers buffers, const int* fds, size_t nFds, uint64_t timestamp) {
+  if (nFds > MAX_DESCRIPTORS) {
+    return false;
+  }
+  if (nFds && !HasCapability(CAPABILITY_FILE_DESCRIPTORS)) {
+    // The background writer would only find out once the message is on its way, and close the endpoint
+    return false;
+  }
+
+  if (m_sendTimestamps && !timestamp)
+    timestamp = Timestamp();
+  QueuedMessage message{ channel, std::move(buffers), {}, 0, timestamp };
+  for (const auto& buffer : message.buffers)
+    if (buffer)
+      message.nBytes += buffer->Size();
+
+  // The caller keeps its descriptors, the queue needs its own
+  for (size_t i = 0; i < nFds; i++) {
+    message.fds.push_back(FileDescriptor::Duplicate(fds[i]));
+    if (!message.fds.back())
+      return false;
+  }
+
+  AsyncSend& async = *m_async;
+  bool isChanged = false;
+  {
+    std::unique_lock<std::mutex> lock(async.lock);
+    auto fits = [&async, &message] {
+      return async.queue.empty() || async.queuedBytes + message.nBytes <= async.capacity;
+    };
+    switch (async.overflow) {
+    case SendOverflow::Block:
+      async.condition.wait(lock, [&async, &fits] { return async.isStopped || fits(); });
+      break;
+    case SendOverflow::DropOldest:
+      while (!fits()) {
+        async.queuedBytes -= async.queue.front().nBytes;
+        async.queue.pop_front();
+      }
+      break;
+    case SendOverflow::Fail:
+      if (!fits())
+        return false;
+      break;
+    }
+    if (async.isStopped)
+      return false;
+
+    async.queuedBytes += message.nBytes;
+    async.queue.push_back(std::move(message));
+    isChanged = UpdateWatermark(async);
+  }
+  async.condition.notify_all();
+  if (isChanged)
+    DeliverWatermark(async);
+  return true;
+}
+
+bool IPCEndpoint::UpdateWatermark(AsyncSend& async) {
+  if (!async.highWatermark)
+    return false;
+  if (!async.isHigh && async.queuedBytes >= async.highWatermark)
+    async.isHigh = true;
+  else if (async.isHigh && async.queuedBytes <= async.lowWatermark)
+    // Also reached when DropOldest has discarded enough to make room
+    async.isHigh = false;
+  else
+    return false;
+  return true;
+}
+
+void IPCEndpoint::DeliverWatermark(AsyncSend& async) {
+  std::unique_lock<std::mutex> lock(async.lock);
+  if (async.isDelivering)
+    // The delivering thread checks again once its handlers return
+    return;
+  async.isDelivering = true;
+  while (async.isHighDelivered != async.isHigh) {
+    const bool isHigh = async.isHighDelivered = async.isHigh;
+    lock.unlock();
+    onSendWatermark(isHigh);
+    lock.lock();
+  }
+  async.isDelivering = false;
+}
+
+void IPCEndpoint::StopAsyncSend(void) {
+  std::deque<QueuedMessage> discarded;
+  {
+    std::lock_guard<std::mutex> lock(m_async->lock);
+    m_async->isStopped = true;
+    m_async->queue.swap(discarded);
+    m_async->queuedBytes = 0;
+  }
+  m_async->condition.notify_all();
+}
+
+void IPCEndpoint::AsyncWriterProc(std::weak_ptr<IPCEndpoint> weak, std::shared_ptr<AsyncSend> async) {
+  for (;;) {
+    QueuedMessage message;
+    bool isChanged = false;
+    {
+      std::unique_lock<std::mutex> lock(async->lock);
+      async->condition.wait(lock, [&async] { return async->isStopped || !async->queue.empty(); });
+      if (async->isStopped)
+        return;
+      message = std::move(async->queue.front());
+      async->queue.pop_front();
+      async->queuedBytes -= message.nBytes;
+      isChanged = UpdateWatermark(*async);
+    }
+    async->condition.notify_all(); // Writers may be waiting for room
+
+    const auto self = weak.lock();
+    if (!self)
+      return;
+    if (isChanged)
+      self->DeliverWatermark(*async);
+
+    std::vector<int> fds;
+    for (const auto& fd : message.fds)
+      fds.push_back(fd.Get());
+
+    // A failed send closes the endpoint, which stops the queue
+    self->SendMessage(message.channel, message.buffers, fds.data(), fds.size(), message.timestamp);
+  }
+}
+
+uint32_t IPCEndpoint::SupportedCapabilities(void) const {
+  return CAPABILITY_EXTENDED_CHANNELS | CAPABILITY_TIMESTAMPS | CAPABILITY_MESSAGE_LENGTHS;
+}
+
+uint32_t IPCEndpoint::EnableCapabilities(uint32_t capabilities) {
+  m_capabilities |= capabilities & SupportedCapabilities() & ~CAPABILITY_SHARED_MEMORY;
+  return m_capabilities;
+}
+
+bool IPCEndpoint::CountersEnabled(void) {
+#if USE_IPC_COUNTERS
   return true;
+#else
+  return false;
+#endif
+}
+
+IPCEndpoint::EndpointCounters IPCEndpoint::GetCounters(void) const {
+  EndpointCounters counters;
+#if USE_IPC_COUNTERS
+  m_counters.Snapshot(counters);
+  counters.readCalls = m_counters.readCalls;
+  counters.writeCalls = m_counters.writeCalls;
+  counters.bytesDrained = m_counters.bytesDrained;
+  counters.sendWait = std::chrono::nanoseconds(m_counters.sendWait);
+  counters.recvLockWait = std::chrono::nanoseconds(m_counters.recvLockWait);
+  counters.recvConditionWait = std::chrono::nanoseconds(m_counters.recvConditionWait);
+#endif
+  return counters;
+}
+
+IPCEndpoint::TrafficCounters IPCEndpoint::GetChannelCounters(uint32_t channel) {
+  TrafficCounters counters;
+#if USE_IPC_COUNTERS
+  if (channel <= Header::MAX_CHANNEL)
+    Handler(channel).counters.Snapshot(counters);
+#endif
+  return counters;
+}
+
+#if USE_IPC_COUNTERS
+void IPCEndpoint::LiveTraffic::Snapshot(TrafficCounters& counters) const {
+  counters.framesSent = framesSent;
+  counters.framesReceived = framesReceived;
+  counters.messagesSent = messagesSent;
+  counters.messagesReceived = messagesReceived;
+  counters.bytesSent = bytesSent;
+  counters.bytesReceived = bytesReceived;
+}
+
+void IPCEndpoint::CountSent(Handlers& handler, uint64_t nFrames, uint64_t nBytes, bool isEndOfMessage) {
+  for (LiveTraffic* traffic : { static_cast<LiveTraffic*>(&m_counters), &handler.counters }) {
+    IPC_COUNT(traffic->framesSent, nFrames);
+    IPC_COUNT(traffic->bytesSent, nBytes);
+    if (isEndOfMessage)
+      IPC_COUNT(traffic->messagesSent, 1);
+  }
+}
+
+void IPCEndpoint::CountReceived(Handlers& handler, uint64_t nBytes, bool isEndOfMessage) {
+  for (LiveTraffic* traffic : { static_cast<LiveTraffic*>(&m_counters), &handler.counters }) {
+    IPC_COUNT(traffic->framesReceived, 1);
+    IPC_COUNT(traffic->bytesReceived, nBytes);
+    if (isEndOfMessage)
+      IPC_COUNT(traffic->messagesReceived, 1);
+  }
+}
+#endif
+
+size_t IPCEndpoint::AnnouncedLength(const Handlers& handler, size_t nReceived) const {
+  const uint64_t nBytes = std::min<uint64_t>(handler.recvMessageLength, m_maxAnnouncedLength);
+  return nBytes > nReceived ? static_cast<size_t>(nBytes) : 0;
+}
+
+void IPCEndpoint::SetMaxFragmentSize(size_t nBytes) {
+  m_maxFragmentSize = std::min<size_t>(std::max<size_t>(nBytes, MIN_FRAGMENT_SIZE), m_blockSize);
+}
+
+bool IPCEndpoint::WriteRawV(const ConstBuffer* buffers, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    if (buffers[i].nBytes && !WriteRaw(buffers[i].pBuf, buffers[i].nBytes))
+      return false;
+  return true;
+}
+
+bool IPCEndpoint::WriteRawFds(const ConstBuffer* buffers, size_t count, const int* fds, size_t nFds) {
+  return !nFds && WriteRawV(buffers, count);
 }
 
 bool IPCEndpoint::ReadRawN(void* buf, std::streamsize size) {
   uint8_t* pCur = static_cast<uint8_t*>(buf);
   while (size) {
+    IPC_COUNT(m_counters.readCalls, 1);
     const auto nRead = ReadRaw(pCur, size);
     if(nRead <= 0)
       return false;
@@ -395,6 +1240,216 @@ bool IPCEndpoint::ReadRawN(void* buf, std::streamsize size) {
   return true;
 }
 
+void IPCEndpoint::ParseExtensions(const uint8_t* data, size_t nBytes, FrameExtensions& extensions) {
+  while (nBytes >= 2) {
+    const uint8_t type = data[0];
+    const size_t length = data[1];
+    data += 2;
+    nBytes -= 2;
+    if (length > nBytes)
+      break;
+
+    switch (type) {
+    case Header::EXTENSION_FILE_DESCRIPTORS:
+      if (length >= 1)
+        extensions.nDescriptors = data[0];
+      break;
+    case Header::EXTENSION_CHANNEL:
+      if (length >= 2) {
+        extensions.hasChannel = true;
+        extensions.channel = (data[0] << 8) + data[1];
+      }
+      break;
+    case Header::EXTENSION_CAPABILITIES:
+      extensions.isHandshake = true;
+      break;
+    case Header::EXTENSION_TIMESTAMP:
+      if (length >= 8) {
+        extensions.hasTimestamp = true;
+        extensions.timestamp = 0;
+        for (size_t i = 0; i < 8; i++)
+          extensions.timestamp = (extensions.timestamp << 8) + data[i];
+      }
+      break;
+    case Header::EXTENSION_MESSAGE_LENGTH:
+      if (length >= 8) {
+        extensions.messageLength = 0;
+        for (size_t i = 0; i < 8; i++)
+          extensions.messageLength = (extensions.messageLength << 8) + data[i];
+      }
+      break;
+    default:
+      break;
+    }
+    data += length;
+    nBytes -= length;
+  }
+}
+
+uint32_t IPCEndpoint::ResolveChannel(const Header& header, const FrameExtensions& extensions) {
+  if (header.Version() >= Header::VERSION_EXTENDED_CHANNEL && extensions.hasChannel)
+    return extensions.channel;
+  return header.Channel();
+}
+
+uint64_t IPCEndpoint::Timestamp(void) {
+  return static_cast<uint64_t>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()
+    ).count()
+  );
+}
+
+void IPCEndpoint::WriteTimestampExtension(uint8_t (&extension)[10], uint64_t timestamp) {
+  extension[0] = Header::EXTENSION_TIMESTAMP;
+  extension[1] = 8;
+  for (size_t i = 0; i < 8; i++)
+    extension[2 + i] = static_cast<uint8_t>(timestamp >> (56 - 8 * i));
+}
+
+void IPCEndpoint::WriteMessageLengthExtension(uint8_t (&extension)[10], uint64_t nBytes) {
+  extension[0] = Header::EXTENSION_MESSAGE_LENGTH;
+  extension[1] = 8;
+  for (size_t i = 0; i < 8; i++)
+    extension[2 + i] = static_cast<uint8_t>(nBytes >> (56 - 8 * i));
+}
+
+void IPCEndpoint::RecordLatency(uint32_t channel, Handlers& handler) {
+  if (!handler.recvTimestamp)
+    return;
+
+  // Stamps from a clock that doesn't match ours, such as a peer on another machine, aren't worth recording
+  const uint64_t now = Timestamp();
+  const uint64_t sent = handler.recvTimestamp;
+  handler.recvTimestamp = 0;
+  if (sent > now)
+    return;
+
+  std::lock_guard<std::mutex> lock(m_latencyMutex);
+  m_latency[channel].Record(std::chrono::nanoseconds(now - sent));
+}
+
+IPCEndpoint::LatencySummary IPCEndpoint::GetLatency(uint32_t channel) const {
+  std::lock_guard<std::mutex> lock(m_latencyMutex);
+  LatencySummary summary{};
+  auto q = m_latency.find(channel);
+  if (q == m_latency.end())
+    return summary;
+
+  const LatencyHistogram& histogram = q->second;
+  summary.count = histogram.Count();
+  summary.p50 = histogram.Percentile(0.5);
+  summary.p99 = histogram.Percentile(0.99);
+  summary.p999 = histogram.Percentile(0.999);
+  summary.max = histogram.Max();
+  return summary;
+}
+
+size_t IPCEndpoint::AddressFrame(Header& header, uint32_t channel, uint8_t (&extension)[4], ConstBuffer* buffers) {
+  buffers[0] = { &header, sizeof(header) };
+  header.SetChannel(channel & Header::NUMBER_OF_CHANNELS_MASK);
+  if (channel < Header::NUMBER_OF_CHANNELS) {
+    // Plain version 0 frame, understood by every peer
+    header.SetVersion(0);
+    header.size = sizeof(Header);
+    return 1;
+  }
+
+  extension[0] = Header::EXTENSION_CHANNEL;
+  extension[1] = 2;
+  extension[2] = static_cast<uint8_t>(channel >> 8);
+  extension[3] = static_cast<uint8_t>(channel);
+  header.SetVersion(Header::VERSION_EXTENDED_CHANNEL);
+  header.size = sizeof(Header) + sizeof(extension);
+  buffers[1] = { extension, sizeof(extension) };
+  return 2;
+}
+
+void IPCEndpoint::ClaimDescriptors(const FrameExtensions& extensions, std::vector<FileDescriptor>& fds) {
+  for (uint32_t i = 0; i < extensions.nDescriptors && !m_recvFds.empty(); i++) {
+    fds.push_back(std::move(m_recvFds.front()));
+    m_recvFds.pop_front();
+  }
+}
+
+bool IPCEndpoint::ParseFrames(const uint8_t* data, size_t nBytes, const MessageHandler& onMessage) {
+  for (;;) {
+    if (m_recvMessage.isProcessingHeader) {
+      // Fixed part of the header
+      if (m_recvMessage.position < sizeof(Header)) {
+        const size_t n = std::min<size_t>(nBytes, sizeof(Header) - m_recvMessage.position);
+        memcpy(reinterpret_cast<uint8_t*>(&m_recvMessage.header) + m_recvMessage.position, data, n);
+        data += n;
+        nBytes -= n;
+        m_recvMessage.position += static_cast<uint32_t>(n);
+        if (m_recvMessage.position < sizeof(Header))
+          return true;
+
+        if (!m_recvMessage.header.Validate()) {
+          Close(Reason::StreamIntegrityViolation);
+          return false;
+        }
+        m_recvMessage.length = m_recvMessage.header.Size();
+        m_recvMessage.channel = m_recvMessage.header.Channel();
+      }
+
+      // Extra header content holds extensions
+      const size_t n = std::min<size_t>(nBytes, m_recvMessage.length - m_recvMessage.position);
+      memcpy(m_recvExtensions + m_recvMessage.position - sizeof(Header), data, n);
+      data += n;
+      nBytes -= n;
+      m_recvMessage.position += static_cast<uint32_t>(n);
+      if (m_recvMessage.position < m_recvMessage.length)
+        return true;
+      if (m_recvMessage.length > sizeof(Header)) {
+        // Descriptors are claimed so that they stay in step with the stream, but there is nowhere to deliver
+        // them; they are closed along with the frame
+        FrameExtensions extensions;
+        ParseExtensions(m_recvExtensions, m_recvMessage.length - sizeof(Header), extensions);
+        ClaimDescriptors(extensions, m_recvMessage.fds);
+        m_recvMessage.channel = ResolveChannel(m_recvMessage.header, extensions);
+        if (extensions.hasTimestamp)
+          Handler(m_recvMessage.channel).recvTimestamp = extensions.timestamp;
+      }
+
+      // Done with header, now handle the payload
+      m_recvMessage.BeginPayload();
+      if (m_recvMessage.length) {
+        m_parsePayload = m_sharedBufferPool ?
+                         m_sharedBufferPool->Get(m_recvMessage.length) :
+                         MessageBuffers::MakeBuffer(m_recvMessage.length);
+        if (!m_parsePayload) {
+          Close(Reason::ReadFailure);
+          return false;
+        }
+      }
+    }
+
+    const size_t n = std::min<size_t>(nBytes, m_recvMessage.length - m_recvMessage.position);
+    if (n) {
+      memcpy(m_parsePayload->Data() + m_recvMessage.position, data, n);
+      data += n;
+      nBytes -= n;
+      m_recvMessage.position += static_cast<uint32_t>(n);
+    }
+    if (m_recvMessage.position < m_recvMessage.length)
+      return true;
+
+    // Payload complete, file it with the rest of its message
+    IPC_COUNT_RECEIVED(Handler(m_recvMessage.channel), m_recvMessage.header.Size() + m_recvMessage.length, m_recvMessage.header.IsEndOfMessage());
+    auto& fragments = m_parseFragments[m_recvMessage.channel];
+    if (m_parsePayload)
+      fragments.push_back(std::move(m_parsePayload));
+    if (m_recvMessage.header.IsEndOfMessage()) {
+      MessageBuffers::Buffers buffers;
+      buffers.swap(fragments);
+      RecordLatency(m_recvMessage.channel, Handler(m_recvMessage.channel));
+      onMessage(m_recvMessage.channel, buffers);
+    }
+    m_recvMessage.BeginHeader();
+  }
+}
+
 void IPCEndpoint::Close(Reason reason) {
   auto wasClosed = m_isClosed.exchange(true);
   if (!wasClosed)
@@ -403,6 +1458,13 @@ void IPCEndpoint::Close(Reason reason) {
 
   m_isClosed = true;
   m_recvCondition.notify_all(); // Inform any remaining readers that the endpoint has been closed
+
+  // Same for writers waiting on a turn; the lock makes sure none of them is between its check and its wait
+  { std::lock_guard<std::mutex> lock(m_sendMutex); }
+  m_sendCondition.notify_all();
+
+  if (m_async)
+    StopAsyncSend();
 }
 
 const IPCEndpoint::Header& IPCEndpoint::ReadMessageHeader(void) {
@@ -410,18 +1472,16 @@ const IPCEndpoint::Header& IPCEndpoint::ReadMessageHeader(void) {
   if (m_nRemain)
     throw std::runtime_error("Attempted to read a message header when payload bytes remain");
 
-  auto ncb = ReadRaw(&m_lastHeader, sizeof(m_lastHeader));
-  if (ncb <= 0) {
-    // we are being closed
-    Close(Reason::ReadFailure);
-  }
-  if (sizeof(m_lastHeader) == ncb) {
+  if (ReadRawN(&m_lastHeader, sizeof(m_lastHeader))) {
     m_nRemain = m_lastHeader.PayloadSize();
     if (m_lastHeader.magic1 != 0x64 || m_lastHeader.magic2 != 0x37)
       throw std::runtime_error("Magic value error");
   }
-  else
+  else {
+    // we are being closed
+    Close(Reason::ReadFailure);
     m_lastHeader = {};
+  }
 
   if(sizeof(m_lastHeader) < m_lastHeader.Size()) {
     const auto nSkip = m_lastHeader.Size() - sizeof(m_lastHeader);
@@ -436,6 +1496,7 @@ const IPCEndpoint::Header& IPCEndpoint::SyncMessageHeader(void) {
   uint8_t byte = 0, bitfield = 0;
   std::streamsize offset = 0;
   while (offset < sizeof(m_lastHeader)) {
+    IPC_COUNT(m_counters.readCalls, 1);
     if (ReadRaw(&byte, sizeof(byte)) <= 0) {
       Close(Reason::ReadFailure);
       m_lastHeader = {};
@@ -466,7 +1527,7 @@ const IPCEndpoint::Header& IPCEndpoint::SyncMessageHeader(void) {
         m_lastHeader.size = byte;
         const std::streamsize remaining = sizeof(m_lastHeader) - 4;
         m_lastHeader.payloadLength = 0;
-        if (ReadRaw(reinterpret_cast<uint8_t*>(&m_lastHeader) + 4, remaining) == remaining) {
+        if (ReadRawN(reinterpret_cast<uint8_t*>(&m_lastHeader) + 4, remaining)) {
           m_nRemain = m_lastHeader.PayloadSize();
           offset += 1 + remaining; // All good!
         } else {
@@ -496,6 +1557,7 @@ std::streamsize IPCEndpoint::ReadPayload(void* pBuf, size_t ncb) {
   if (!ncb)
     return 0;
 
+  IPC_COUNT(m_counters.readCalls, 1);
   const auto retVal = ReadRaw(pBuf, ncb);
   if (retVal > 0)
     m_nRemain -= (size_t)retVal;
@@ -1,5 +1,7 @@
 // Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
 #pragma once
+#include "FileDescriptor.h"
+#include "LatencyHistogram.h"
 #include "MessageBuffers.h"
 #include <LeapSerial/Archive.h>
 #include <mutex>
@@ -7,7 +9,11 @@
 #include <thread>
 #include <atomic>
 #include <autowiring/Autowired.h>
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <unordered_map>
 #include <vector>
 
 namespace leap {
@@ -62,6 +68,68 @@ public:
   /// </remarks>
   autowiring::signal<void(Reason reason)> onConnectionLost;
 
+  /// <summary>
+  /// Signal asserted when the asynchronous send queue crosses one of its watermarks
+  /// </summary>
+  /// <remarks>
+  /// The argument is true when the queue has filled up to its high watermark, and false when it has drained back
+  /// down to its low watermark, whether by being sent or by being dropped.  This signal is asserted without any
+  /// locks held, from the writing thread or from the background writer, but never from two threads at once.  The
+  /// argument alternates and always ends on the queue's current state; a crossing that is undone before it could
+  /// be reported is not reported at all.
+  /// </remarks>
+  autowiring::signal<void(bool isHigh)> onSendWatermark;
+
+  /// <summary>
+  /// Traffic on an endpoint, or on one of its channels
+  /// </summary>
+  /// <remarks>
+  /// Byte counts include frame headers.
+  /// </remarks>
+  struct TrafficCounters {
+    uint64_t framesSent = 0;
+    uint64_t framesReceived = 0;
+    uint64_t messagesSent = 0;
+    uint64_t messagesReceived = 0;
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+  };
+
+  /// <summary>
+  /// Traffic on an endpoint along with the work it took
+  /// </summary>
+  struct EndpointCounters :
+    TrafficCounters
+  {
+    // Calls into the transport to read, and to write
+    uint64_t readCalls = 0;
+    uint64_t writeCalls = 0;
+
+    // Payload bytes thrown away because nobody was reading their channel
+    uint64_t bytesDrained = 0;
+
+    // Time writers spent waiting for their turn to send
+    std::chrono::nanoseconds sendWait{ 0 };
+
+    // Time readers spent waiting for the receive lock, and waiting on other readers once they had it
+    std::chrono::nanoseconds recvLockWait{ 0 };
+    std::chrono::nanoseconds recvConditionWait{ 0 };
+  };
+
+  /// <summary>
+  /// What an asynchronous write does when the send queue has no room for its message
+  /// </summary>
+  enum class SendOverflow {
+    // Wait until the background writer has made room
+    Block,
+
+    // Discard the oldest queued messages until there is room
+    DropOldest,
+
+    // Fail the write, the message is not sent
+    Fail,
+  };
+
   /// <summary>
   /// Represents a single channel in the endpoint
   /// </summary>
@@ -88,9 +156,51 @@ public:
     // Read a single, entire message consisting of possibly multiple partial buffers
     MessageBuffers::Buffers ReadMessageBuffers();
 
-    // Write a single, entire message consisting of possibly multiple partial buffers
+    // Write a single, entire message consisting of possibly multiple partial buffers.  The whole message is
+    // sent as one gathered write; the final fragment carries the end-of-message marker.
     bool WriteMessageBuffers(const MessageBuffers::Buffers& messageBuffers);
 
+    /// <summary>
+    /// Reads a single, entire message along with any file descriptors that were attached to it
+    /// </summary>
+    /// <param name="fds">Receives the attached descriptors, which the caller then owns</param>
+    MessageBuffers::Buffers ReadMessageBuffers(std::vector<FileDescriptor>& fds);
+
+    /// <summary>
+    /// Writes a single, entire message with file descriptors attached to it
+    /// </summary>
+    /// <param name="fds">Descriptors to send, the receiver gets duplicates and the caller keeps ownership of these</param>
+    /// <returns>
+    /// False if the message could not be sent, or if the remote endpoint has not agreed to
+    /// CAPABILITY_FILE_DESCRIPTORS.  In the latter case nothing is sent and the endpoint stays open.
+    /// </returns>
+    /// <remarks>
+    /// Descriptors allow large payloads, such as a memfd, to be passed by reference instead of being copied
+    /// through the connection.  At most MAX_DESCRIPTORS can be attached to one message.  The message itself may
+    /// be empty.
+    /// </remarks>
+    bool WriteMessageBuffers(const MessageBuffers::Buffers& messageBuffers, const std::vector<int>& fds);
+
+    /// <summary>
+    /// Reads a single, entire message into one contiguous buffer
+    /// </summary>
+    /// <param name="sizeHint">The expected size of the message, or zero if it is not known</param>
+    /// <returns>The message, which is empty if the message was, or null if the endpoint closed before it was complete</returns>
+    /// <remarks>
+    /// Fragments are read straight into the buffer, so the message can be deserialized in place without first
+    /// gathering them together.  The buffer comes from the shared buffer pool.  If the sender announced the
+    /// length of the message, see SetSendMessageLengths, the buffer is allocated once at that size.  Otherwise,
+    /// if the message turns out to be larger than the hint, or than the first fragment if there is no hint, the
+    /// buffer grows geometrically.
+    /// </remarks>
+    MessageBuffers::SharedBuffer ReadMessage(size_t sizeHint = 0);
+
+    /// <summary>
+    /// Reads a single, entire message into one contiguous buffer, along with any file descriptors that were attached to it
+    /// </summary>
+    /// <param name="fds">Receives the attached descriptors, which the caller then owns</param>
+    MessageBuffers::SharedBuffer ReadMessage(std::vector<FileDescriptor>& fds, size_t sizeHint = 0);
+
     /// <summary>
     /// Reads the requested number of bytes into the passed buffer
     /// </summary>
@@ -120,13 +230,32 @@ public:
     /// </summary>
     bool WriteMessageComplete();
 
+    /// <summary>
+    /// Collects small writes on this channel so that they are sent together
+    /// </summary>
+    /// <param name="threshold">The number of bytes to collect before sending, or zero to send every write as it is made</param>
+    /// <remarks>
+    /// Writes are copied into a buffer that this channel keeps for its lifetime.  The buffer is sent as a single
+    /// frame when the message is completed, or when the next write would take it past the threshold; a write
+    /// that is larger than the threshold by itself is sent directly.  Anything still buffered when the channel
+    /// is released without completing its message is discarded, along with the rest of that message.
+    /// </remarks>
+    void SetWriteBuffering(size_t threshold);
+
   private:
     Channel(const std::shared_ptr<IPCEndpoint>& endpoint, uint32_t channel, Mode mode);
 
+    // Sends whatever has been buffered, as the end of the message if requested
+    bool FlushWrites(bool isComplete);
+
     const uint32_t m_channel;
     const Mode m_mode;
     std::shared_ptr<IPCEndpoint> m_endpoint;
 
+    // Write buffer, and the number of bytes in it, if write buffering is enabled
+    MessageBuffers::SharedBuffer m_writeBuffer;
+    size_t m_nWriteBuffered = 0;
+
     friend class IPCEndpoint;
   };
 
@@ -144,6 +273,11 @@ public:
     static const uint32_t NUMBER_OF_CHANNELS = 1 << 2;
     static const uint32_t NUMBER_OF_CHANNELS_MASK = (NUMBER_OF_CHANNELS - 1);
 
+    // Channels from NUMBER_OF_CHANNELS up to MAX_CHANNEL are carried by version 1 frames, which hold the full
+    // channel number in an extension.  Version 0 peers only ever see frames for the first NUMBER_OF_CHANNELS.
+    static const uint32_t MAX_CHANNEL = 0xFFFF;
+    static const uint32_t VERSION_EXTENDED_CHANNEL = 1;
+
     //
     //  0                   1                   2                   3
     //  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
@@ -158,13 +292,17 @@ public:
     //
     //  Magic 1:               8 bits (0x64)
     //  Magic 2:               8 bits (0x37)
-    //  Version:               3 bits (0)
+    //  Version:               3 bits (0, or 1 for an extended channel)
     //  Reserved:              2 bits (0)
-    //  Channel:               2 bits (0)
+    //  Channel:               2 bits (0, or the low bits of an extended channel)
     //  End of Message (EOM):  1 bit  (1 = Final fragment, 0 = More fragments to follow)
     //  Header Length:         8 bits (8)
     //  Payload Length:       32 bits (Length of payload to follow)
     //
+    // A header longer than 8 bytes carries extensions in the bytes that follow the fixed part.  Each extension
+    // is a type byte, a length byte, and that many bytes of value.  Receivers skip extensions they don't know,
+    // and stop at the first one that doesn't fit.
+    //
     Header(void) :
       eom(false),
       channel(0),
@@ -195,6 +333,57 @@ public:
     bool Validate() const {
       return magic1 == 0x64 && magic2 == 0x37 && size >= sizeof(*this);
     }
+
+    enum ExtensionType : uint8_t {
+      // Number of file descriptors attached to this frame, 1 byte
+      EXTENSION_FILE_DESCRIPTORS = 1,
+
+      // Channel of a version 1 frame, 2 bytes, big-endian
+      EXTENSION_CHANNEL = 2,
+
+      // Connection handshake, 1 byte handshake version, 1 byte handshake step, and 4 bytes of Capability flags,
+      // big-endian.  Frames that carry it have no payload and are not part of any channel's traffic.
+      EXTENSION_CAPABILITIES = 3,
+
+      // Time the sender started the message, 8 bytes of steady clock nanoseconds, big-endian.  Only the first
+      // frame of a message carries it.
+      EXTENSION_TIMESTAMP = 4,
+
+      // Total payload size of a message that spans more than one frame, 8 bytes, big-endian.  Only the first
+      // frame of a message carries it.
+      EXTENSION_MESSAGE_LENGTH = 5,
+    };
+  };
+
+  // Largest number of file descriptors that can be attached to a single message
+  enum { MAX_DESCRIPTORS = 253 };
+
+  /// <summary>
+  /// Optional features that both ends of a connection have to support before either end may use them
+  /// </summary>
+  enum Capability : uint32_t {
+    // Channels beyond the first Header::NUMBER_OF_CHANNELS
+    CAPABILITY_EXTENDED_CHANNELS = 1 << 0,
+
+    // File descriptors attached to messages
+    CAPABILITY_FILE_DESCRIPTORS = 1 << 1,
+
+    // Data moves through shared memory rings rather than through the socket
+    CAPABILITY_SHARED_MEMORY = 1 << 2,
+
+    // Time stamps on the first frame of each message, see SetSendTimestamps
+    CAPABILITY_TIMESTAMPS = 1 << 3,
+
+    // Total lengths on the first frame of messages that span several frames, see SetSendMessageLengths
+    CAPABILITY_MESSAGE_LENGTHS = 1 << 4,
+  };
+
+  /// <summary>
+  /// A single contiguous region of memory to be sent by WriteRawV
+  /// </summary>
+  struct ConstBuffer {
+    const void* pBuf;
+    std::streamsize nBytes;
   };
 
 protected:
@@ -203,24 +392,163 @@ protected:
   virtual std::streamsize ReadRaw(void* buffer, std::streamsize size) = 0;
   virtual bool WriteRaw(const void* pBuf, std::streamsize nBytes) = 0;
 
+  // Gathering form of WriteRaw, sends all of the passed buffers in order.  Platforms that support scatter/gather
+  // I/O override this so that the whole list goes out in a single call; the default makes one WriteRaw call per
+  // buffer.
+  virtual bool WriteRawV(const ConstBuffer* buffers, size_t count);
+
+  // Form of WriteRawV that passes file descriptors along with the first byte sent.  Transports that can carry
+  // descriptors override this; the default fails if any descriptors are passed.
+  virtual bool WriteRawFds(const ConstBuffer* buffers, size_t count, const int* fds, size_t nFds);
+
+  // Called by transports that carry descriptors, in the order the descriptors arrive, while reading the stream
+  // they arrived with.  Each frame header that announces descriptors claims them from the front of this queue.
+  // Ownership of fd is taken either way.  Returns false, and closes fd, if a frame's worth of descriptors is
+  // already waiting to be claimed; only a peer that sends descriptors without announcing them gets here, and
+  // the transport should give up on the connection rather than hold on to them.
+  bool OnDescriptorReceived(int fd) {
+    if (m_recvFds.size() >= MAX_DESCRIPTORS) {
+      FileDescriptor{ fd };
+      return false;
+    }
+    m_recvFds.emplace_back(fd);
+    return true;
+  }
+
   // Helper routine to receive exactly the specified number of bytes, or fail
   bool ReadRawN(void* buf, std::streamsize size);
 
+  // Handler for complete messages produced by ParseFrames, invoked with the channel and the message fragments
+  typedef std::function<void(uint32_t channel, MessageBuffers::Buffers& buffers)> MessageHandler;
+
+  // Incremental frame parser for event-driven transports.  Consumes all of the passed bytes, carrying any
+  // partial header or payload over to the next call, and invokes onMessage for each message completed.  This
+  // shares its receive state with the blocking read path, an endpoint must be read one way or the other.
+  // Returns false if the stream is found to be corrupt, in which case the endpoint is closed.
+  bool ParseFrames(const uint8_t* data, size_t nBytes, const MessageHandler& onMessage);
+
   // Mark endpoint as closed, and notify others that may not yet know
   void Close(Reason reason);
 
   // PID of the remote endpoint
   uint32_t m_pid = 0;
 
+  // Capabilities agreed with the remote endpoint
+  uint32_t m_capabilities = 0;
+
+  // The Capability flags that this transport is able to provide, if the remote endpoint agrees to them
+  virtual uint32_t SupportedCapabilities(void) const;
+
 private:
+  friend class IPCHandshakeUnix;
+
   void ReleaseChannel(uint32_t channel, Channel::Mode mode);
   void HandlePendingUnsafe();
 
   // Low-level read; either into a pre-allocated buffer, or create a buffer big enough to hold the (partial) message
-  std::streamsize Read(uint32_t channel, void* buffer, std::streamsize size, MessageBuffers::SharedBuffer* sharedBuffer);
+  // When a buffer is created for a reader that wants the whole message, it is made big enough for the length
+  // the sender announced, if any, so that the rest of the message can be read into it.
+  std::streamsize Read(uint32_t channel, void* buffer, std::streamsize size, MessageBuffers::SharedBuffer* sharedBuffer, bool isWholeMessage = false);
+
+  MessageBuffers::Buffers ReadMessageBuffers(uint32_t channel, std::vector<FileDescriptor>* fds);
+  MessageBuffers::SharedBuffer ReadMessage(uint32_t channel, size_t sizeHint, std::vector<FileDescriptor>* fds);
+  bool WriteMessageBuffers(uint32_t channel, const MessageBuffers::Buffers& messageBuffers, const int* fds, size_t nFds);
+
+  // Puts a complete message on the wire from the calling thread.  If timestamps are being sent, the message is
+  // stamped with the passed time, or with the current time if that is zero.
+  bool SendMessage(uint32_t channel, const MessageBuffers::Buffers& messageBuffers, const int* fds, size_t nFds, uint64_t timestamp);
+
+  // A complete message waiting in the asynchronous send queue
+  struct QueuedMessage {
+    uint32_t channel;
+    MessageBuffers::Buffers buffers;
+    std::vector<FileDescriptor> fds;
+    size_t nBytes;
+    uint64_t timestamp;
+  };
+
+  // Asynchronous send state, shared with the background writer so that it never has to outlive the endpoint
+  struct AsyncSend {
+    std::mutex lock;
+    std::condition_variable condition;
+    std::deque<QueuedMessage> queue;
+    size_t queuedBytes = 0;
+    size_t capacity = 0;
+    SendOverflow overflow = SendOverflow::Block;
+    size_t highWatermark = 0;
+    size_t lowWatermark = 0;
+    bool isHigh = false;
+    bool isStopped = false;
+
+    // The state last passed to onSendWatermark, and whether a thread is passing one right now
+    bool isHighDelivered = false;
+    bool isDelivering = false;
+  };
+
+  // Adds a message to the asynchronous send queue according to its overflow policy, with the time it was started
+  // if that is known
+  bool EnqueueMessage(uint32_t channel, MessageBuffers::Buffers buffers, const int* fds, size_t nFds, uint64_t timestamp = 0);
+
+  // Current steady clock time in nanoseconds, as carried by EXTENSION_TIMESTAMP
+  static uint64_t Timestamp(void);
+  static void WriteTimestampExtension(uint8_t (&extension)[10], uint64_t timestamp);
+  static void WriteMessageLengthExtension(uint8_t (&extension)[10], uint64_t nBytes);
+
+  // Discards anything still queued and releases writers waiting for room, once the endpoint has closed
+  void StopAsyncSend(void);
+
+  // Updates the watermark state after the queue has changed, must be called with the queue locked.  Returns
+  // true if the state changed and needs to be delivered.
+  static bool UpdateWatermark(AsyncSend& async);
+
+  // Asserts onSendWatermark until the delivered state matches the queue's.  Only one thread delivers at a time,
+  // any other thread that finds a change just leaves it to that one.
+  void DeliverWatermark(AsyncSend& async);
+
+  // Body of the background writer.  The endpoint is only locked while a message is being sent.
+  static void AsyncWriterProc(std::weak_ptr<IPCEndpoint> weak, std::shared_ptr<AsyncSend> async);
+
+  // Extensions found in the extended part of a frame header
+  struct FrameExtensions {
+    uint32_t nDescriptors = 0;
+    bool hasChannel = false;
+    uint32_t channel = 0;
+    bool hasTimestamp = false;
+    uint64_t timestamp = 0;
+    uint64_t messageLength = 0;
+    bool isHandshake = false;
+  };
+  static void ParseExtensions(const uint8_t* data, size_t nBytes, FrameExtensions& extensions);
+
+  // The channel a frame belongs to, taking extended channels into account
+  static uint32_t ResolveChannel(const Header& header, const FrameExtensions& extensions);
+
+  // Fills in the channel, version, and size of an outgoing frame header and produces the buffers to send for it,
+  // either the header alone or the header followed by the channel extension, into the first one or two entries
+  // of the passed array.  The extension is written into the passed storage.  Returns the number of buffers.
+  static size_t AddressFrame(Header& header, uint32_t channel, uint8_t (&extension)[4], ConstBuffer* buffers);
+
+  // Moves the descriptors announced by a frame from the receive queue to the passed list
+  void ClaimDescriptors(const FrameExtensions& extensions, std::vector<FileDescriptor>& fds);
+
+  // A frame that has been received and is waiting in its channel's read-ahead queue
+  struct QueuedFrame {
+    MessageBuffers::SharedBuffer payload;
+    uint32_t length = 0;
+    uint32_t position = 0;
+    bool eom = false;
+    std::vector<FileDescriptor> fds;
+    uint64_t timestamp = 0;
+    uint64_t messageLength = 0;
+  };
 
-  MessageBuffers::Buffers ReadMessageBuffers(uint32_t channel);
-  bool WriteMessageBuffers(uint32_t channel, const MessageBuffers::Buffers& messageBuffers);
+  // Read implementation used when read-ahead is enabled.  Readers consume frames from their own queue, and
+  // whichever reader finds its queue empty while nobody else is receiving takes a turn receiving the next frame.
+  std::streamsize ReadQueued(uint32_t channel, void* buffer, std::streamsize size, MessageBuffers::SharedBuffer* sharedBuffer, bool isWholeMessage);
+
+  // Receives one frame and files it with its channel, waiting for room in that channel's queue.  The passed
+  // lock on m_recvMutex is released while receiving.  Returns false if the frame could not be received.
+  bool PumpFrame(std::unique_lock<std::mutex>& lock);
 
   std::streamsize Read(uint32_t channel, void* buffer, std::streamsize size);
 
@@ -250,6 +578,9 @@ private:
     // Header itself
     Header header;
 
+    // Channel the frame belongs to, which may be an extended channel
+    uint32_t channel = 0;
+
     // Length of header or payload
     uint32_t length = sizeof(Header);
 
@@ -258,15 +589,114 @@ private:
 
     // Flag of whether we are processing the header or the payload
     bool isProcessingHeader = true;
+
+    // Descriptors attached to this frame, not yet claimed by a reader
+    std::vector<FileDescriptor> fds;
   };
 
   enum { DRAIN_SIZE = 16384 };
 
+#if USE_IPC_COUNTERS
+  // Counters as they are being updated.  Updates are relaxed, a snapshot is not a consistent point in time.
+  struct LiveTraffic {
+    std::atomic<uint64_t> framesSent{ 0 };
+    std::atomic<uint64_t> framesReceived{ 0 };
+    std::atomic<uint64_t> messagesSent{ 0 };
+    std::atomic<uint64_t> messagesReceived{ 0 };
+    std::atomic<uint64_t> bytesSent{ 0 };
+    std::atomic<uint64_t> bytesReceived{ 0 };
+
+    void Snapshot(TrafficCounters& counters) const;
+  };
+
+  struct LiveCounters :
+    LiveTraffic
+  {
+    std::atomic<uint64_t> readCalls{ 0 };
+    std::atomic<uint64_t> writeCalls{ 0 };
+    std::atomic<uint64_t> bytesDrained{ 0 };
+    std::atomic<uint64_t> sendWait{ 0 };
+    std::atomic<uint64_t> recvLockWait{ 0 };
+    std::atomic<uint64_t> recvConditionWait{ 0 };
+  };
+#endif
+
   struct Handlers {
-    bool pending;
-    bool reading;
-    bool writing;
-    std::atomic<bool> eom;
+    bool pending = false;
+    bool reading = false;
+    bool writing = false;
+    std::atomic<bool> eom{ true };
+
+    // Descriptors attached to the message being read on this channel
+    std::vector<FileDescriptor> fds;
+
+    // Frames received ahead of the reader, and the total size of their payloads
+    std::deque<QueuedFrame> queue;
+    size_t queuedBytes = 0;
+
+    // Outgoing frame state, only touched by this channel's writer.  sendFrames holds the end of each frame in
+    // sendBuffers along with the frame's size on the wire.
+    Header sendHeader;
+    std::vector<Header> sendHeaders;
+    std::vector<ConstBuffer> sendBuffers;
+    std::vector<std::pair<size_t, size_t>> sendFrames;
+    uint8_t sendChannelExtension[4];
+    uint8_t sendDescriptorExtension[3];
+
+    // Priority of this channel's turns on the wire, guarded by m_sendMutex
+    int sendPriority = 0;
+
+    // Payload written to this channel in asynchronous mode, held until the message is complete
+    MessageBuffers::Buffers asyncBuffers;
+
+    // Time the message being written was started, while timestamps are being sent, and the extension carrying it
+    uint64_t sendTimestamp = 0;
+    uint8_t sendTimestampExtension[10];
+
+    // Length of the message being sent, while message lengths are being sent
+    uint8_t sendMessageLengthExtension[10];
+
+    // Time the message being read was sent, zero if it carried no timestamp
+    uint64_t recvTimestamp = 0;
+
+    // Total length of the message being read as announced by the sender, zero if it wasn't
+    uint64_t recvMessageLength = 0;
+
+#if USE_IPC_COUNTERS
+    LiveTraffic counters;
+#endif
+  };
+
+  // Handler for the passed channel, created if this is an extended channel that has not been seen before.  The
+  // unsafe form must be called with m_pendingMutex held.
+  Handlers& Handler(uint32_t channel);
+  Handlers& HandlerUnsafe(uint32_t channel);
+
+  // Waits until the passed channel may put frames on the wire.  Waiting writers get their turns in order of
+  // their channel's priority and then in the order they asked for them, so concurrent writers interleave their
+  // fragments.  Returns false if the endpoint was closed while waiting.
+  bool AcquireSendTurn(const Handlers& handler);
+
+  // Ends the current turn and hands the wire to the next waiting channel
+  void ReleaseSendTurn(void);
+
+  // Adds the latency of the message just read on a channel to that channel's histogram, if it had a timestamp
+  void RecordLatency(uint32_t channel, Handlers& handler);
+
+  // The length the sender announced for the message being read on a channel, clamped to m_maxAnnouncedLength.
+  // Zero if there was no announcement or if it is no more than the nReceived bytes already in hand.
+  size_t AnnouncedLength(const Handlers& handler, size_t nReceived) const;
+
+#if USE_IPC_COUNTERS
+  // Record frames and messages on both the endpoint and the channel's handler
+  void CountSent(Handlers& handler, uint64_t nFrames, uint64_t nBytes, bool isEndOfMessage);
+  void CountReceived(Handlers& handler, uint64_t nBytes, bool isEndOfMessage);
+#endif
+
+  // A writer waiting for its turn to send
+  struct SendTurn {
+    uint64_t ticket;
+    int priority;
   };
 
   Autowired<MessageBuffers::SharedBufferPool> m_sharedBufferPool;
@@ -275,13 +705,53 @@ private:
   std::mutex m_recvMutex;
   std::mutex m_pendingMutex;
   std::condition_variable m_recvCondition;
-  Header m_sendHeader;
+  std::condition_variable m_sendCondition;
+  std::deque<SendTurn> m_sendQueue; // Writers waiting for a turn to send, guarded by m_sendMutex
+  uint64_t m_nextSendTicket = 0; // Guarded by m_sendMutex
+  uint64_t m_sendGranted = UINT64_MAX; // Ticket of the waiting writer that was given the next turn, guarded by m_sendMutex
+  bool m_isSending = false; // Set while a channel has its turn, guarded by m_sendMutex
+  uint8_t m_recvExtensions[256]; // Extended header content of the frame being received
+  std::deque<FileDescriptor> m_recvFds; // Descriptors received but not yet claimed by a frame
   Message m_recvMessage;
+  MessageBuffers::SharedBuffer m_parsePayload; // Payload being filled in by ParseFrames
+  std::unordered_map<uint32_t, MessageBuffers::Buffers> m_parseFragments; // Fragments of messages being assembled by ParseFrames
   const std::streamsize m_blockSize;
+  std::atomic<size_t> m_maxFragmentSize{ 0x7FFFFFFF };
   Handlers m_handler[Header::NUMBER_OF_CHANNELS];
+
+  // Handlers for extended channels.  Entries are never removed, so references to them stay valid; the table
+  // itself is guarded by m_pendingMutex.
+  std::unordered_map<uint32_t, Handlers> m_extendedHandlers;
   std::atomic<bool> m_hasPending{ false };
   std::atomic<bool> m_isClosed{ false };
 
+  // Per-channel read-ahead limit, zero if read-ahead is disabled
+  size_t m_readAheadLimit = 0;
+
+  // Most that an announced message length may allocate up front
+  std::atomic<size_t> m_maxAnnouncedLength{ DEFAULT_MAX_ANNOUNCED_LENGTH };
+
+  // Set while a reader is receiving a frame on behalf of the read-ahead queues, guarded by m_recvMutex
+  bool m_isPumping = false;
+
+  // Asynchronous send queue and its writer, if asynchronous sending is enabled
+  std::shared_ptr<AsyncSend> m_async;
+  std::thread m_asyncWriter;
+
+#if USE_IPC_COUNTERS
+  LiveCounters m_counters;
+#endif
+
+  // Set if outgoing messages are stamped with the time they were started
+  std::atomic<bool> m_sendTimestamps{ false };
+
+  // Set if outgoing messages announce their length
+  std::atomic<bool> m_sendMessageLengths{ false };
+
+  // Latency of timestamped messages received on each channel
+  mutable std::mutex m_latencyMutex;
+  std::unordered_map<uint32_t, LatencyHistogram> m_latency;
+
   // Last header read by ReadMessageHeader
   Header m_lastHeader;
 
@@ -296,6 +766,10 @@ public:
   /// <summary>
   /// Acquires a channel that can be used to transmit messages
   /// </summary>
+  /// <returns>
+  /// The channel, or nullptr if it is already in use in the requested mode, or if it is an extended channel and
+  /// the remote endpoint has not agreed to CAPABILITY_EXTENDED_CHANNELS
+  /// </returns>
   std::unique_ptr<Channel> AcquireChannel(uint32_t channel, Channel::Mode mode);
 
   /// <summary>
@@ -327,6 +801,169 @@ public:
   /// </remarks>
   std::streamsize ReadPayload(void* pBuf, size_t ncb);
 
+  /// <summary>
+  /// Enables read-ahead, so that a slow reader on one channel does not hold up readers on the others
+  /// </summary>
+  /// <param name="nBytes">The number of payload bytes each channel may hold, or zero to disable read-ahead</param>
+  /// <remarks>
+  /// By default a frame is left in the stream until the reader of its channel takes it, and every other channel
+  /// waits behind it.  With read-ahead, frames are received as soon as any reader is waiting and are queued for
+  /// their channel.  Once a channel has nBytes queued, receiving stops until its reader catches up; a single
+  /// frame larger than the limit is still accepted into an empty queue.  This method must be called before the
+  /// endpoint is first read from, and does not apply to endpoints serviced by an IPCReactor.
+  /// </remarks>
+  void SetReadAheadLimit(size_t nBytes) { m_readAheadLimit = nBytes; }
+
+  /// <summary>
+  /// Limits how much is allocated up front for a message whose total length the sender announced
+  /// </summary>
+  /// <remarks>
+  /// The announced length comes from the peer and is only trusted as a hint.  Longer announcements are clamped
+  /// to this limit, and a message that really is longer grows its buffer as it arrives, as it would have without
+  /// an announcement.
+  /// </remarks>
+  void SetMaxAnnouncedLength(size_t nBytes) { m_maxAnnouncedLength = nBytes; }
+  enum { DEFAULT_MAX_ANNOUNCED_LENGTH = 16 * 1024 * 1024 };
+
+  /// <summary>
+  /// Limits the size of the frames that outgoing messages are broken into, including frame headers
+  /// </summary>
+  /// <remarks>
+  /// Channels that are writing at the same time take turns putting one fragment each on the wire, so a small
+  /// fragment size keeps a large message on one channel from holding up messages on the others, at the cost of
+  /// more frames per message.  By default fragments are effectively unlimited.  Sizes too small to hold a frame
+  /// header and some payload are raised to MIN_FRAGMENT_SIZE.
+  /// </remarks>
+  void SetMaxFragmentSize(size_t nBytes);
+  enum { MIN_FRAGMENT_SIZE = 64 };
+
+  /// <summary>
+  /// Sets the priority of outgoing frames on the specified channel
+  /// </summary>
+  /// <param name="priority">The priority, higher values go first; channels start at zero</param>
+  /// <remarks>
+  /// When several channels are waiting to send, the next fragment on the wire comes from the waiting channel with
+  /// the highest priority, and channels of equal priority take turns.  A fragment that is already being sent is
+  /// never interrupted, so a high-priority message can still wait for up to one fragment from another channel;
+  /// SetMaxFragmentSize bounds how long that is.
+  /// </remarks>
+  void SetChannelPriority(uint32_t channel, int priority);
+
+  /// <summary>
+  /// The number of writers that have the wire or are waiting for their turn on it
+  /// </summary>
+  size_t GetWritersInLine(void);
+
+  /// <summary>
+  /// Makes writes on this endpoint return without waiting for the peer
+  /// </summary>
+  /// <param name="capacity">The number of payload bytes the send queue may hold</param>
+  /// <param name="overflow">What to do with a message that does not fit in the queue</param>
+  /// <param name="highWatermark">Queued bytes at which onSendWatermark is asserted, or zero for no signal</param>
+  /// <param name="lowWatermark">Queued bytes at which onSendWatermark is asserted again once the queue drains</param>
+  /// <remarks>
+  /// Complete messages are queued, and a background thread sends them in the order they were queued.  Payload
+  /// written with Channel::Write is copied and held until its message is complete; buffers passed to
+  /// WriteMessageBuffers are queued as they are and must not be modified afterwards, and descriptors are
+  /// duplicated.  A message larger than the whole queue is still accepted into an empty queue.  Anything still
+  /// queued when the endpoint is closed is discarded.  This method must be called at most once, before the
+  /// endpoint is first written to, and the endpoint must be owned by a shared_ptr.
+  /// </remarks>
+  void EnableAsyncSend(size_t capacity, SendOverflow overflow, size_t highWatermark = 0, size_t lowWatermark = 0);
+
+  /// <summary>
+  /// Stamps every message sent from this endpoint with the time it was started
+  /// </summary>
+  /// <remarks>
+  /// The time goes in a header extension on the first frame of each message, and costs ten bytes per message.
+  /// The receiving endpoint uses it to keep a latency histogram for each channel, see GetLatency.  The steady
+  /// clock is used, which is shared by every process on the same host, so the two ends must be on the same
+  /// host for the measurements to mean anything.  Nothing is stamped unless the remote endpoint has agreed to
+  /// CAPABILITY_TIMESTAMPS.
+  /// </remarks>
+  /// <returns>False if stamps were requested but the remote endpoint has not agreed to them</returns>
+  bool SetSendTimestamps(bool enable) {
+    m_sendTimestamps = enable && HasCapability(CAPABILITY_TIMESTAMPS);
+    return m_sendTimestamps == enable;
+  }
+
+  /// <summary>
+  /// Announces the total length of every message sent from this endpoint that spans more than one frame
+  /// </summary>
+  /// <remarks>
+  /// The length goes in a header extension on the first frame of the message, and costs ten bytes per message.
+  /// It is only known up front for messages sent whole, by WriteMessageBuffers or from the asynchronous send
+  /// queue; messages written piece by piece with Channel::Write go without.  A receiver calling
+  /// Channel::ReadMessage uses it to allocate the message's buffer once.  Nothing is announced unless the remote
+  /// endpoint has agreed to CAPABILITY_MESSAGE_LENGTHS.
+  /// </remarks>
+  /// <returns>False if lengths were requested but the remote endpoint has not agreed to them</returns>
+  bool SetSendMessageLengths(bool enable) {
+    m_sendMessageLengths = enable && HasCapability(CAPABILITY_MESSAGE_LENGTHS);
+    return m_sendMessageLengths == enable;
+  }
+
+  /// <summary>
+  /// End-to-end latency of timestamped messages received on a channel
+  /// </summary>
+  struct LatencySummary {
+    uint64_t count = 0;
+    std::chrono::nanoseconds p50{ 0 };
+    std::chrono::nanoseconds p99{ 0 };
+    std::chrono::nanoseconds p999{ 0 };
+    std::chrono::nanoseconds max{ 0 };
+  };
+
+  /// <summary>
+  /// Returns the latency of the timestamped messages received on the specified channel so far
+  /// </summary>
+  /// <remarks>
+  /// Latency runs from the sender's first write of a message to the moment the message has been completely read
+  /// here, either by ReadMessageBuffers or by the reader calling ReadMessageComplete.  Messages delivered by an
+  /// IPCReactor are measured when they are handed to the reactor's handler.
+  /// </remarks>
+  LatencySummary GetLatency(uint32_t channel) const;
+
+  /// <summary>
+  /// True if this library was built with USE_IPC_COUNTERS
+  /// </summary>
+  /// <remarks>
+  /// Counters are compiled out unless USE_IPC_COUNTERS is defined to a nonzero value.  Without them, snapshots
+  /// are always zero.
+  /// </remarks>
+  static bool CountersEnabled(void);
+
+  /// <summary>
+  /// Returns a snapshot of the counters for this endpoint
+  /// </summary>
+  EndpointCounters GetCounters(void) const;
+
+  /// <summary>
+  /// Returns a snapshot of the traffic counters for one channel of this endpoint
+  /// </summary>
+  TrafficCounters GetChannelCounters(uint32_t channel);
+
+  /// <summary>
+  /// Returns the set of Capability flags agreed with the remote endpoint when the connection was made
+  /// </summary>
+  /// <remarks>
+  /// This is zero if the remote endpoint predates the connection handshake, or if the platform does not perform
+  /// one.  Features that depend on the remote endpoint are only used if it has agreed to them.
+  /// </remarks>
+  uint32_t Capabilities() const { return m_capabilities; }
+  bool HasCapability(Capability capability) const { return (m_capabilities & capability) != 0; }
+
+  /// <summary>
+  /// Adds to the agreed Capability flags of an endpoint whose remote end is known to support them
+  /// </summary>
+  /// <remarks>
+  /// For endpoints that were not set up by a connection handshake, such as both ends of a socket pair created by
+  /// this process.  Flags that this transport can't provide are ignored, and CAPABILITY_SHARED_MEMORY can only be
+  /// agreed by a handshake.  This must be called before the endpoint is first used.
+  /// </remarks>
+  /// <returns>The agreed Capability flags</returns>
+  uint32_t EnableCapabilities(uint32_t capabilities);
+
   /// <summary>
   /// Returns the PID of the remote endpoint
   /// </summary>
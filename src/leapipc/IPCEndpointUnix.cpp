@@ -2,14 +2,17 @@
 #include "stdafx.h"
 #include "IPCEndpointUnix.h"
 
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #if USE_NETWORK_SOCKETS
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #elif __APPLE__
 #include <sys/un.h>
-#else
-#include <poll.h>
 #endif
 
 using namespace leap::ipc;
@@ -38,33 +41,233 @@ IPCEndpointUnix::IPCEndpointUnix(int socket):
 IPCEndpointUnix::~IPCEndpointUnix(void)
 {
   Abort(Reason::Unspecified);
+  ::close(m_socket);
 }
 
 std::streamsize IPCEndpointUnix::ReadRaw(void* buffer, std::streamsize size) {
-#if !USE_NETWORK_SOCKETS && !__APPLE__
-  struct pollfd fds = { m_socket, POLLIN, 0 };
-  if (fds.fd < 0 || poll(&fds, 1, -1) <= 0 || !(fds.revents & POLLIN)) {
+  if (!m_hasReadBegun.load(std::memory_order_relaxed))
+    m_hasReadBegun = true;
+  if (m_recvHead == m_recvTail) {
+    if (size >= static_cast<std::streamsize>(m_recvBufferSize))
+      // Nothing buffered and either buffering is disabled or the caller wants a lot, read directly into the
+      // destination
+      return Receive(buffer, size);
+
+    m_recvBuffer.resize(m_recvBufferSize);
+    const std::streamsize nRead = Receive(m_recvBuffer.data(), m_recvBuffer.size());
+    if (nRead <= 0)
+      return nRead;
+    m_recvHead = 0;
+    m_recvTail = static_cast<size_t>(nRead);
+  }
+
+  const size_t n = std::min<size_t>(static_cast<size_t>(size), m_recvTail - m_recvHead);
+  memcpy(buffer, m_recvBuffer.data() + m_recvHead, n);
+  m_recvHead += n;
+  return static_cast<std::streamsize>(n);
+}
+
+std::streamsize IPCEndpointUnix::Receive(void* buffer, std::streamsize size) {
+  // No need to poll first, Abort shuts the socket down and that wakes up a blocked recv directly
+  for (;;) {
+    const std::streamsize nRead = ReceiveMessage(buffer, static_cast<size_t>(size), MSG_NOSIGNAL);
+    if (nRead >= 0 || errno != EINTR)
+      return nRead;
+  }
+}
+
+ssize_t IPCEndpointUnix::ReceiveMessage(void* buffer, size_t size, int flags) {
+  m_nReceiveCalls++;
+#if USE_NETWORK_SOCKETS
+  return ::recv(m_socket, buffer, size, flags);
+#else
+  iovec iov = { buffer, size };
+  union {
+    cmsghdr align;
+    uint8_t buf[CMSG_SPACE(sizeof(int) * MAX_DESCRIPTORS)];
+  } control;
+
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+#ifdef MSG_CMSG_CLOEXEC
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+  const ssize_t nRead = ::recvmsg(m_socket, &msg, flags);
+  if (nRead <= 0)
+    return nRead;
+
+  // Descriptors that didn't fit have been dropped by the kernel, and the frames that announced them can no
+  // longer be matched up with what arrived
+  bool isValid = !(msg.msg_flags & MSG_CTRUNC);
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    const size_t nFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < nFds; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+      if (!isValid)
+        ::close(fd);
+      else if (!OnDescriptorReceived(fd))
+        isValid = false;
+    }
+  }
+  if (!isValid) {
+    Abort(Reason::StreamIntegrityViolation);
+    errno = EPROTO;
     return -1;
   }
+  return nRead;
 #endif
-  return ::recv(m_socket, buffer, size, MSG_NOSIGNAL);
+}
+
+bool IPCEndpointUnix::ReceiveAvailable(const MessageHandler& onMessage) {
+  if (!m_hasReadBegun.load(std::memory_order_relaxed))
+    m_hasReadBegun = true;
+
+  // Anything ReadRaw buffered before this endpoint was handed to a reactor goes first
+  if (m_recvHead != m_recvTail) {
+    const size_t head = m_recvHead;
+    m_recvHead = m_recvTail;
+    if (!ParseFrames(m_recvBuffer.data() + head, m_recvTail - head, onMessage))
+      return false;
+  }
+
+  m_recvBuffer.resize(m_recvBufferSize ? m_recvBufferSize : size_t(DEFAULT_RECEIVE_BUFFER_SIZE));
+
+  const ssize_t nRead = ReceiveMessage(m_recvBuffer.data(), m_recvBuffer.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (nRead < 0)
+    // Spurious wakeups are not a failure
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  if (nRead == 0)
+    return false;
+  return ParseFrames(m_recvBuffer.data(), static_cast<size_t>(nRead), onMessage);
 }
 
 bool IPCEndpointUnix::WriteRaw(const void* pBuf, std::streamsize nBytes) {
   return (nBytes == ::send(m_socket, pBuf, nBytes, MSG_NOSIGNAL));
 }
 
+bool IPCEndpointUnix::WriteRawV(const ConstBuffer* buffers, size_t count) {
+  return WriteRawFds(buffers, count, nullptr, 0);
+}
+
+bool IPCEndpointUnix::WriteRawFds(const ConstBuffer* buffers, size_t count, const int* fds, size_t nFds) {
+#if USE_NETWORK_SOCKETS
+  // Descriptors can't cross a network connection
+  if (nFds)
+    return false;
+#else
+  if (nFds > MAX_DESCRIPTORS)
+    return false;
+  union {
+    cmsghdr align;
+    uint8_t buf[CMSG_SPACE(sizeof(int) * MAX_DESCRIPTORS)];
+  } control;
+#endif
+
+  // Build an iovec list we can advance in place if the kernel only takes part of it
+  iovec local[16];
+  std::vector<iovec> remote;
+  iovec* iov = local;
+  if (count > sizeof(local) / sizeof(*local)) {
+    remote.resize(count);
+    iov = remote.data();
+  }
+
+  size_t nRemaining = 0;
+  for (size_t i = 0; i < count; i++)
+    if (buffers[i].nBytes > 0)
+      iov[nRemaining++] = { const_cast<void*>(buffers[i].pBuf), static_cast<size_t>(buffers[i].nBytes) };
+
+  while (nRemaining) {
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = static_cast<decltype(msg.msg_iovlen)>(std::min<size_t>(nRemaining, IOV_MAX));
+#if !USE_NETWORK_SOCKETS
+    if (nFds) {
+      // Descriptors go out with the first byte, and only once
+      memset(control.buf, 0, sizeof(control.buf));
+      msg.msg_control = control.buf;
+      msg.msg_controllen = CMSG_SPACE(sizeof(int) * nFds);
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nFds);
+      memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nFds);
+    }
+#endif
+
+    ssize_t nSent = ::sendmsg(m_socket, &msg, MSG_NOSIGNAL);
+    if (nSent < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+#if !USE_NETWORK_SOCKETS
+    nFds = 0;
+#endif
+
+    // Skip over everything that was fully sent, and trim whatever was partially sent
+    for (; nRemaining && static_cast<size_t>(nSent) >= iov->iov_len; iov++, nRemaining--)
+      nSent -= iov->iov_len;
+    if (nRemaining) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + nSent;
+      iov->iov_len -= nSent;
+    }
+  }
+  return true;
+}
+
+uint32_t IPCEndpointUnix::SupportedCapabilities(void) const {
+#if USE_NETWORK_SOCKETS
+  return IPCEndpoint::SupportedCapabilities();
+#else
+  return IPCEndpoint::SupportedCapabilities() | CAPABILITY_FILE_DESCRIPTORS;
+#endif
+}
+
 bool IPCEndpointUnix::Abort(Reason reason) {
-  int socket = m_socket.exchange(-1);
-  if (socket < 0) {
+  if (m_isAborted.exchange(true)) {
     return false;
   }
-  ::shutdown(socket, SHUT_RDWR);
-  ::close(socket);
+
+  // Shutting down wakes any thread blocked in recv or send on this socket.  The descriptor itself stays open
+  // until destruction so it can't be recycled out from under those threads.
+  ::shutdown(m_socket, SHUT_RDWR);
   Close(reason);
   return true;
 }
 
+bool IPCEndpointUnix::SetReceiveBufferSize(size_t size) {
+  // Readers use the buffer without a lock, so it can't be changed under them
+  if (m_hasReadBegun)
+    return false;
+
+  m_recvBufferSize = size;
+  if (m_recvHead == m_recvTail) {
+    // Anything handed back by the handshake stays where it is until it has been consumed
+    m_recvBuffer.resize(size);
+    m_recvBuffer.shrink_to_fit();
+    m_recvHead = 0;
+    m_recvTail = 0;
+  }
+  return true;
+}
+
+void IPCEndpointUnix::Unread(const void* data, size_t nBytes) {
+  const uint8_t* pData = static_cast<const uint8_t*>(data);
+  std::vector<uint8_t> buffer(pData, pData + nBytes);
+  buffer.insert(buffer.end(), m_recvBuffer.begin() + m_recvHead, m_recvBuffer.begin() + m_recvTail);
+  m_recvBuffer.swap(buffer);
+  m_recvHead = 0;
+  m_recvTail = m_recvBuffer.size();
+}
+
 void IPCEndpointUnix::SetDefaultOptions(int socket) {
 #if USE_NETWORK_SOCKETS
   const int so_enable = 1;
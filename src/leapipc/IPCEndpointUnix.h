@@ -3,6 +3,7 @@
 #include "IPCEndpoint.h"
 #include <atomic>
 #include <string>
+#include <vector>
 
 #include <sys/socket.h>
 #if !defined(MSG_NOSIGNAL)
@@ -22,13 +23,71 @@ public:
   // IPCEndpoint overrides:
   std::streamsize ReadRaw(void* buffer, std::streamsize size) override;
   bool WriteRaw(const void* pBuf, std::streamsize nBytes) override;
+  bool WriteRawV(const ConstBuffer* buffers, size_t count) override;
+  bool WriteRawFds(const ConstBuffer* buffers, size_t count, const int* fds, size_t nFds) override;
   bool Abort(Reason reason) override;
+  uint32_t SupportedCapabilities(void) const override;
 
   static void SetDefaultOptions(int socket);
 
+  // Suggested size of the user-space receive buffer, and the size used when the endpoint is serviced by a reactor
+  enum { DEFAULT_RECEIVE_BUFFER_SIZE = 16384 };
+
+  /// <summary>
+  /// Sets the size of the user-space receive buffer, or zero to disable receive buffering
+  /// </summary>
+  /// <returns>False if reading has already begun, in which case nothing is changed</returns>
+  /// <remarks>
+  /// Buffering is disabled by default.  When it is enabled, each recv call pulls as many bytes as the kernel
+  /// has ready, up to the buffer size, and subsequent header and payload reads are satisfied from memory.  Reads
+  /// at least as large as the buffer bypass it and go directly to the caller's memory.  The buffer is used by
+  /// whichever thread is reading without any lock, so this must be called before the first read, and must not
+  /// race with it.
+  /// </remarks>
+  bool SetReceiveBufferSize(size_t size);
+
+  /// <summary>
+  /// The number of receive system calls that have been made on this endpoint
+  /// </summary>
+  uint64_t ReceiveCallCount(void) const { return m_nReceiveCalls; }
+
 private:
-  // File descriptor of our socket
-  std::atomic<int> m_socket;
+  // File descriptor of our socket, closed on destruction
+  const int m_socket;
+
+  // Set once Abort has shut the socket down
+  std::atomic<bool> m_isAborted{ false };
+
+  // User-space receive buffer, the bytes in [m_recvHead, m_recvTail) have not yet been consumed.  The buffer
+  // is only refilled by ReadRaw if buffering is enabled.
+  size_t m_recvBufferSize = 0;
+  std::vector<uint8_t> m_recvBuffer;
+  size_t m_recvHead = 0;
+  size_t m_recvTail = 0;
+
+  std::atomic<uint64_t> m_nReceiveCalls{ 0 };
+
+  // Set by the first read, after which the receive buffer can no longer be changed
+  std::atomic<bool> m_hasReadBegun{ false };
+
+  // Single receive system call, blocks until at least one byte is available
+  std::streamsize Receive(void* buffer, std::streamsize size);
+
+  // Single receive system call that also takes in any descriptors that arrive with the data
+  ssize_t ReceiveMessage(void* buffer, size_t size, int flags);
+
+  // Takes in whatever the socket has ready without blocking and parses it into messages.  Returns false if the
+  // connection has been lost or the stream is corrupt.
+  bool ReceiveAvailable(const MessageHandler& onMessage);
+
+  // Puts bytes that were taken off the socket before this endpoint was created back in front of the stream
+  void Unread(const void* data, size_t nBytes);
+
+  // True if there are bytes in the receive buffer that have not yet been consumed
+  bool HasUnread(void) const { return m_recvHead != m_recvTail; }
+
+  friend class IPCHandshakeUnix;
+  friend class IPCReactorUnix;
 };
 
 }}
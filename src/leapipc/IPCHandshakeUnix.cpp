@@ -0,0 +1,214 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include "IPCHandshakeUnix.h"
+#include "IPCEndpointUnix.h"
+#if __linux__ && !USE_NETWORK_SOCKETS
+#include "SharedMemoryEndpointUnix.h"
+#endif
+
+#include <cstring>
+
+#include <errno.h>
+#include <poll.h>
+
+using namespace leap::ipc;
+
+// Listeners that predate the handshake never answer, so clients only wait briefly for them.  Clients send their
+// hello as soon as they connect, and so the listener doesn't wait any longer than that.
+static const std::chrono::milliseconds sc_helloTimeout{ 250 };
+
+// Once the listener has said hello it waits for the client's confirmation, which the client sends at the latest
+// when it gives up on the listener's hello.  A client that takes much longer than that has hung, and the
+// connection fails rather than either side guessing at what the other will use.
+static const std::chrono::milliseconds sc_confirmTimeout{ 1250 };
+
+static const uint32_t sc_handshakeChannel = IPCEndpoint::Header::NUMBER_OF_CHANNELS - 1;
+static const uint8_t sc_handshakeVersion = 0;
+
+// Handshake steps
+static const uint8_t sc_stepHello = 0;
+static const uint8_t sc_stepConfirm = 1;
+
+// Handshake frames are a header followed by a single extension: type, length, version, step, and four bytes of
+// capabilities
+static const size_t sc_frameSize = sizeof(IPCEndpoint::Header) + 8;
+
+namespace {
+  bool IsHandshakeHeader(const IPCEndpoint::Header& header) {
+    return
+      header.Validate() &&
+      header.Version() == 0 &&
+      header.Size() == sc_frameSize &&
+      header.PayloadSize() == 0 &&
+      !header.IsEndOfMessage() &&
+      header.IsChannel(sc_handshakeChannel);
+  }
+}
+
+uint32_t IPCHandshakeUnix::LocalCapabilities(size_t ringSize) {
+  uint32_t capabilities =
+    IPCEndpoint::CAPABILITY_EXTENDED_CHANNELS |
+    IPCEndpoint::CAPABILITY_TIMESTAMPS |
+    IPCEndpoint::CAPABILITY_MESSAGE_LENGTHS;
+#if !USE_NETWORK_SOCKETS
+  capabilities |= IPCEndpoint::CAPABILITY_FILE_DESCRIPTORS;
+#endif
+#if __linux__ && !USE_NETWORK_SOCKETS
+  if (ringSize)
+    capabilities |= IPCEndpoint::CAPABILITY_SHARED_MEMORY;
+#endif
+  return capabilities;
+}
+
+bool IPCHandshakeUnix::SendFrame(int socket, uint8_t step, uint32_t capabilities) {
+  // Not the end of a message, an older endpoint that is already reading the channel doesn't see it at all
+  IPCEndpoint::Header header;
+  header.SetChannel(sc_handshakeChannel);
+  header.size = sc_frameSize;
+
+  uint8_t frame[sc_frameSize];
+  static_assert(sizeof(frame) == sizeof(Frame::data), "Frame storage must hold a handshake frame");
+  memcpy(frame, &header, sizeof(header));
+  uint8_t* extension = frame + sizeof(header);
+  extension[0] = IPCEndpoint::Header::EXTENSION_CAPABILITIES;
+  extension[1] = 6;
+  extension[2] = sc_handshakeVersion;
+  extension[3] = step;
+  extension[4] = static_cast<uint8_t>(capabilities >> 24);
+  extension[5] = static_cast<uint8_t>(capabilities >> 16);
+  extension[6] = static_cast<uint8_t>(capabilities >> 8);
+  extension[7] = static_cast<uint8_t>(capabilities);
+
+  for (;;) {
+    const ssize_t nSent = ::send(socket, frame, sizeof(frame), MSG_NOSIGNAL);
+    if (nSent >= 0 || errno != EINTR)
+      return nSent == static_cast<ssize_t>(sizeof(frame));
+  }
+}
+
+bool IPCHandshakeUnix::Receive(int socket, std::chrono::steady_clock::time_point limit, uint8_t* buffer, size_t size, size_t& nRead) {
+  nRead = 0;
+  while (nRead < size) {
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(limit - std::chrono::steady_clock::now());
+    if (remaining.count() <= 0)
+      return true;
+
+    pollfd fds = { socket, POLLIN, 0 };
+    const int rs = ::poll(&fds, 1, static_cast<int>(remaining.count()));
+    if (rs < 0 && errno != EINTR)
+      return false;
+    if (rs <= 0)
+      continue;
+
+    const ssize_t n = ::recv(socket, buffer + nRead, size - nRead, MSG_DONTWAIT);
+    if (n == 0)
+      return false;
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        continue;
+      return false;
+    }
+    nRead += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool IPCHandshakeUnix::ReceiveFrame(int socket, std::chrono::milliseconds timeout, Frame& frame) {
+  // The header alone decides whether this is a handshake frame.  Only as much is taken off the socket as is
+  // needed to tell, anything else is handed back to the endpoint.
+  IPCEndpoint::Header header;
+  if (!Receive(socket, std::chrono::steady_clock::now() + timeout, frame.data, sizeof(header), frame.nRead))
+    return false;
+  if (frame.nRead < sizeof(header))
+    return true;
+  memcpy(&header, frame.data, sizeof(header));
+  if (!IsHandshakeHeader(header))
+    return true;
+
+  // The extension is sent along with the header, it's only a matter of it being received
+  size_t nExtension;
+  if (
+    !Receive(socket, std::chrono::steady_clock::now() + sc_confirmTimeout, frame.data + sizeof(header), sc_frameSize - sizeof(header), nExtension) ||
+    nExtension != sc_frameSize - sizeof(header)
+  )
+    return false;
+  frame.nRead += nExtension;
+
+  const uint8_t* extension = frame.data + sizeof(header);
+  if (
+    extension[0] != IPCEndpoint::Header::EXTENSION_CAPABILITIES ||
+    extension[1] != 6 ||
+    extension[2] != sc_handshakeVersion
+  )
+    return true;
+
+  frame.isHandshake = true;
+  frame.step = extension[3];
+  frame.capabilities =
+    (extension[4] << 24) +
+    (extension[5] << 16) +
+    (extension[6] << 8) +
+    extension[7];
+  return true;
+}
+
+std::shared_ptr<IPCEndpoint> IPCHandshakeUnix::Connect(int socket, size_t ringSize) {
+  const uint32_t local = LocalCapabilities(ringSize);
+  if (!SendFrame(socket, sc_stepHello, local))
+    return nullptr;
+
+  // What we confirm is what both sides use, even if the listener's hello turns up after we have stopped waiting
+  Frame hello;
+  if (!ReceiveFrame(socket, sc_helloTimeout, hello))
+    return nullptr;
+  const uint32_t agreed = hello.isHandshake && hello.step == sc_stepHello ? local & hello.capabilities : 0;
+  if (!SendFrame(socket, sc_stepConfirm, agreed))
+    return nullptr;
+  return Finish(socket, agreed, ringSize, true, hello);
+}
+
+std::shared_ptr<IPCEndpoint> IPCHandshakeUnix::Accept(int socket, size_t ringSize) {
+  Frame hello;
+  if (!ReceiveFrame(socket, sc_helloTimeout, hello))
+    return nullptr;
+  if (!hello.isHandshake || hello.step != sc_stepHello)
+    // A client that predates the handshake, we stay quiet and it gets nothing
+    return Finish(socket, 0, ringSize, false, hello);
+
+  const uint32_t local = LocalCapabilities(ringSize);
+  if (!SendFrame(socket, sc_stepHello, local))
+    return nullptr;
+
+  Frame confirm;
+  if (!ReceiveFrame(socket, sc_confirmTimeout, confirm) || !confirm.isHandshake || confirm.step != sc_stepConfirm)
+    return nullptr;
+  return Finish(socket, local & confirm.capabilities, ringSize, false, confirm);
+}
+
+std::shared_ptr<IPCEndpoint> IPCHandshakeUnix::Finish(int socket, uint32_t agreed, size_t ringSize, bool isClient, const Frame& first) {
+  std::shared_ptr<IPCEndpoint> endpoint;
+#if __linux__ && !USE_NETWORK_SOCKETS
+  if (agreed & IPCEndpoint::CAPABILITY_SHARED_MEMORY) {
+    // Both sides are expecting the ring negotiation, so neither waits on a timeout for the other
+    endpoint = isClient ?
+      SharedMemoryEndpointUnix::Offer(socket, ringSize) :
+      SharedMemoryEndpointUnix::Answer(socket, ringSize);
+    if (!endpoint)
+      return nullptr;
+
+    // Either side may still have fallen back to the socket, and the rings can't carry descriptors
+    if (std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(endpoint))
+      agreed &= ~IPCEndpoint::CAPABILITY_FILE_DESCRIPTORS;
+    else
+      agreed &= ~IPCEndpoint::CAPABILITY_SHARED_MEMORY;
+  }
+#endif
+  if (!endpoint) {
+    auto endpointUnix = std::make_shared<IPCEndpointUnix>(socket);
+    if (!first.isHandshake)
+      endpointUnix->Unread(first.data, first.nRead);
+    endpoint = endpointUnix;
+  }
+  endpoint->m_capabilities = agreed;
+  return endpoint;
+}
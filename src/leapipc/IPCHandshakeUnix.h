@@ -0,0 +1,85 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace leap {
+namespace ipc {
+
+class IPCEndpoint;
+
+/// <summary>
+/// Connection-time exchange of capabilities between a client and a listener
+/// </summary>
+/// <remarks>
+/// The client sends a hello frame listing the Capability flags it supports as soon as it connects.  A listener
+/// that receives it answers with a hello of its own, and the client then confirms the flags that both sides
+/// will use.  The client's confirmation is final: if the listener's hello doesn't arrive in time, the client
+/// confirms nothing and the listener goes along with that, so the two sides never disagree.  Handshake frames
+/// are empty frames on the last channel that don't end a message, with the capabilities in a header extension.
+/// An endpoint that predates the handshake skips over them, but if it hasn't started reading that channel yet
+/// it takes them for the start of a message and drops the first real one, so clients and listeners only use
+/// the handshake once it has been enabled on them.  A listener never says hello to a client that didn't, and
+/// treats it as supporting nothing.  Once both sides have agreed to use shared memory, the rings are negotiated
+/// as part of the same exchange.
+/// </remarks>
+class IPCHandshakeUnix
+{
+public:
+  /// <summary>
+  /// Connecting side of the handshake
+  /// </summary>
+  /// <param name="socket">A newly connected socket, ownership is taken by the returned endpoint</param>
+  /// <param name="ringSize">The size of shared memory rings to use, or zero if shared memory is not wanted</param>
+  /// <returns>The endpoint to use, or nullptr if the connection failed during the handshake</returns>
+  /// <remarks>
+  /// Against a listener that doesn't take part in the handshake, this waits a short while for a hello that
+  /// never comes.
+  /// </remarks>
+  static std::shared_ptr<IPCEndpoint> Connect(int socket, size_t ringSize);
+
+  /// <summary>
+  /// Listening side of the handshake
+  /// </summary>
+  /// <param name="socket">A newly accepted socket, ownership is taken by the returned endpoint</param>
+  /// <param name="ringSize">The size of shared memory rings to use, or zero if shared memory is not wanted</param>
+  /// <returns>The endpoint to use, or nullptr if the connection failed during the handshake</returns>
+  /// <remarks>
+  /// This blocks for as long as the client takes to say hello and confirm, and should not be called on a thread
+  /// that other connections are waiting on.
+  /// </remarks>
+  static std::shared_ptr<IPCEndpoint> Accept(int socket, size_t ringSize);
+
+  /// <summary>
+  /// The Capability flags this side of a connection supports
+  /// </summary>
+  static uint32_t LocalCapabilities(size_t ringSize);
+
+private:
+  // The first frame received from the peer
+  struct Frame {
+    // Bytes taken off the socket, a header and the capabilities extension for a handshake frame.  Anything
+    // else is the start of the peer's ordinary traffic.
+    uint8_t data[16];
+    size_t nRead = 0;
+
+    bool isHandshake = false;
+    uint8_t step = 0;
+    uint32_t capabilities = 0;
+  };
+
+  static bool SendFrame(int socket, uint8_t step, uint32_t capabilities);
+  static bool ReceiveFrame(int socket, std::chrono::milliseconds timeout, Frame& frame);
+
+  // Reads up to the specified number of bytes, stopping early only at the time limit.  Returns false if the
+  // connection failed.
+  static bool Receive(int socket, std::chrono::steady_clock::time_point limit, uint8_t* buffer, size_t size, size_t& nRead);
+
+  // Creates the endpoint for the agreed capabilities and records them on it.  If the first frame wasn't part of
+  // the handshake, it is handed back to the endpoint to be read as ordinary traffic.
+  static std::shared_ptr<IPCEndpoint> Finish(int socket, uint32_t agreed, size_t ringSize, bool isClient, const Frame& first);
+};
+
+}}
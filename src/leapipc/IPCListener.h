@@ -2,6 +2,8 @@
 #pragma once
 #include <autowiring/CoreThread.h>
 #include <autowiring/auto_signal.h>
+#include <cstddef>
+#include <memory>
 
 class CoreContext;
 
@@ -9,6 +11,7 @@ namespace leap {
 namespace ipc {
 
 class IPCEndpoint;
+class IPCReactor;
 
 /// <summary>
 /// Retrieves a scope that is known to be valid in test scenarios
@@ -39,7 +42,8 @@ public:
   // Handler invoked when a new client endpoint has been connected
   // At this point the context will not yet have been started.  It is an error for listeners on this routine
   // to initiate the passed context.  Listeners may inject anything they want into the passed context.  The
-  // first argument, the IPCEndpoint, is guaranteed to exist in the context.
+  // first argument, the IPCEndpoint, is guaranteed to exist in the context.  This is always raised from the
+  // listener's own thread, one client at a time, including when handshakes are enabled and run concurrently.
   autowiring::signal<void(const std::shared_ptr<IPCEndpoint>&)> onClientConnected;
 
   /// <summary>
@@ -62,6 +66,51 @@ public:
   static IPCListener* New(const char* pstrNamespace) {
     return New(nullptr, pstrNamespace);
   }
+
+  /// <summary>
+  /// Exchanges capabilities with clients as part of every connection
+  /// </summary>
+  /// <remarks>
+  /// Off by default, in which case the listener puts nothing on the wire but its own traffic and accepted
+  /// connections have no capabilities.  When enabled, the listener waits briefly for each client's hello before
+  /// raising onClientConnected, and a client that doesn't send one is treated as supporting nothing.  Clients
+  /// must enable the handshake as well for it to take place.  Where the platform has no handshake this has no
+  /// effect.
+  /// </remarks>
+  void EnableHandshake(bool enable = true) { m_isHandshakeEnabled = enable; }
+
+  /// <summary>
+  /// Allows clients to move their data through shared memory rather than through the socket
+  /// </summary>
+  /// <param name="ringSize">The size of the ring this side writes to, in bytes, or zero to disable</param>
+  /// <remarks>
+  /// The rings are negotiated as part of the handshake, see EnableHandshake.  Shared memory is only used for
+  /// clients that request it, and only where the platform supports it; all other connections use the socket.
+  /// Accepted endpoints behave identically either way.
+  /// </remarks>
+  void SetSharedMemoryRingSize(size_t ringSize) { m_sharedMemoryRingSize = ringSize; }
+
+  /// <summary>
+  /// Hands every connection this listener accepts to a reactor, rather than leaving them to be read by subscribers
+  /// </summary>
+  /// <param name="reactor">The reactor to add accepted connections to, or nullptr to stop doing so</param>
+  /// <remarks>
+  /// Each connection is added to the reactor once onClientConnected has been raised for it, and from then on the
+  /// reactor alone reads from it.  Subscribers may still write to these connections, but must not read from
+  /// them.  Reactors are only available on the platforms that provide IPCReactor::New, elsewhere this has no
+  /// effect.
+  /// </remarks>
+  void SetReactor(const std::shared_ptr<IPCReactor>& reactor) { m_reactor = reactor; }
+
+protected:
+  // True if connections begin with the capabilities handshake
+  bool m_isHandshakeEnabled = false;
+
+  // Size of the shared memory ring to allocate for each client that asks for one, zero if disabled
+  size_t m_sharedMemoryRingSize = 0;
+
+  // Reactor that accepted connections are handed to, if there is one
+  std::shared_ptr<IPCReactor> m_reactor;
 };
 
 }}
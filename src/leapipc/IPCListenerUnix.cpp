@@ -3,6 +3,10 @@
 #include "IPCListenerUnix.h"
 #include "FileMonitor.h"
 #include "IPCEndpointUnix.h"
+#include "IPCHandshakeUnix.h"
+#if __linux__
+#include "IPCReactor.h"
+#endif
 #include <autowiring/ContextEnumerator.h>
 
 #include <poll.h>
@@ -78,6 +82,9 @@ IPCListener* IPCListener::New(const char* pstrScope, const char* pstrNamespace)
   #pragma GCC diagnostic ignored "-Wunused-result"
 #endif
 
+// Written to the notification pipe when a handshake has finished, anything else stops the connection loop
+static const char sc_handshakeDone = '+';
+
 void IPCListenerUnix::OnStop(void) {
   (void)::write(m_sendFd, "_", 1);
 }
@@ -219,9 +226,14 @@ void IPCListenerUnix::Run(void) {
 
       if (fds[0].revents & POLLRDNORM) {
         // We received a message from the other end of our pipe, consume it
-        char msg;
+        char msg = 0;
         (void)::read(m_recvFd, &msg, 1);
-        break;
+        if (msg != sc_handshakeDone)
+          break;
+
+        // A handshake finished, its client is connected from here like any other
+        ReapHandshakes(false);
+        continue;
       }
 
       // Other descriptor is present in the array, we can accept a connection
@@ -230,8 +242,70 @@ void IPCListenerUnix::Run(void) {
         // Server socket is dead, need to regenerate
         break;
 
-      // Create the context and inject the Unix IPC endpoint into it
-      onClientConnected(std::make_shared<IPCEndpointUnix>(client));
+      ReapHandshakes(false);
+      if (m_isHandshakeEnabled)
+        BeginHandshake(client);
+      else
+        // Create the context and inject the Unix IPC endpoint into it
+        OnConnected(std::make_shared<IPCEndpointUnix>(client));
+    }
+  }
+  ReapHandshakes(true);
+}
+
+void IPCListenerUnix::BeginHandshake(int client) {
+  std::lock_guard<std::mutex> lock(m_handshakeLock);
+  auto handshake = m_handshakes.emplace(m_handshakes.end());
+  handshake->socket = client;
+  handshake->thread = std::thread(
+    [this, handshake, client] {
+      // Agree on capabilities with the client, including shared memory rings if both sides want them
+      std::shared_ptr<IPCEndpoint> endpoint = IPCHandshakeUnix::Accept(client, m_sharedMemoryRingSize);
+      if (!endpoint)
+        // Client went away in the middle of the handshake
+        ::close(client);
+
+      // The listener thread raises onClientConnected, so that subscribers see one client at a time no matter how
+      // many handshakes are under way
+      {
+        std::lock_guard<std::mutex> lock(m_handshakeLock);
+        handshake->socket = -1;
+        handshake->endpoint = endpoint;
+        handshake->isDone = true;
+      }
+      (void)::write(m_sendFd, &sc_handshakeDone, 1);
     }
+  );
+}
+
+void IPCListenerUnix::OnConnected(const std::shared_ptr<IPCEndpoint>& endpoint) {
+  onClientConnected(endpoint);
+
+#if __linux__
+  // Let the reactor service this connection, if we were asked to, rather than dedicating a thread to it
+  if (m_reactor)
+    m_reactor->Add(endpoint);
+#endif
+}
+
+void IPCListenerUnix::ReapHandshakes(bool isStopping) {
+  std::list<Handshake> finished;
+  {
+    std::lock_guard<std::mutex> lock(m_handshakeLock);
+    for (auto q = m_handshakes.begin(); q != m_handshakes.end();) {
+      if (isStopping && q->socket >= 0)
+        // Wakes the handshake up, it fails as though the client had gone away
+        ::shutdown(q->socket, SHUT_RDWR);
+      if (isStopping || q->isDone)
+        // Entries move without being copied, so the threads still running can keep using theirs
+        finished.splice(finished.end(), m_handshakes, q++);
+      else
+        ++q;
+    }
+  }
+  for (auto& handshake : finished) {
+    handshake.thread.join();
+    if (handshake.endpoint && !isStopping && !ShouldStop())
+      OnConnected(handshake.endpoint);
   }
 }
@@ -2,6 +2,9 @@
 #pragma once
 #include "IPCListener.h"
 #include <autowiring/autowiring.h>
+#include <list>
+#include <mutex>
+#include <thread>
 #include FILESYSTEM_HEADER
 
 namespace leap {
@@ -42,6 +45,29 @@ private:
     operator bool(void) const { return ok; }
   };
 
+  // A connection that is still being set up on its own thread, so that a slow client doesn't hold up the rest
+  struct Handshake {
+    // The accepted socket, until the handshake is done with it
+    int socket = -1;
+    bool isDone = false;
+    std::thread thread;
+
+    // The connected endpoint once the handshake has succeeded, for the listener thread to hand over
+    std::shared_ptr<IPCEndpoint> endpoint;
+  };
+  std::mutex m_handshakeLock;
+  std::list<Handshake> m_handshakes;
+
+  // Hands a newly connected endpoint over to our subscribers
+  void OnConnected(const std::shared_ptr<IPCEndpoint>& endpoint);
+
+  // Starts the handshake with a newly accepted client
+  void BeginHandshake(int client);
+
+  // Joins handshake threads that have finished and raises onClientConnected for the clients that made it.  When
+  // stopping, the rest are cut short and joined as well, and nobody is told about them.
+  void ReapHandshakes(bool isStopping);
+
   void OnStop(void) override;
 
 protected:
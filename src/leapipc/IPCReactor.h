@@ -0,0 +1,55 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#pragma once
+#include "MessageBuffers.h"
+#include <autowiring/CoreThread.h>
+#include <autowiring/auto_signal.h>
+#include <memory>
+
+namespace leap {
+namespace ipc {
+
+class IPCEndpoint;
+
+/// <summary>
+/// Event-driven receiver that services many endpoints from a single thread
+/// </summary>
+/// <remarks>
+/// An endpoint that has been added to a reactor is read exclusively by the reactor; channels acquired on it
+/// may still be used for writing, but must not be used for reading.  A listener can be asked to add every
+/// connection it accepts, see IPCListener::SetReactor.  Only socket endpoints can be serviced, Add fails for
+/// shared memory endpoints.  File descriptors attached to messages are not delivered
+/// through onMessage and are closed on arrival.  The reactor is currently available on Linux only.
+/// </remarks>
+class IPCReactor:
+  public CoreThread
+{
+public:
+  IPCReactor(void);
+  virtual ~IPCReactor(void);
+
+  /// <summary>
+  /// Signal asserted on the reactor thread whenever a complete message arrives on one of its endpoints
+  /// </summary>
+  autowiring::signal<void(const std::shared_ptr<IPCEndpoint>& endpoint, uint32_t channel, MessageBuffers::Buffers& buffers)> onMessage;
+
+  /// <summary>
+  /// Begins servicing the passed endpoint
+  /// </summary>
+  /// <returns>False if the endpoint's transport cannot be serviced by this reactor</returns>
+  virtual bool Add(const std::shared_ptr<IPCEndpoint>& endpoint) = 0;
+
+  /// <summary>
+  /// Stops servicing the passed endpoint
+  /// </summary>
+  /// <remarks>
+  /// Endpoints are removed automatically when their connection is lost.
+  /// </remarks>
+  virtual void Remove(const std::shared_ptr<IPCEndpoint>& endpoint) = 0;
+
+  /// <summary>
+  /// Creates a new reactor for the current platform
+  /// </summary>
+  static IPCReactor* New(void);
+};
+
+}}
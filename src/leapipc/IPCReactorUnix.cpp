@@ -0,0 +1,155 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include "IPCReactorUnix.h"
+#include "IPCEndpointUnix.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+using namespace leap::ipc;
+
+IPCReactor::IPCReactor(void) :
+  CoreThread("IPCReactor")
+{
+}
+
+IPCReactor::~IPCReactor(void)
+{
+}
+
+IPCReactor* IPCReactor::New(void) {
+  return new IPCReactorUnix;
+}
+
+IPCReactorUnix::IPCReactorUnix(void) :
+  m_epoll(::epoll_create1(EPOLL_CLOEXEC)),
+  m_wakeFd(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+  if (m_epoll < 0 || m_wakeFd < 0)
+    throw std::runtime_error("Failed to create the descriptors needed by the IPC reactor");
+
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = m_wakeFd;
+  ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &ev);
+}
+
+IPCReactorUnix::~IPCReactorUnix(void)
+{
+  ::close(m_wakeFd);
+  ::close(m_epoll);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+  // gcc disregards (void) cast in this case
+  #pragma GCC diagnostic ignored "-Wunused-result"
+#endif
+
+bool IPCReactorUnix::Add(const std::shared_ptr<IPCEndpoint>& endpoint) {
+  auto endpointUnix = std::dynamic_pointer_cast<IPCEndpointUnix>(endpoint);
+  if (!endpointUnix || endpointUnix->IsClosed())
+    return false;
+
+  const int socket = endpointUnix->m_socket;
+  std::lock_guard<std::mutex> lock(m_lock);
+  if (!m_endpoints.emplace(socket, endpointUnix).second)
+    return false;
+
+  epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.fd = socket;
+  if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, socket, &ev) < 0) {
+    m_endpoints.erase(socket);
+    return false;
+  }
+  if (endpointUnix->HasUnread()) {
+    m_unread.push_back(socket);
+    const uint64_t one = 1;
+    (void)::write(m_wakeFd, &one, sizeof(one));
+  }
+  return true;
+}
+
+void IPCReactorUnix::Remove(const std::shared_ptr<IPCEndpoint>& endpoint) {
+  auto endpointUnix = std::dynamic_pointer_cast<IPCEndpointUnix>(endpoint);
+  if (endpointUnix)
+    Remove(endpointUnix->m_socket);
+}
+
+void IPCReactorUnix::Remove(int socket) {
+  // Declared ahead of the lock so that the endpoint is released outside of it
+  std::shared_ptr<IPCEndpointUnix> endpoint;
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto q = m_endpoints.find(socket);
+  if (q == m_endpoints.end())
+    return;
+
+  // Deregister before the endpoint can be destroyed and its descriptor closed
+  ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, socket, nullptr);
+  endpoint = std::move(q->second);
+  m_endpoints.erase(q);
+}
+
+void IPCReactorUnix::OnStop(void) {
+  const uint64_t one = 1;
+  (void)::write(m_wakeFd, &one, sizeof(one));
+}
+
+void IPCReactorUnix::Run(void) {
+  epoll_event events[64];
+  while (!ShouldStop()) {
+    const int nEvents = ::epoll_wait(m_epoll, events, sizeof(events) / sizeof(*events), -1);
+    if (nEvents < 0) {
+      if (errno == EINTR)
+        continue;
+      // Something went wrong, cannot proceed
+      break;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+      const int socket = events[i].data.fd;
+      if (socket != m_wakeFd) {
+        Service(socket);
+        continue;
+      }
+
+      // Woken up to stop or to look at new endpoints with buffered bytes, consume the wakeup and let the loop
+      // condition decide
+      uint64_t value;
+      (void)::read(m_wakeFd, &value, sizeof(value));
+      std::vector<int> unread;
+      {
+        std::lock_guard<std::mutex> lock(m_lock);
+        unread.swap(m_unread);
+      }
+      for (int unreadSocket : unread)
+        Service(unreadSocket);
+    }
+  }
+}
+
+void IPCReactorUnix::Service(int socket) {
+  std::shared_ptr<IPCEndpointUnix> endpoint;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto q = m_endpoints.find(socket);
+    if (q == m_endpoints.end())
+      // Removed since epoll_wait returned
+      return;
+    endpoint = q->second;
+  }
+
+  const bool ok = endpoint->ReceiveAvailable(
+    [this, &endpoint] (uint32_t channel, MessageBuffers::Buffers& buffers) {
+      onMessage(endpoint, channel, buffers);
+    }
+  );
+  if (!ok) {
+    Remove(socket);
+    endpoint->Abort(IPCEndpoint::Reason::ConnectionLost);
+  }
+}
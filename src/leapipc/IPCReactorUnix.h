@@ -0,0 +1,54 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#pragma once
+#include "IPCReactor.h"
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace leap {
+namespace ipc {
+
+class IPCEndpointUnix;
+
+/// <summary>
+/// epoll-based reactor implementation
+/// </summary>
+class IPCReactorUnix:
+  public IPCReactor
+{
+public:
+  IPCReactorUnix(void);
+  virtual ~IPCReactorUnix(void);
+
+  // IPCReactor overrides:
+  bool Add(const std::shared_ptr<IPCEndpoint>& endpoint) override;
+  void Remove(const std::shared_ptr<IPCEndpoint>& endpoint) override;
+
+private:
+  // Descriptor of our epoll instance
+  const int m_epoll;
+
+  // Event descriptor used to wake up the reactor thread
+  const int m_wakeFd;
+
+  // Endpoints being serviced, keyed by socket
+  std::mutex m_lock;
+  std::unordered_map<int, std::shared_ptr<IPCEndpointUnix>> m_endpoints;
+
+  // Sockets whose endpoints were added with bytes already buffered, which the socket itself won't signal
+  std::vector<int> m_unread;
+
+  // Removes the endpoint registered on the specified socket, if there is one
+  void Remove(int socket);
+
+  // Receives whatever the endpoint registered on the specified socket has ready, if there is one
+  void Service(int socket);
+
+  void OnStop(void) override;
+
+protected:
+  // CoreThread overrides:
+  void Run(void) override;
+};
+
+}}
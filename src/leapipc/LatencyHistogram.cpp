@@ -0,0 +1,60 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include "LatencyHistogram.h"
+#include <cmath>
+#include <cstring>
+
+using namespace leap::ipc;
+
+LatencyHistogram::LatencyHistogram(void) {
+  memset(m_buckets, 0, sizeof(m_buckets));
+}
+
+size_t LatencyHistogram::BucketOf(uint64_t value) {
+  if (value < LINEAR_LIMIT)
+    return static_cast<size_t>(value);
+
+  // Position of the highest set bit, then the next SUB_BUCKET_BITS bits below it pick the sub-bucket
+  size_t exponent = 4;
+  while (exponent < 63 && (value >> (exponent + 1)))
+    exponent++;
+  const size_t subBucket = static_cast<size_t>(value >> (exponent - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1);
+  return LINEAR_LIMIT + ((exponent - 4) << SUB_BUCKET_BITS) + subBucket;
+}
+
+uint64_t LatencyHistogram::UpperBoundOf(size_t bucket) {
+  if (bucket < LINEAR_LIMIT)
+    return bucket;
+
+  const size_t exponent = 4 + ((bucket - LINEAR_LIMIT) >> SUB_BUCKET_BITS);
+  const uint64_t subBucket = (bucket - LINEAR_LIMIT) & ((1 << SUB_BUCKET_BITS) - 1);
+  const uint64_t width = uint64_t(1) << (exponent - SUB_BUCKET_BITS);
+  return (uint64_t(1) << exponent) + (subBucket + 1) * width - 1;
+}
+
+void LatencyHistogram::Record(std::chrono::nanoseconds value) {
+  const uint64_t ns = value.count() > 0 ? static_cast<uint64_t>(value.count()) : 0;
+  m_buckets[BucketOf(ns)]++;
+  m_count++;
+  if (ns > m_max)
+    m_max = ns;
+}
+
+std::chrono::nanoseconds LatencyHistogram::Percentile(double fraction) const {
+  if (!m_count)
+    return std::chrono::nanoseconds(0);
+
+  uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * m_count));
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < NUMBER_OF_BUCKETS; i++) {
+    seen += m_buckets[i];
+    if (seen >= rank) {
+      // The top bucket can't report more than has actually been seen
+      const uint64_t bound = UpperBoundOf(i);
+      return std::chrono::nanoseconds(bound < m_max ? bound : m_max);
+    }
+  }
+  return std::chrono::nanoseconds(m_max);
+}
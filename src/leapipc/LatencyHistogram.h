@@ -0,0 +1,57 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace leap {
+namespace ipc {
+
+/// <summary>
+/// Log-linear histogram of durations
+/// </summary>
+/// <remarks>
+/// Each power of two is split into eight buckets, so a reported value is within 12.5% of the recorded values
+/// it stands for.  Values below 16ns are exact.  Recording is constant time and allocation free.  This type
+/// is not thread safe.
+/// </remarks>
+class LatencyHistogram
+{
+public:
+  LatencyHistogram(void);
+
+  /// <summary>
+  /// Adds one duration to the histogram, negative durations are recorded as zero
+  /// </summary>
+  void Record(std::chrono::nanoseconds value);
+
+  /// <summary>
+  /// Returns the smallest recorded value that at least the passed fraction of recorded values are no larger than
+  /// </summary>
+  /// <param name="fraction">The percentile as a fraction, for example 0.99 for the 99th percentile</param>
+  /// <returns>The upper bound of the bucket holding that value, or zero if nothing has been recorded</returns>
+  std::chrono::nanoseconds Percentile(double fraction) const;
+
+  /// <returns>The number of values recorded</returns>
+  uint64_t Count(void) const { return m_count; }
+
+  /// <returns>The largest value recorded, exactly</returns>
+  std::chrono::nanoseconds Max(void) const { return std::chrono::nanoseconds(m_max); }
+
+private:
+  // Eight sub-buckets for every power of two from 16ns upwards, and exact buckets below that
+  enum {
+    SUB_BUCKET_BITS = 3,
+    LINEAR_LIMIT = 16,
+    NUMBER_OF_BUCKETS = LINEAR_LIMIT + (64 - 4) * (1 << SUB_BUCKET_BITS)
+  };
+
+  static size_t BucketOf(uint64_t value);
+  static uint64_t UpperBoundOf(size_t bucket);
+
+  uint64_t m_buckets[NUMBER_OF_BUCKETS];
+  uint64_t m_count = 0;
+  uint64_t m_max = 0;
+};
+
+}}
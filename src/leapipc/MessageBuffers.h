@@ -1,39 +1,66 @@
 // Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
 #pragma once
+#include "SlabAllocator.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
 #include <autowiring/ContextMember.h>
-#include <autowiring/ObjectPool.h>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
 namespace leap {
 namespace ipc {
 
 namespace MessageBuffers {
+  // Where the payload of a buffer with inline storage was placed, filled in once its block has been allocated
+  struct InlineStorage {
+    void* data = nullptr;
+    size_t nBytes = 0;
+    bool isHit = false;
+  };
+
   template<typename T>
   class RawBuffer {
   public:
-    RawBuffer(size_t size = 0, T* data = nullptr) : m_data(data), m_allocatedSize(0), m_size(size), m_isOwner(false) {
+    RawBuffer(size_t size = 0, T* data = nullptr) : m_data(data), m_size(size), m_allocatedSize(0), m_isOwner(false) {
       if (!m_data) {
         m_isOwner = true;
         m_data = new T[m_size];
         m_allocatedSize = m_size;
       }
     }
+
+    // Storage that shares an allocation with this buffer, and goes away along with it
+    RawBuffer(size_t size, const InlineStorage& storage) :
+      m_data(static_cast<T*>(storage.data)),
+      m_size(size),
+      m_allocatedSize(storage.nBytes / sizeof(T)),
+      m_isOwner(true),
+      m_isInline(true)
+    {}
+
     ~RawBuffer() {
-      if (m_isOwner) {
-        delete [] m_data;
-      }
+      Release();
     }
 
     RawBuffer(const RawBuffer&) = delete;
     RawBuffer& operator=(const RawBuffer&) = delete;
 
-    RawBuffer(RawBuffer&& rhs) {
-      swap(rhs);
+    RawBuffer(RawBuffer&& rhs) : m_data(nullptr), m_size(0), m_allocatedSize(0), m_isOwner(false) {
+      Take(rhs);
     }
 
     RawBuffer& operator=(RawBuffer&& rhs) {
-      swap(rhs);
+      if (this != &rhs) {
+        Release();
+        Take(rhs);
+      }
       return *this;
     }
 
@@ -56,10 +83,11 @@ namespace MessageBuffers {
             data[i] = std::move(m_data[i]);
           }
         }
+        Release();
         m_allocatedSize = size;
         m_size = size;
-        delete [] m_data;
         m_data = data;
+        m_isInline = false;
       }
       return true;
     }
@@ -67,52 +95,326 @@ namespace MessageBuffers {
     size_t Size() const { return m_size; }
     T* Data() const { return m_data; }
 
+    // The size this buffer can be resized to without reallocating
+    size_t AllocatedSize() const { return m_allocatedSize; }
+
     bool HasOwnership() const { return m_isOwner; }
 
   private:
-    void swap(RawBuffer&& rhs) {
-      T* t_data = m_data;
-      size_t t_size = m_size;
-      bool t_isOwner = m_isOwner;
+    // Takes over the contents of rhs, leaving it empty.  Inline storage is part of the allocation that rhs lives
+    // in and goes away with it, so its contents are moved to storage of our own rather than taken over.
+    void Take(RawBuffer& rhs) {
+      if (rhs.m_isInline) {
+        m_data = new T[rhs.m_size];
+        std::move(rhs.m_data, rhs.m_data + rhs.m_size, m_data);
+        m_size = rhs.m_size;
+        m_allocatedSize = rhs.m_size;
+        m_isOwner = true;
+        m_isInline = false;
+        rhs.m_size = 0;
+        return;
+      }
+
       m_data = rhs.m_data;
       m_size = rhs.m_size;
+      m_allocatedSize = rhs.m_allocatedSize;
       m_isOwner = rhs.m_isOwner;
-      rhs.m_data = t_data;
-      rhs.m_size = t_size;
-      rhs.m_isOwner = t_isOwner;
+      m_isInline = false;
+      rhs.m_data = nullptr;
+      rhs.m_size = 0;
+      rhs.m_allocatedSize = 0;
+      rhs.m_isOwner = false;
+    }
+
+    void Release() {
+      if (m_isOwner && !m_isInline) {
+        delete [] m_data;
+      }
     }
 
     T* m_data;
     size_t m_size;
     size_t m_allocatedSize;
     bool m_isOwner;
+    bool m_isInline = false;
   };
 
   using Buffer = RawBuffer<uint8_t>;
   using SharedBuffer = std::shared_ptr<Buffer>;
   using Buffers = std::vector<SharedBuffer>;
 
+  // Allocates a shared_ptr control block with room for an aligned payload right behind it
+  template<typename U>
+  class InlineAllocator {
+  public:
+    typedef U value_type;
+
+    InlineAllocator(InlineStorage& storage, size_t nBytes) : m_storage(&storage), m_nBytes(nBytes) {}
+    template<typename V>
+    InlineAllocator(const InlineAllocator<V>& rhs) : m_storage(rhs.m_storage), m_nBytes(rhs.m_nBytes) {}
+
+    U* allocate(size_t n) {
+      const size_t offset = Offset(n);
+      const size_t blockSize = SlabAllocator::BlockSize(offset + m_nBytes);
+      uint8_t* block = static_cast<uint8_t*>(SlabAllocator::Allocate(blockSize, &m_storage->isHit));
+
+      // Whatever the slab rounded the block up by is room for the payload to grow into
+      m_storage->data = block + offset;
+      m_storage->nBytes = blockSize - offset;
+      return reinterpret_cast<U*>(block);
+    }
+
+    void deallocate(U* p, size_t n) {
+      SlabAllocator::Free(p, Offset(n) + m_nBytes);
+    }
+
+    template<typename V>
+    bool operator==(const InlineAllocator<V>& rhs) const { return m_nBytes == rhs.m_nBytes; }
+    template<typename V>
+    bool operator!=(const InlineAllocator<V>& rhs) const { return m_nBytes != rhs.m_nBytes; }
+
+  private:
+    template<typename V>
+    friend class InlineAllocator;
+
+    static size_t Offset(size_t n) {
+      const size_t alignment = alignof(std::max_align_t);
+      return (n * sizeof(U) + alignment - 1) & ~(alignment - 1);
+    }
+
+    // Only used while the block is being allocated, the control block keeps a copy of this allocator
+    InlineStorage* m_storage;
+    size_t m_nBytes;
+  };
+
+  /// <summary>
+  /// Creates a buffer whose shared_ptr control block and payload are a single allocation
+  /// </summary>
+  /// <param name="isHit">Optionally receives true if the allocation was satisfied without going to the heap</param>
+  /// <remarks>
+  /// The payload is aligned for any type.  Allocations come from the SlabAllocator, so buffers that are created
+  /// and released at a steady rate stop allocating altogether.  The buffer can be resized up to its allocated
+  /// size in place, and is moved to a separate allocation if it grows beyond that.
+  /// </remarks>
+  template<typename T>
+  std::shared_ptr<RawBuffer<T>> MakeRawBuffer(size_t size, bool* isHit = nullptr) {
+    static_assert(std::is_trivial<T>::value, "Inline storage is not constructed, only trivial types may use it");
+    InlineStorage storage;
+    auto buffer = std::allocate_shared<RawBuffer<T>>(InlineAllocator<RawBuffer<T>>(storage, size * sizeof(T)), size, storage);
+    if (isHit)
+      *isHit = storage.isHit;
+    return buffer;
+  }
+
+  /// <summary>
+  /// Equivalent to std::make_shared&lt;Buffer&gt;(size), but with a single allocation
+  /// </summary>
+  inline SharedBuffer MakeBuffer(size_t size) {
+    return MakeRawBuffer<uint8_t>(size);
+  }
+
   template<typename T>
   class RawBufferPool : public ContextMember {
   public:
+    // Defaults for how much memory idle large buffers may hold, and for how long
+    enum {
+      DEFAULT_BUDGET = 64 * 1024 * 1024,
+      DEFAULT_IDLE_TIMEOUT_MS = 10000
+    };
+
+    RawBufferPool(void) :
+      m_large(std::make_shared<LargeBuffers>())
+    {}
+
+    struct Statistics {
+      // Buffers handed out without allocating any storage for them
+      uint64_t hits;
+
+      // Buffers whose storage had to be allocated from the heap
+      uint64_t misses;
+
+      // Bytes held by large buffers, in use or idle, now and at the most there have ever been
+      uint64_t residentBytes;
+      uint64_t peakResidentBytes;
+
+      // Bytes held by idle large buffers kept for reuse
+      uint64_t idleBytes;
+
+      // Bytes the process-wide SlabAllocator holds for small buffers, in use or free, and the free ones in its
+      // depot and thread caches.  These are shared with every other pool.
+      uint64_t slabResidentBytes;
+      uint64_t slabIdleBytes;
+    };
+
     std::shared_ptr<RawBuffer<T>> Get(size_t size) {
-#if _MSC_VER
-      static const size_t s_maxAllocatedBufferSize = 4096; // 4KB or smaller on Windows
-#else
-      static const size_t s_maxAllocatedBufferSize = 127*1024; // 127KB or smaller on Mac
-#endif
-      if (size <= s_maxAllocatedBufferSize) {
-        return std::make_shared<MessageBuffers::Buffer>(size);
+      const size_t nBytes = size * sizeof(T);
+      if (nBytes <= SlabAllocator::MAX_BLOCK_SIZE) {
+        // Small buffers come from the slabs, together with their control blocks
+        bool isHit;
+        auto buffer = MakeRawBuffer<T>(size, &isHit);
+        (isHit ? m_hits : m_misses).fetch_add(1, std::memory_order_relaxed);
+        return buffer;
       }
-      auto sb = m_pool();
-      if (sb && !sb->Resize(size, false)) {
-        sb.reset();
+
+      std::unique_ptr<RawBuffer<T>> buffer;
+      std::vector<std::unique_ptr<RawBuffer<T>>> freed;
+      {
+        std::lock_guard<std::mutex> lk(m_large->lock);
+
+        // The smallest idle buffer that fits, as long as the request would use at least half of it.  A huge
+        // buffer is never kept alive by a stream of much smaller requests, and ages out instead.
+        auto best = m_large->idle.end();
+        for (auto q = m_large->idle.begin(); q != m_large->idle.end(); ++q) {
+          const size_t allocated = q->buffer->AllocatedSize();
+          if (allocated >= size && allocated / 2 <= size && (best == m_large->idle.end() || allocated < best->buffer->AllocatedSize()))
+            best = q;
+        }
+        if (best != m_large->idle.end()) {
+          buffer = std::move(best->buffer);
+          m_large->idleBytes -= buffer->AllocatedSize() * sizeof(T);
+          m_large->idle.erase(best);
+        }
+        m_large->TrimUnsafe(freed);
+      }
+
+      const bool isHit = !!buffer;
+      (isHit ? m_hits : m_misses).fetch_add(1, std::memory_order_relaxed);
+      if (buffer)
+        buffer->Resize(size, false);
+      else
+        buffer.reset(new RawBuffer<T>(size));
+
+      // Charged for what it holds now, the buffer's owner may still grow it
+      const size_t charged = buffer->AllocatedSize() * sizeof(T);
+      {
+        std::lock_guard<std::mutex> lk(m_large->lock);
+        m_large->inUseBytes += charged;
+        m_large->peakBytes = std::max(m_large->peakBytes, m_large->inUseBytes + m_large->idleBytes);
       }
-      return sb;
+
+      std::weak_ptr<LargeBuffers> large = m_large;
+      return std::shared_ptr<RawBuffer<T>>(
+        buffer.release(),
+        [large, charged] (RawBuffer<T>* p) { LargeBuffers::Return(large, p, charged); },
+        SlabAllocator::Allocator<RawBuffer<T>>()
+      );
+    }
+
+    /// <summary>
+    /// Sets the most memory that idle large buffers may hold, in bytes
+    /// </summary>
+    /// <remarks>
+    /// Free small blocks held by the SlabAllocator, in its depot or in thread caches, count against the budget
+    /// too, and since they are the cheapest to allocate again they are given back to the heap first.  After that, the large buffers that
+    /// have been idle longest are freed.  A buffer larger than the whole budget is freed as soon as it is
+    /// returned.
+    /// </remarks>
+    void SetBudget(size_t budget) {
+      std::vector<std::unique_ptr<RawBuffer<T>>> freed;
+      std::lock_guard<std::mutex> lk(m_large->lock);
+      m_large->budget = budget;
+      m_large->TrimUnsafe(freed);
+    }
+
+    /// <summary>
+    /// Sets how long a large buffer may stay idle before it is freed
+    /// </summary>
+    /// <remarks>
+    /// The pool has no thread of its own.  Expired buffers are freed the next time a large buffer is taken
+    /// from or returned to the pool, or when Trim is called.
+    /// </remarks>
+    void SetIdleTimeout(std::chrono::milliseconds timeout) {
+      std::vector<std::unique_ptr<RawBuffer<T>>> freed;
+      std::lock_guard<std::mutex> lk(m_large->lock);
+      m_large->idleTimeout = timeout;
+      m_large->TrimUnsafe(freed);
+    }
+
+    /// <summary>
+    /// Frees idle large buffers that have expired, and idle memory that exceeds the budget
+    /// </summary>
+    void Trim(void) {
+      std::vector<std::unique_ptr<RawBuffer<T>>> freed;
+      std::lock_guard<std::mutex> lk(m_large->lock);
+      m_large->TrimUnsafe(freed);
+    }
+
+    /// <summary>
+    /// Counts of the buffers this pool has handed out, and the memory held by its large buffers
+    /// </summary>
+    /// <remarks>
+    /// Small buffers are drawn from the process-wide SlabAllocator, which is reported separately.
+    /// </remarks>
+    Statistics GetStatistics(void) const {
+      Statistics statistics{ m_hits.load(std::memory_order_relaxed), m_misses.load(std::memory_order_relaxed), 0, 0, 0, 0, 0 };
+      const SlabAllocator::Statistics slab = SlabAllocator::GetStatistics();
+      statistics.slabResidentBytes = slab.residentBytes;
+      statistics.slabIdleBytes = slab.depotBytes + slab.cachedBytes;
+      std::lock_guard<std::mutex> lk(m_large->lock);
+      statistics.residentBytes = m_large->inUseBytes + m_large->idleBytes;
+      statistics.peakResidentBytes = m_large->peakBytes;
+      statistics.idleBytes = m_large->idleBytes;
+      return statistics;
     }
 
   private:
-    ObjectPool<RawBuffer<T>> m_pool;
+    // Large buffers are tracked here rather than by the pool itself, buffers that are still in use when the
+    // pool goes away find it gone and simply free themselves
+    struct LargeBuffers {
+      struct Idle {
+        std::chrono::steady_clock::time_point since;
+        std::unique_ptr<RawBuffer<T>> buffer;
+      };
+
+      std::mutex lock;
+
+      // Idle buffers, in the order they were returned
+      std::deque<Idle> idle;
+
+      size_t budget = DEFAULT_BUDGET;
+      std::chrono::steady_clock::duration idleTimeout = std::chrono::milliseconds(DEFAULT_IDLE_TIMEOUT_MS);
+      uint64_t inUseBytes = 0;
+      uint64_t idleBytes = 0;
+      uint64_t peakBytes = 0;
+
+      // Moves expired and over-budget buffers into freed, so that they are freed once the lock is released.
+      // Over-budget slab blocks are freed right away.
+      void TrimUnsafe(std::vector<std::unique_ptr<RawBuffer<T>>>& freed) {
+        const SlabAllocator::Statistics slab = SlabAllocator::GetStatistics();
+        uint64_t slabIdleBytes = slab.depotBytes + slab.cachedBytes;
+        if (idleBytes + slabIdleBytes > budget)
+          slabIdleBytes = SlabAllocator::Trim(budget > idleBytes ? static_cast<size_t>(budget - idleBytes) : 0);
+
+        const auto now = std::chrono::steady_clock::now();
+        while (!idle.empty() && (idleBytes + slabIdleBytes > budget || now - idle.front().since > idleTimeout)) {
+          idleBytes -= idle.front().buffer->AllocatedSize() * sizeof(T);
+          freed.push_back(std::move(idle.front().buffer));
+          idle.pop_front();
+        }
+      }
+
+      static void Return(const std::weak_ptr<LargeBuffers>& weak, RawBuffer<T>* p, size_t charged) {
+        std::unique_ptr<RawBuffer<T>> buffer(p);
+        auto large = weak.lock();
+        if (!large)
+          return;
+
+        std::vector<std::unique_ptr<RawBuffer<T>>> freed;
+        std::lock_guard<std::mutex> lk(large->lock);
+        large->inUseBytes -= charged;
+        const size_t nBytes = buffer->AllocatedSize() * sizeof(T);
+        if (nBytes <= large->budget) {
+          large->idleBytes += nBytes;
+          large->idle.push_back(Idle{ std::chrono::steady_clock::now(), std::move(buffer) });
+          large->peakBytes = std::max(large->peakBytes, large->inUseBytes + large->idleBytes);
+        }
+        large->TrimUnsafe(freed);
+      }
+    };
+
+    const std::shared_ptr<LargeBuffers> m_large;
+    std::atomic<uint64_t> m_hits{ 0 };
+    std::atomic<uint64_t> m_misses{ 0 };
   };
 
   using SharedBufferPool = RawBufferPool<uint8_t>;
@@ -12,6 +12,7 @@ namespace leap {
       // IPCEndpoint overrides:
       std::streamsize ReadRaw(void* buffer, std::streamsize size) override = 0;
       bool WriteRaw(const void* pBuf, std::streamsize nBytes) override = 0;
+      using IPCEndpoint::WriteRawV;
     };
 
   }
@@ -0,0 +1,530 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include "SharedMemoryEndpointUnix.h"
+#include "IPCEndpointUnix.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace leap::ipc;
+
+// Layout of the page at the start of every ring, shared by both processes.  The producer and consumer fields
+// are kept on separate cache lines so the two sides don't contend over them.
+struct SharedMemoryEndpointUnix::RingControl {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+
+  // Written by the producer: total bytes written, and the futex the consumer parks on
+  alignas(64) std::atomic<uint64_t> head;
+  std::atomic<uint32_t> dataSeq;
+  std::atomic<uint32_t> consumerWaiting;
+
+  // Written by the consumer: total bytes read, and the futex the producer parks on
+  alignas(64) std::atomic<uint64_t> tail;
+  std::atomic<uint32_t> spaceSeq;
+  std::atomic<uint32_t> producerWaiting;
+
+  // Set by either side once it is done with the ring
+  alignas(64) std::atomic<uint32_t> closed;
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex words must be plain 32-bit integers");
+
+// The ring contents start on the page after the control block
+static const size_t sc_controlSize = 4096;
+static const size_t sc_minRingSize = 4096;
+static const size_t sc_maxRingSize = 1 << 30;
+static const uint32_t sc_ringMagic = 0x474E524C;
+static const uint32_t sc_ringVersion = 0;
+
+// Seals every ring carries before it is offered.  A peer that could resize the memory after it has been mapped
+// would fault the other process on its next access to the ring.
+static const int sc_ringSeals = F_SEAL_SHRINK | F_SEAL_GROW;
+
+// How long a blocked reader or writer sleeps before checking whether the peer process is still there
+static const timespec sc_parkTimeout = { 0, 100 * 1000 * 1000 };
+
+// Both sides have already agreed to negotiate rings by the time offers are exchanged, so each answers the other
+// straight away.  This only guards against a peer that has hung, and a peer that misses it loses the connection.
+static const std::chrono::milliseconds sc_negotiationTimeout{ 1000 };
+
+// Offers are sent as an empty end-of-message frame on the last channel with the offer itself carried in the
+// extended header.
+static const uint32_t sc_offerChannel = IPCEndpoint::Header::NUMBER_OF_CHANNELS - 1;
+static const uint32_t sc_offerRingAttached = 1;
+
+namespace {
+  struct OfferFrame {
+    IPCEndpoint::Header header;
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t ringSize;
+  };
+  static_assert(sizeof(OfferFrame) == 24, "Offer frame must be packed");
+
+  bool IsOfferHeader(const IPCEndpoint::Header& header) {
+    return
+      header.Validate() &&
+      header.Size() == sizeof(OfferFrame) &&
+      header.PayloadSize() == 0 &&
+      header.IsEndOfMessage() &&
+      header.IsChannel(sc_offerChannel);
+  }
+
+  // Returns false if the wait timed out
+  bool FutexWait(std::atomic<uint32_t>& word, uint32_t expected) {
+    timespec timeout = sc_parkTimeout;
+    return
+      ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0) == 0 ||
+      errno != ETIMEDOUT;
+  }
+
+  void FutexWake(std::atomic<uint32_t>& word) {
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+  }
+}
+
+//
+// SharedMemoryEndpointUnix::Ring
+//
+
+bool SharedMemoryEndpointUnix::Ring::Create(size_t ringSize, int& fd) {
+  size_t size = sc_minRingSize;
+  while (size < ringSize && size < sc_maxRingSize)
+    size <<= 1;
+
+  fd = ::memfd_create("leapipc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return false;
+  if (
+    ::ftruncate(fd, static_cast<off_t>(sc_controlSize + size)) < 0 ||
+    ::fcntl(fd, F_ADD_SEALS, sc_ringSeals | F_SEAL_SEAL) < 0
+  ) {
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  void* pMem = ::mmap(nullptr, sc_controlSize + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pMem == MAP_FAILED) {
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  control = new (pMem) RingControl;
+  control->magic = sc_ringMagic;
+  control->version = sc_ringVersion;
+  control->capacity = size;
+  control->head = 0;
+  control->dataSeq = 0;
+  control->consumerWaiting = 0;
+  control->tail = 0;
+  control->spaceSeq = 0;
+  control->producerWaiting = 0;
+  control->closed = 0;
+  data = static_cast<uint8_t*>(pMem) + sc_controlSize;
+  capacity = size;
+  mappedSize = sc_controlSize + size;
+  return true;
+}
+
+bool SharedMemoryEndpointUnix::Ring::Map(int fd) {
+  // Only memory whose size can no longer change is safe to map
+  const int seals = ::fcntl(fd, F_GET_SEALS);
+  if (seals < 0 || (seals & sc_ringSeals) != sc_ringSeals)
+    return false;
+
+  struct stat sb;
+  if (::fstat(fd, &sb) < 0 || sb.st_size <= static_cast<off_t>(sc_controlSize))
+    return false;
+
+  const size_t size = static_cast<size_t>(sb.st_size);
+  void* pMem = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pMem == MAP_FAILED)
+    return false;
+
+  // Don't trust anything about the ring that doesn't agree with the size of the memory behind it
+  auto* pControl = static_cast<RingControl*>(pMem);
+  const uint64_t ringCapacity = pControl->capacity;
+  if (
+    pControl->magic != sc_ringMagic ||
+    pControl->version != sc_ringVersion ||
+    ringCapacity != size - sc_controlSize ||
+    (ringCapacity & (ringCapacity - 1))
+  ) {
+    ::munmap(pMem, size);
+    return false;
+  }
+
+  control = pControl;
+  data = static_cast<uint8_t*>(pMem) + sc_controlSize;
+  capacity = static_cast<size_t>(ringCapacity);
+  mappedSize = size;
+  return true;
+}
+
+void SharedMemoryEndpointUnix::Ring::Unmap(void) {
+  if (control)
+    ::munmap(control, mappedSize);
+  control = nullptr;
+  data = nullptr;
+}
+
+//
+// SharedMemoryEndpointUnix
+//
+
+SharedMemoryEndpointUnix::SharedMemoryEndpointUnix(int socket, Ring& tx, Ring& rx) :
+  m_socket{ socket },
+  m_tx(tx),
+  m_rx(rx)
+{
+  tx = {};
+  rx = {};
+  IPCEndpointUnix::SetDefaultOptions(m_socket);
+
+  struct ucred cred = {0};
+  socklen_t credlen = sizeof(cred);
+  if (::getsockopt(m_socket, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != -1) {
+    m_pid = cred.pid;
+  }
+}
+
+SharedMemoryEndpointUnix::~SharedMemoryEndpointUnix(void)
+{
+  Abort(Reason::Unspecified);
+  m_tx.Unmap();
+  m_rx.Unmap();
+  ::close(m_socket);
+}
+
+std::streamsize SharedMemoryEndpointUnix::ReadRaw(void* buffer, std::streamsize size) {
+  RingControl& control = *m_rx.control;
+  const uint64_t tail = control.tail.load(std::memory_order_relaxed);
+  const size_t mask = m_rx.capacity - 1;
+
+  for (;;) {
+    if (m_isAborted)
+      return -1;
+
+    const uint64_t head = control.head.load();
+    if (head - tail > m_rx.capacity)
+      // Peer has scribbled over the indices, nothing in this ring can be trusted
+      return -1;
+
+    const size_t available = static_cast<size_t>(head - tail);
+    if (available) {
+      const size_t n = std::min<size_t>(available, static_cast<size_t>(size));
+      const size_t offset = static_cast<size_t>(tail) & mask;
+      const size_t first = std::min(n, m_rx.capacity - offset);
+      memcpy(buffer, m_rx.data + offset, first);
+      memcpy(static_cast<uint8_t*>(buffer) + first, m_rx.data, n - first);
+      control.tail.store(tail + n);
+
+      if (control.producerWaiting.load()) {
+        control.spaceSeq.fetch_add(1);
+        FutexWake(control.spaceSeq);
+      }
+      return static_cast<std::streamsize>(n);
+    }
+
+    if (control.closed)
+      // Peer is done and everything it wrote has been read
+      return 0;
+
+    // Nothing to read, park until the producer publishes more.  The sequence number is sampled before the
+    // waiting flag is raised so that a publish in between makes the futex wait return immediately.
+    const uint32_t seq = control.dataSeq.load();
+    control.consumerWaiting.store(1);
+    bool alive = true;
+    if (control.head.load() == tail && !control.closed && !m_isAborted)
+      alive = FutexWait(control.dataSeq, seq) || IsPeerAlive();
+    control.consumerWaiting.store(0);
+    if (!alive)
+      return 0;
+  }
+}
+
+bool SharedMemoryEndpointUnix::Produce(const uint8_t* data, size_t nBytes) {
+  RingControl& control = *m_tx.control;
+  uint64_t head = control.head.load(std::memory_order_relaxed);
+  const size_t mask = m_tx.capacity - 1;
+
+  while (nBytes) {
+    if (m_isAborted || control.closed)
+      return false;
+
+    const uint64_t tail = control.tail.load();
+    if (head - tail > m_tx.capacity)
+      return false;
+
+    const size_t space = m_tx.capacity - static_cast<size_t>(head - tail);
+    if (!space) {
+      // The reader has to know about what is already in the ring before we can wait for it to make room
+      WakeConsumer();
+
+      const uint32_t seq = control.spaceSeq.load();
+      control.producerWaiting.store(1);
+      bool alive = true;
+      if (control.tail.load() == tail && !control.closed && !m_isAborted)
+        alive = FutexWait(control.spaceSeq, seq) || IsPeerAlive();
+      control.producerWaiting.store(0);
+      if (!alive)
+        return false;
+      continue;
+    }
+
+    const size_t n = std::min(nBytes, space);
+    const size_t offset = static_cast<size_t>(head) & mask;
+    const size_t first = std::min(n, m_tx.capacity - offset);
+    memcpy(m_tx.data + offset, data, first);
+    memcpy(m_tx.data, data + first, n - first);
+    head += n;
+    control.head.store(head);
+
+    data += n;
+    nBytes -= n;
+  }
+  return true;
+}
+
+void SharedMemoryEndpointUnix::WakeConsumer(void) {
+  RingControl& control = *m_tx.control;
+  if (control.consumerWaiting.load()) {
+    control.dataSeq.fetch_add(1);
+    FutexWake(control.dataSeq);
+  }
+}
+
+bool SharedMemoryEndpointUnix::WriteRaw(const void* pBuf, std::streamsize nBytes) {
+  const bool retVal = Produce(static_cast<const uint8_t*>(pBuf), static_cast<size_t>(nBytes));
+  WakeConsumer();
+  return retVal;
+}
+
+bool SharedMemoryEndpointUnix::WriteRawV(const ConstBuffer* buffers, size_t count) {
+  // Publish everything before waking the reader once for the lot
+  bool retVal = true;
+  for (size_t i = 0; retVal && i < count; i++)
+    retVal = Produce(static_cast<const uint8_t*>(buffers[i].pBuf), static_cast<size_t>(buffers[i].nBytes));
+  WakeConsumer();
+  return retVal;
+}
+
+bool SharedMemoryEndpointUnix::IsPeerAlive(void) const {
+  // The peer never writes to the socket after the negotiation, so all we can see here is it going away
+  char c;
+  const ssize_t n = ::recv(m_socket, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+  return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
+
+bool SharedMemoryEndpointUnix::Abort(Reason reason) {
+  if (m_isAborted.exchange(true)) {
+    return false;
+  }
+
+  // Wake anyone parked on either ring, on this side or the other
+  for (Ring* ring : { &m_tx, &m_rx }) {
+    RingControl& control = *ring->control;
+    control.closed.store(1);
+    control.dataSeq.fetch_add(1);
+    control.spaceSeq.fetch_add(1);
+    FutexWake(control.dataSeq);
+    FutexWake(control.spaceSeq);
+  }
+
+  ::shutdown(m_socket, SHUT_RDWR);
+  Close(reason);
+  return true;
+}
+
+bool SharedMemoryEndpointUnix::SendOffer(int socket, int fd, size_t ringSize) {
+  OfferFrame frame;
+  frame.header.SetChannel(sc_offerChannel);
+  frame.header.SetEndOfMessage();
+  frame.header.size = sizeof(frame);
+  frame.magic = sc_ringMagic;
+  frame.flags = fd >= 0 ? sc_offerRingAttached : 0;
+  frame.ringSize = ringSize;
+
+  iovec iov = { &frame, sizeof(frame) };
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  union {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  if (fd >= 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  for (;;) {
+    const ssize_t nSent = ::sendmsg(socket, &msg, MSG_NOSIGNAL);
+    if (nSent >= 0 || errno != EINTR)
+      return nSent == static_cast<ssize_t>(sizeof(frame));
+  }
+}
+
+bool SharedMemoryEndpointUnix::ReceiveOffer(int socket, std::chrono::milliseconds timeout, int& fd, size_t& ringSize) {
+  fd = -1;
+  ringSize = 0;
+  auto fail = [&fd] {
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+    return false;
+  };
+
+  // Nothing but the offer is expected here, so it is read off the socket as it arrives.  The descriptor, if
+  // there is one, comes with the first part of the frame.
+  OfferFrame frame;
+  size_t nRead = 0;
+  const auto limit = std::chrono::steady_clock::now() + timeout;
+  while (nRead < sizeof(frame)) {
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(limit - std::chrono::steady_clock::now());
+    if (remaining.count() <= 0)
+      return fail();
+
+    pollfd fds = { socket, POLLIN, 0 };
+    const int rs = ::poll(&fds, 1, static_cast<int>(remaining.count()));
+    if (rs < 0 && errno != EINTR)
+      return fail();
+    if (rs <= 0)
+      continue;
+
+    iovec iov = { reinterpret_cast<uint8_t*>(&frame) + nRead, sizeof(frame) - nRead };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    union {
+      cmsghdr align;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    const ssize_t n = ::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n == 0)
+      return fail();
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        continue;
+      return fail();
+    }
+
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        continue;
+      int received;
+      memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+      if (fd < 0)
+        fd = received;
+      else
+        ::close(received);
+    }
+    nRead += static_cast<size_t>(n);
+  }
+
+  if (!IsOfferHeader(frame.header) || frame.magic != sc_ringMagic)
+    return fail();
+  if (!(frame.flags & sc_offerRingAttached) && fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  ringSize = static_cast<size_t>(frame.ringSize);
+  return true;
+}
+
+std::shared_ptr<IPCEndpoint> SharedMemoryEndpointUnix::Offer(int socket, size_t ringSize) {
+  // If we can't create a ring we still send an offer without one, so the listener declines as well
+  Ring tx;
+  int txFd = -1;
+  const bool created = tx.Create(ringSize, txFd);
+
+  // Our mapping keeps the memory around, the descriptor is only needed long enough to send it
+  const bool sent = SendOffer(socket, txFd, tx.capacity);
+  if (txFd >= 0)
+    ::close(txFd);
+
+  int rxFd = -1;
+  size_t rxSize;
+  Ring rx;
+  if (sent && ReceiveOffer(socket, sc_negotiationTimeout, rxFd, rxSize)) {
+    if (created && rxFd >= 0 && rx.Map(rxFd)) {
+      ::close(rxFd);
+      return std::shared_ptr<IPCEndpoint>(new SharedMemoryEndpointUnix(socket, tx, rx));
+    }
+    if (rxFd < 0) {
+      // The listener declined, both sides stay on the socket
+      if (created) {
+        tx.control->closed = 1;
+        tx.Unmap();
+      }
+      return std::make_shared<IPCEndpointUnix>(socket);
+    }
+
+    // The listener committed to shared memory and we can't follow it, this connection is unusable
+    ::close(rxFd);
+  }
+
+  if (created) {
+    // If the listener maps our ring after all, it will find it closed rather than wait on it forever
+    tx.control->closed = 1;
+    tx.Unmap();
+  }
+  return nullptr;
+}
+
+std::shared_ptr<IPCEndpoint> SharedMemoryEndpointUnix::Answer(int socket, size_t ringSize) {
+  int rxFd;
+  size_t rxSize;
+  if (!ReceiveOffer(socket, sc_negotiationTimeout, rxFd, rxSize))
+    return nullptr;
+
+  Ring rx;
+  const bool mapped = rxFd >= 0 && rx.Map(rxFd);
+  if (rxFd >= 0)
+    ::close(rxFd);
+
+  Ring tx;
+  int txFd = -1;
+  if (!mapped || !ringSize || !tx.Create(ringSize, txFd)) {
+    rx.Unmap();
+
+    // Decline, the client falls back to the socket as well
+    if (!SendOffer(socket, -1, 0))
+      return nullptr;
+    return std::make_shared<IPCEndpointUnix>(socket);
+  }
+
+  const bool sent = SendOffer(socket, txFd, tx.capacity);
+  ::close(txFd);
+  if (!sent) {
+    tx.Unmap();
+    rx.Unmap();
+    return nullptr;
+  }
+  return std::shared_ptr<IPCEndpoint>(new SharedMemoryEndpointUnix(socket, tx, rx));
+}
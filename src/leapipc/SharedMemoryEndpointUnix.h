@@ -0,0 +1,104 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#pragma once
+#include "RawIPCEndpoint.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace leap {
+namespace ipc {
+
+/// <summary>
+/// Endpoint that moves data through a pair of shared memory rings, one for each direction
+/// </summary>
+/// <remarks>
+/// Each side allocates the ring that it writes to from a memfd and passes the descriptor to the other side over
+/// an already-connected Unix domain socket.  The memfd is sealed against resizing before it is sent, and a ring
+/// without those seals is refused, so neither side can fault the other by truncating the memory under it.
+/// Readers and writers block on futexes in the shared ring header.  The socket stays open for the life of the
+/// endpoint so that either side can tell when the other has gone away.  Endpoints of this type are created by
+/// Offer and Answer, which negotiate the rings at connect time once both sides have agreed to try, and fall back
+/// to an ordinary socket endpoint when either side cannot create or map a ring.  Linux only.
+/// </remarks>
+class SharedMemoryEndpointUnix:
+  public RawIPCEndpoint
+{
+public:
+  ~SharedMemoryEndpointUnix(void);
+
+  // Default size of each ring
+  enum { DEFAULT_RING_SIZE = 8 * 1024 * 1024 };
+
+  // IPCEndpoint overrides:
+  std::streamsize ReadRaw(void* buffer, std::streamsize size) override;
+  bool WriteRaw(const void* pBuf, std::streamsize nBytes) override;
+  bool WriteRawV(const ConstBuffer* buffers, size_t count) override;
+  bool Abort(Reason reason) override;
+
+  /// <summary>
+  /// Connecting side of the negotiation, offers a ring to the listener on the other end of the socket
+  /// </summary>
+  /// <param name="socket">A newly connected socket, ownership is taken by the returned endpoint</param>
+  /// <param name="ringSize">The size of the ring to offer, rounded up to a power of two</param>
+  /// <returns>
+  /// A shared memory endpoint if the listener accepted the offer, a socket endpoint if it declined, or nullptr
+  /// if the connection failed or the listener did not answer during the negotiation.
+  /// </returns>
+  /// <remarks>
+  /// The listener must be expecting the offer, see IPCHandshakeUnix.
+  /// </remarks>
+  static std::shared_ptr<IPCEndpoint> Offer(int socket, size_t ringSize);
+
+  /// <summary>
+  /// Listening side of the negotiation, answers the ring offer from the client
+  /// </summary>
+  /// <param name="socket">A newly accepted socket, ownership is taken by the returned endpoint</param>
+  /// <param name="ringSize">
+  /// The size of the ring to allocate for this side, rounded up to a power of two, or zero to decline the offer
+  /// </param>
+  /// <returns>
+  /// A shared memory endpoint if the offer was accepted, a socket endpoint if either side declined, or nullptr
+  /// if the connection failed or the client did not make an offer during the negotiation.
+  /// </returns>
+  static std::shared_ptr<IPCEndpoint> Answer(int socket, size_t ringSize);
+
+private:
+  struct RingControl;
+
+  struct Ring {
+    RingControl* control = nullptr;
+    uint8_t* data = nullptr;
+    size_t capacity = 0;
+    size_t mappedSize = 0;
+
+    bool Create(size_t ringSize, int& fd);
+    bool Map(int fd);
+    void Unmap(void);
+  };
+
+  SharedMemoryEndpointUnix(int socket, Ring& tx, Ring& rx);
+
+  // Socket used for the negotiation and thereafter to detect that the peer has gone away
+  const int m_socket;
+
+  // Ring we write to, and the ring the peer writes to
+  Ring m_tx;
+  Ring m_rx;
+
+  std::atomic<bool> m_isAborted{ false };
+
+  // Copies into the transmit ring, blocking for space as needed.  The reader is not woken up.
+  bool Produce(const uint8_t* data, size_t nBytes);
+
+  // Wakes up the reader of the transmit ring if it is waiting for data
+  void WakeConsumer(void);
+
+  // Returns false if the peer is known to have gone away
+  bool IsPeerAlive(void) const;
+
+  // Negotiation frame exchange
+  static bool SendOffer(int socket, int fd, size_t ringSize);
+  static bool ReceiveOffer(int socket, std::chrono::milliseconds timeout, int& fd, size_t& ringSize);
+};
+
+}}
@@ -0,0 +1,304 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include "SlabAllocator.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+using namespace leap::ipc;
+
+namespace {
+  // Each thread keeps about this many bytes of free blocks in every class, and at least two blocks
+  const size_t sc_threadCacheBytes = 256 * 1024;
+  const size_t sc_maxThreadCacheBlocks = 256;
+
+  size_t CacheCapacity(size_t sizeClass) {
+    const size_t nBlocks = sc_threadCacheBytes >> (SlabAllocator::MIN_BLOCK_SHIFT + sizeClass);
+    return nBlocks < 2 ? 2 : nBlocks > sc_maxThreadCacheBlocks ? sc_maxThreadCacheBlocks : nBlocks;
+  }
+
+  // Bytes of slab blocks taken from the heap, and bytes of the ones sitting in the depot
+  std::atomic<uint64_t> s_residentBytes{ 0 };
+  std::atomic<uint64_t> s_depotBytes{ 0 };
+
+  struct Depot {
+    std::mutex lock;
+    std::vector<void*> blocks[SlabAllocator::NUMBER_OF_CLASSES];
+    size_t limit = SlabAllocator::DEFAULT_DEPOT_LIMIT;
+
+    // Most blocks kept in a class, must be called with the lock held
+    size_t CapacityUnsafe(size_t sizeClass) const {
+      return std::max(limit >> (SlabAllocator::MIN_BLOCK_SHIFT + sizeClass), CacheCapacity(sizeClass));
+    }
+  };
+
+  // Never destroyed, threads may still be freeing blocks while statics are being torn down
+  Depot& GetDepot(void) {
+    static Depot* depot = new Depot;
+    return *depot;
+  }
+
+  void Release(size_t sizeClass, const std::vector<void*>& blocks) {
+    for (void* block : blocks)
+      ::operator delete(block);
+    s_residentBytes -= blocks.size() * (size_t(SlabAllocator::MIN_BLOCK_SIZE) << sizeClass);
+  }
+
+  // Moves blocks into the depot, and frees whatever doesn't fit once the depot lock has been released
+  void Deposit(size_t sizeClass, void* const* begin, void* const* end) {
+    std::vector<void*> excess;
+    {
+      Depot& depot = GetDepot();
+      std::lock_guard<std::mutex> lk(depot.lock);
+      auto& shared = depot.blocks[sizeClass];
+      const size_t capacity = depot.CapacityUnsafe(sizeClass);
+      const size_t room = capacity > shared.size() ? capacity - shared.size() : 0;
+      void* const* kept = begin + std::min<size_t>(room, end - begin);
+      shared.insert(shared.end(), begin, kept);
+      excess.assign(kept, end);
+      s_depotBytes += (kept - begin) * (size_t(SlabAllocator::MIN_BLOCK_SIZE) << sizeClass);
+    }
+    Release(sizeClass, excess);
+  }
+
+  struct ThreadCache {
+    ThreadCache(void);
+    ~ThreadCache(void);
+
+    // Taken by the owning thread around every allocation and free.  Nobody else takes it except to flush the
+    // cache, so it is almost never contended.
+    std::mutex lock;
+    std::vector<void*> blocks[SlabAllocator::NUMBER_OF_CLASSES];
+
+    // Bytes of the blocks above, only changed with the lock held so that statistics can read it without
+    std::atomic<uint64_t> nBytes{ 0 };
+
+    // Must be called with the lock held
+    void AddBytesUnsafe(int64_t delta) {
+      nBytes.store(nBytes.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+  };
+
+  // Every live thread cache, so that they can be counted and flushed
+  struct Registry {
+    std::mutex lock;
+    std::vector<ThreadCache*> caches;
+  };
+
+  // Never destroyed, for the same reason as the depot
+  Registry& GetRegistry(void) {
+    static Registry* registry = new Registry;
+    return *registry;
+  }
+
+  // Set once this thread's cache has been destroyed, blocks freed after that go straight to the depot
+  thread_local bool tls_isCacheDestroyed = false;
+
+  ThreadCache::ThreadCache(void) {
+    for (size_t i = 0; i < SlabAllocator::NUMBER_OF_CLASSES; i++)
+      blocks[i].reserve(CacheCapacity(i) + 1);
+
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lk(registry.lock);
+    registry.caches.push_back(this);
+  }
+
+  ThreadCache::~ThreadCache(void) {
+    tls_isCacheDestroyed = true;
+    {
+      // Once the cache is out of the registry nobody else can reach it
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lk(registry.lock);
+      registry.caches.erase(std::find(registry.caches.begin(), registry.caches.end(), this));
+    }
+    for (size_t i = 0; i < SlabAllocator::NUMBER_OF_CLASSES; i++)
+      Deposit(i, blocks[i].data(), blocks[i].data() + blocks[i].size());
+  }
+
+  uint64_t CachedBytes(void) {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lk(registry.lock);
+    uint64_t nBytes = 0;
+    for (ThreadCache* cache : registry.caches)
+      nBytes += cache->nBytes.load(std::memory_order_relaxed);
+    return nBytes;
+  }
+
+  // Empties the cache of every thread into the depot, including threads that have stopped allocating but are
+  // still alive
+  void FlushThreadCaches(void) {
+    std::vector<void*> flushed[SlabAllocator::NUMBER_OF_CLASSES];
+    {
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lk(registry.lock);
+      for (ThreadCache* cache : registry.caches) {
+        std::lock_guard<std::mutex> cacheLock(cache->lock);
+        for (size_t i = 0; i < SlabAllocator::NUMBER_OF_CLASSES; i++) {
+          flushed[i].insert(flushed[i].end(), cache->blocks[i].begin(), cache->blocks[i].end());
+          cache->blocks[i].clear();
+        }
+        cache->nBytes.store(0, std::memory_order_relaxed);
+      }
+    }
+    for (size_t i = 0; i < SlabAllocator::NUMBER_OF_CLASSES; i++)
+      Deposit(i, flushed[i].data(), flushed[i].data() + flushed[i].size());
+  }
+
+  ThreadCache* GetThreadCache(void) {
+    if (tls_isCacheDestroyed)
+      return nullptr;
+    static thread_local ThreadCache cache;
+    return &cache;
+  }
+}
+
+size_t SlabAllocator::ClassOf(size_t nBytes) {
+  size_t sizeClass = 0;
+  while ((size_t(MIN_BLOCK_SIZE) << sizeClass) < nBytes)
+    sizeClass++;
+  return sizeClass;
+}
+
+size_t SlabAllocator::BlockSize(size_t nBytes) {
+  if (nBytes > MAX_BLOCK_SIZE)
+    return nBytes;
+  return size_t(MIN_BLOCK_SIZE) << ClassOf(nBytes);
+}
+
+void SlabAllocator::SetDepotLimit(size_t nBytes) {
+  std::vector<void*> excess[NUMBER_OF_CLASSES];
+  {
+    Depot& depot = GetDepot();
+    std::lock_guard<std::mutex> lk(depot.lock);
+    depot.limit = nBytes;
+    for (size_t i = 0; i < NUMBER_OF_CLASSES; i++) {
+      auto& shared = depot.blocks[i];
+      const size_t capacity = depot.CapacityUnsafe(i);
+      if (shared.size() <= capacity)
+        continue;
+
+      // The oldest blocks go, the same ones a refill would have reached last
+      excess[i].assign(shared.begin(), shared.end() - capacity);
+      shared.erase(shared.begin(), shared.end() - capacity);
+      s_depotBytes -= excess[i].size() * (size_t(MIN_BLOCK_SIZE) << i);
+    }
+  }
+  for (size_t i = 0; i < NUMBER_OF_CLASSES; i++)
+    Release(i, excess[i]);
+}
+
+uint64_t SlabAllocator::Trim(size_t nBytes) {
+  // Thread caches are only flushed when the depot alone can't make up the difference, refilling them costs the
+  // threads a trip to the depot each
+  if (CachedBytes() > nBytes)
+    FlushThreadCaches();
+  const uint64_t cached = CachedBytes();
+  const uint64_t depotTarget = cached < nBytes ? nBytes - cached : 0;
+
+  std::vector<void*> excess[NUMBER_OF_CLASSES];
+  uint64_t remaining;
+  {
+    Depot& depot = GetDepot();
+    std::lock_guard<std::mutex> lk(depot.lock);
+    for (size_t i = NUMBER_OF_CLASSES; i-- && s_depotBytes > depotTarget;) {
+      auto& shared = depot.blocks[i];
+      const size_t blockSize = size_t(MIN_BLOCK_SIZE) << i;
+      const uint64_t over = s_depotBytes - depotTarget;
+      const size_t nFreed = static_cast<size_t>(std::min<uint64_t>(shared.size(), (over + blockSize - 1) / blockSize));
+      excess[i].assign(shared.begin(), shared.begin() + nFreed);
+      shared.erase(shared.begin(), shared.begin() + nFreed);
+      s_depotBytes -= nFreed * blockSize;
+    }
+    remaining = s_depotBytes;
+  }
+  for (size_t i = 0; i < NUMBER_OF_CLASSES; i++)
+    Release(i, excess[i]);
+  return remaining + cached;
+}
+
+SlabAllocator::Statistics SlabAllocator::GetStatistics(void) {
+  return Statistics{
+    s_residentBytes.load(std::memory_order_relaxed),
+    s_depotBytes.load(std::memory_order_relaxed),
+    CachedBytes()
+  };
+}
+
+void* SlabAllocator::Allocate(size_t nBytes, bool* isHit) {
+  if (isHit)
+    *isHit = false;
+  if (nBytes > MAX_BLOCK_SIZE)
+    return ::operator new(nBytes);
+
+  const size_t sizeClass = ClassOf(nBytes);
+  void* block = nullptr;
+  if (ThreadCache* cache = GetThreadCache()) {
+    std::lock_guard<std::mutex> cacheLock(cache->lock);
+    auto& blocks = cache->blocks[sizeClass];
+    if (blocks.empty()) {
+      // Refill half of the cache in one trip to the depot
+      Depot& depot = GetDepot();
+      std::lock_guard<std::mutex> lk(depot.lock);
+      auto& shared = depot.blocks[sizeClass];
+      const size_t nMoved = std::min(shared.size(), CacheCapacity(sizeClass) / 2);
+      blocks.insert(blocks.end(), shared.end() - nMoved, shared.end());
+      shared.resize(shared.size() - nMoved);
+      s_depotBytes -= nMoved * (size_t(MIN_BLOCK_SIZE) << sizeClass);
+      cache->AddBytesUnsafe(nMoved * (size_t(MIN_BLOCK_SIZE) << sizeClass));
+    }
+    if (!blocks.empty()) {
+      block = blocks.back();
+      blocks.pop_back();
+      cache->AddBytesUnsafe(-(int64_t(MIN_BLOCK_SIZE) << sizeClass));
+    }
+  }
+  else {
+    Depot& depot = GetDepot();
+    std::lock_guard<std::mutex> lk(depot.lock);
+    auto& shared = depot.blocks[sizeClass];
+    if (!shared.empty()) {
+      block = shared.back();
+      shared.pop_back();
+      s_depotBytes -= size_t(MIN_BLOCK_SIZE) << sizeClass;
+    }
+  }
+
+  if (block) {
+    if (isHit)
+      *isHit = true;
+    return block;
+  }
+  block = ::operator new(size_t(MIN_BLOCK_SIZE) << sizeClass);
+  s_residentBytes += size_t(MIN_BLOCK_SIZE) << sizeClass;
+  return block;
+}
+
+void SlabAllocator::Free(void* block, size_t nBytes) {
+  if (!block)
+    return;
+  if (nBytes > MAX_BLOCK_SIZE) {
+    ::operator delete(block);
+    return;
+  }
+
+  const size_t sizeClass = ClassOf(nBytes);
+  ThreadCache* cache = GetThreadCache();
+  if (!cache) {
+    Deposit(sizeClass, &block, &block + 1);
+    return;
+  }
+
+  std::lock_guard<std::mutex> cacheLock(cache->lock);
+  auto& blocks = cache->blocks[sizeClass];
+  blocks.push_back(block);
+  cache->AddBytesUnsafe(size_t(MIN_BLOCK_SIZE) << sizeClass);
+  const size_t capacity = CacheCapacity(sizeClass);
+  if (blocks.size() > capacity) {
+    // Spill the older half, the most recently freed blocks are the likeliest to still be in the CPU cache
+    const size_t nMoved = blocks.size() - capacity / 2;
+    Deposit(sizeClass, blocks.data(), blocks.data() + nMoved);
+    blocks.erase(blocks.begin(), blocks.begin() + nMoved);
+    cache->AddBytesUnsafe(-static_cast<int64_t>(nMoved * (size_t(MIN_BLOCK_SIZE) << sizeClass)));
+  }
+}
@@ -0,0 +1,120 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace leap {
+namespace ipc {
+
+/// <summary>
+/// Process-wide allocator for small blocks, sorted into power-of-two size classes
+/// </summary>
+/// <remarks>
+/// Freed blocks are kept for reuse rather than returned to the heap.  Each thread has a small cache of free
+/// blocks in every class, and allocates from and frees to that cache under a lock of its own that no other
+/// thread takes except to flush the cache.  Caches that run dry refill from a shared depot, and caches that
+/// overflow spill half their blocks into it, so that a thread that only frees, such as a consumer of received
+/// messages, feeds a thread that only allocates.  Once the depot holds enough blocks for the peak number in
+/// use, allocation no longer touches the heap.
+///
+/// The depot keeps at most DepotLimit bytes of blocks in each class, blocks spilled beyond that go back to the
+/// heap, so a burst of traffic doesn't leave its peak allocation behind for good.  Blocks held in thread
+/// caches are counted as idle alongside the depot's, and Trim flushes the caches when that is what it takes to
+/// get idle memory under a limit, so the memory kept doesn't grow with the number of threads.
+///
+/// Requests larger than MAX_BLOCK_SIZE are passed straight through to the heap.
+/// </remarks>
+class SlabAllocator
+{
+public:
+  enum {
+    // Smallest and largest size classes, every power of two in between is also a class
+    MIN_BLOCK_SHIFT = 6,
+    MAX_BLOCK_SHIFT = 17,
+    NUMBER_OF_CLASSES = MAX_BLOCK_SHIFT - MIN_BLOCK_SHIFT + 1,
+    MIN_BLOCK_SIZE = 1 << MIN_BLOCK_SHIFT,
+    MAX_BLOCK_SIZE = 1 << MAX_BLOCK_SHIFT,
+
+    // Default for the most the depot keeps in each size class, in bytes
+    DEFAULT_DEPOT_LIMIT = 1024 * 1024
+  };
+
+  struct Statistics {
+    // Bytes of blocks taken from the heap and not yet given back, in use or free
+    uint64_t residentBytes;
+
+    // Bytes of free blocks held in the shared depot
+    uint64_t depotBytes;
+
+    // Bytes of free blocks held in the caches of all live threads
+    uint64_t cachedBytes;
+  };
+
+  /// <summary>
+  /// Allocates a block of BlockSize(nBytes) bytes
+  /// </summary>
+  /// <param name="isHit">Optionally receives true if the block was reused, false if it came from the heap</param>
+  /// <remarks>
+  /// Throws std::bad_alloc if the heap is exhausted, as operator new does.
+  /// </remarks>
+  static void* Allocate(size_t nBytes, bool* isHit = nullptr);
+
+  /// <summary>
+  /// Frees a block returned by Allocate, nBytes may be the size that was asked for or the block's actual size
+  /// </summary>
+  static void Free(void* block, size_t nBytes);
+
+  /// <returns>The usable size of the block that Allocate returns for a request of nBytes</returns>
+  static size_t BlockSize(size_t nBytes);
+
+  /// <summary>
+  /// Sets the most the depot keeps in each size class, in bytes, and frees anything already over it
+  /// </summary>
+  /// <remarks>
+  /// The depot always has room for one full spill from a thread cache, whatever the limit.
+  /// </remarks>
+  static void SetDepotLimit(size_t nBytes);
+
+  /// <summary>
+  /// Frees idle blocks, largest classes first, until the depot and the thread caches together hold no more than
+  /// nBytes
+  /// </summary>
+  /// <returns>The number of idle bytes held afterwards</returns>
+  /// <remarks>
+  /// The depot is trimmed first.  If the thread caches alone hold more than nBytes, every thread's cache is
+  /// flushed into the depot beforehand, and threads that are still allocating refill theirs from the depot.
+  /// </remarks>
+  static uint64_t Trim(size_t nBytes = 0);
+
+  /// <summary>
+  /// Process-wide memory held by the allocator, blocks larger than MAX_BLOCK_SIZE are not counted
+  /// </summary>
+  static Statistics GetStatistics(void);
+
+  /// <summary>
+  /// Standard allocator drawing from the SlabAllocator, for use with std::allocate_shared and containers
+  /// </summary>
+  template<typename T>
+  class Allocator {
+  public:
+    typedef T value_type;
+
+    Allocator(void) {}
+    template<typename U>
+    Allocator(const Allocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(SlabAllocator::Allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) { SlabAllocator::Free(p, n * sizeof(T)); }
+
+    template<typename U>
+    bool operator==(const Allocator<U>&) const { return true; }
+    template<typename U>
+    bool operator!=(const Allocator<U>&) const { return false; }
+  };
+
+private:
+  static size_t ClassOf(size_t nBytes);
+};
+
+}}
@@ -0,0 +1,340 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include <leapipc/CircularBufferEndpoint.h>
+#include <leapipc/IPCEndpoint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !_WIN32
+#include <leapipc/IPCEndpointUnix.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace leap::ipc;
+
+// Measures how many messages, and how many bytes, an endpoint moves per second.  Every combination of
+// transport, message size, channel count and fragment count is run in turn, with one writer and one reader
+// thread per channel, and the results are written to a JSON file.
+//
+// Usage: LeapIPCBench [--output=FILE] [--transports=unix,tcp,circular] [--min-size=N] [--max-size=N]
+//                     [--channels=N] [--fragments=1,4,16] [--bytes-per-run=N]
+
+namespace {
+  struct Options {
+    std::string output = "LeapIPCBench.json";
+    std::vector<std::string> transports{
+#if !_WIN32
+      "unix",
+      "tcp",
+#endif
+      "circular"
+    };
+    uint64_t minSize = 8;
+    uint64_t maxSize = 64 * 1024 * 1024;
+    size_t maxChannels = 4;
+    std::vector<size_t> fragments{ 1, 4, 16 };
+
+    // Each run sends about this much in total, but never fewer than two messages per channel
+    uint64_t bytesPerRun = 256 * 1024 * 1024;
+    uint64_t maxMessagesPerRun = 200000;
+  };
+
+  struct Result {
+    std::string transport;
+    uint64_t messageSize;
+    size_t channels;
+    size_t fragments;
+    uint64_t messages;
+    double seconds;
+    bool ok;
+  };
+
+  // Both ends of a connection.  Loopback transports have a single endpoint that is both.
+  struct Link {
+    std::shared_ptr<IPCEndpoint> sender;
+    std::shared_ptr<IPCEndpoint> receiver;
+  };
+
+  std::vector<std::string> Split(const std::string& value) {
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    for (;;) {
+      const size_t end = value.find(',', begin);
+      if (end != begin)
+        parts.push_back(value.substr(begin, end - begin));
+      if (end == std::string::npos)
+        return parts;
+      begin = end + 1;
+    }
+  }
+
+#if !_WIN32
+  // Loopback TCP connection, which is what a build with USE_NETWORK_SOCKETS uses between client and listener
+  bool MakeTcpPair(int (&sockets)[2]) {
+    const int listener = ::socket(PF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+      return false;
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addrlen = sizeof(addr);
+    sockets[0] = sockets[1] = -1;
+    if (
+      ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+      ::listen(listener, 1) == 0 &&
+      ::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addrlen) == 0
+    ) {
+      sockets[0] = ::socket(PF_INET, SOCK_STREAM, 0);
+      if (sockets[0] >= 0 && ::connect(sockets[0], reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        sockets[1] = ::accept(listener, nullptr, nullptr);
+    }
+    ::close(listener);
+    if (sockets[1] < 0) {
+      if (sockets[0] >= 0)
+        ::close(sockets[0]);
+      return false;
+    }
+
+    const int so_enable = 1;
+    for (int socket : sockets)
+      ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &so_enable, sizeof(so_enable));
+    return true;
+  }
+#endif
+
+  Link MakeLink(const std::string& transport) {
+    Link link;
+    if (transport == "circular") {
+      link.sender = link.receiver = std::make_shared<CircularBufferEndpoint>(
+        1024 * 1024,
+        CircularBufferEndpoint::Mode::SingleProducerSingleConsumer
+      );
+      return link;
+    }
+
+#if !_WIN32
+    int sockets[2];
+    if (transport == "unix") {
+      if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+        return link;
+    }
+    else if (transport == "tcp") {
+      if (!MakeTcpPair(sockets))
+        return link;
+    }
+    else
+      return link;
+    link.sender = std::make_shared<IPCEndpointUnix>(sockets[0]);
+    link.receiver = std::make_shared<IPCEndpointUnix>(sockets[1]);
+
+    // Both ends are ours, so there is nothing to negotiate before using channels beyond the first four
+    link.sender->EnableCapabilities(~0u);
+    link.receiver->EnableCapabilities(~0u);
+#endif
+    return link;
+  }
+
+  Result Run(const std::string& transport, uint64_t messageSize, size_t nChannels, size_t nFragments, uint64_t nMessages) {
+    Result result{ transport, messageSize, nChannels, nFragments, nMessages, 0.0, false };
+    Link link = MakeLink(transport);
+    if (!link.sender)
+      return result;
+
+    // Readers are in place before anything is sent, so no message is ever drained
+    const bool isLoopback = link.sender == link.receiver;
+    std::vector<std::unique_ptr<IPCEndpoint::Channel>> readers, writers;
+    for (uint32_t i = 0; i < nChannels; i++) {
+      readers.push_back(link.receiver->AcquireChannel(i, isLoopback ? IPCEndpoint::Channel::READ_WRITE : IPCEndpoint::Channel::READ_ONLY));
+      if (!isLoopback)
+        writers.push_back(link.sender->AcquireChannel(i, IPCEndpoint::Channel::WRITE_ONLY));
+    }
+    auto& senders = isLoopback ? readers : writers;
+
+    // Each fragment is a separate buffer, and so goes out as a separate frame
+    MessageBuffers::Buffers message;
+    for (size_t i = 0; i < nFragments; i++) {
+      const uint64_t begin = messageSize * i / nFragments;
+      const uint64_t end = messageSize * (i + 1) / nFragments;
+      auto buffer = MessageBuffers::MakeBuffer(static_cast<size_t>(end - begin));
+      memset(buffer->Data(), static_cast<int>(i), buffer->Size());
+      message.push_back(std::move(buffer));
+    }
+
+    std::atomic<bool> go{ false };
+    std::atomic<bool> ok{ true };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nChannels; i++) {
+      IPCEndpoint::Channel* reader = readers[i].get();
+      IPCEndpoint::Channel* writer = senders[i].get();
+      threads.emplace_back([&go, &ok, &message, writer, nMessages] {
+        while (!go)
+          std::this_thread::yield();
+        for (uint64_t j = 0; j < nMessages && ok; j++)
+          if (!writer->WriteMessageBuffers(message))
+            ok = false;
+      });
+      threads.emplace_back([&ok, reader, nMessages, messageSize] {
+        for (uint64_t j = 0; j < nMessages && ok; j++) {
+          uint64_t nBytes = 0;
+          for (const auto& buffer : reader->ReadMessageBuffers())
+            nBytes += buffer->Size();
+          if (nBytes != messageSize)
+            ok = false;
+        }
+      });
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto& thread : threads) {
+      // A failed writer leaves its reader waiting for good, closing the link lets it go
+      if (!ok)
+        link.receiver->Abort(IPCEndpoint::Reason::Unspecified);
+      thread.join();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.ok = ok;
+    return result;
+  }
+
+  bool WriteResults(const Options& options, const std::vector<Result>& results) {
+    std::ofstream out(options.output);
+    if (!out)
+      return false;
+
+    out << "{\n";
+    out << "  \"benchmark\": \"LeapIPCBench\",\n";
+    out << "  \"counters\": " << (IPCEndpoint::CountersEnabled() ? "true" : "false") << ",\n";
+#if USE_NETWORK_SOCKETS
+    out << "  \"networkSockets\": true,\n";
+#else
+    out << "  \"networkSockets\": false,\n";
+#endif
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      const Result& result = results[i];
+      const double messages = static_cast<double>(result.messages * result.channels);
+      char line[512];
+      snprintf(
+        line, sizeof(line),
+        "%s\n    { \"transport\": \"%s\", \"messageSize\": %llu, \"channels\": %u, \"fragments\": %u, "
+        "\"messages\": %.0f, \"seconds\": %.6f, \"messagesPerSec\": %.1f, \"mbPerSec\": %.3f, \"ok\": %s }",
+        i ? "," : "",
+        result.transport.c_str(),
+        static_cast<unsigned long long>(result.messageSize),
+        static_cast<unsigned>(result.channels),
+        static_cast<unsigned>(result.fragments),
+        messages,
+        result.seconds,
+        result.seconds > 0 ? messages / result.seconds : 0.0,
+        result.seconds > 0 ? messages * result.messageSize / result.seconds / 1e6 : 0.0,
+        result.ok ? "true" : "false"
+      );
+      out << line;
+    }
+    out << "\n  ]\n}\n";
+    return static_cast<bool>(out);
+  }
+
+  bool ParseOptions(int argc, const char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+      const std::string arg = argv[i];
+      const size_t eq = arg.find('=');
+      const std::string key = arg.substr(0, eq);
+      const std::string value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+      if (key == "--output")
+        options.output = value;
+      else if (key == "--transports")
+        options.transports = Split(value);
+      else if (key == "--min-size")
+        options.minSize = std::strtoull(value.c_str(), nullptr, 10);
+      else if (key == "--max-size")
+        options.maxSize = std::strtoull(value.c_str(), nullptr, 10);
+      else if (key == "--channels")
+        options.maxChannels = static_cast<size_t>(std::strtoul(value.c_str(), nullptr, 10));
+      else if (key == "--bytes-per-run")
+        options.bytesPerRun = std::strtoull(value.c_str(), nullptr, 10);
+      else if (key == "--fragments") {
+        options.fragments.clear();
+        for (const auto& part : Split(value))
+          options.fragments.push_back(static_cast<size_t>(std::strtoul(part.c_str(), nullptr, 10)));
+      }
+      else
+        return false;
+    }
+    return
+      options.minSize &&
+      options.minSize <= options.maxSize &&
+      options.maxChannels &&
+      options.maxChannels <= IPCEndpoint::Header::NUMBER_OF_CHANNELS &&
+      !options.fragments.empty() &&
+      std::find(options.fragments.begin(), options.fragments.end(), 0) == options.fragments.end();
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    fprintf(
+      stderr,
+      "Usage: %s [--output=FILE] [--transports=unix,tcp,circular] [--min-size=N] [--max-size=N]\n"
+      "       [--channels=N] [--fragments=1,4,16] [--bytes-per-run=N]\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  std::vector<Result> results;
+  bool ok = true;
+  for (const auto& transport : options.transports) {
+    // Sizes go up by a factor of eight, and the largest size is always run
+    for (uint64_t size = options.minSize; size; size = size < options.maxSize ? std::min(size * 8, options.maxSize) : 0) {
+      for (size_t nChannels = 1; nChannels <= options.maxChannels; nChannels++) {
+        for (size_t nFragments : options.fragments) {
+          if (nFragments > size)
+            continue;
+
+          const uint64_t nMessages = std::max<uint64_t>(
+            2,
+            std::min<uint64_t>(options.maxMessagesPerRun, options.bytesPerRun / (size * nChannels))
+          );
+          Result result = Run(transport, size, nChannels, nFragments, nMessages);
+          const double messages = static_cast<double>(result.messages * result.channels);
+          printf(
+            "%-8s %10llu B  %u ch  %2u frag  %12.0f msg/s  %10.1f MB/s%s\n",
+            transport.c_str(),
+            static_cast<unsigned long long>(size),
+            static_cast<unsigned>(nChannels),
+            static_cast<unsigned>(nFragments),
+            result.seconds > 0 ? messages / result.seconds : 0.0,
+            result.seconds > 0 ? messages * size / result.seconds / 1e6 : 0.0,
+            result.ok ? "" : "  FAILED"
+          );
+          fflush(stdout);
+          ok = ok && result.ok;
+          results.push_back(result);
+        }
+      }
+    }
+  }
+
+  if (!WriteResults(options, results)) {
+    fprintf(stderr, "Could not write %s\n", options.output.c_str());
+    return 1;
+  }
+  return ok ? 0 : 1;
+}
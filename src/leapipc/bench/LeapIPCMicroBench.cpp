@@ -0,0 +1,459 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include <leapipc/CircularBufferEndpoint.h>
+#include <leapipc/IPCEndpoint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !_WIN32
+#include <leapipc/IPCEndpointUnix.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#if __linux__
+#include <leapipc/SharedMemoryEndpointUnix.h>
+#endif
+
+using namespace leap::ipc;
+
+// Timings for the individual fast paths, each compared against the path it replaced or the setting that turns
+// it off.  The unit tests only check that these paths behave correctly, how much they save is measured here.
+//
+// Usage: LeapIPCMicroBench [SCENARIO...]
+// Runs every scenario if none are named.
+
+namespace {
+  struct Scenario {
+    const char* name;
+    const char* description;
+    bool (*run)(void);
+  };
+
+  // CircularBufferEndpointTest.SingleProducerSingleConsumerSequence checks that the lock-free mode delivers every byte
+  bool CircularBufferModes(void) {
+    // Same total volume for every transfer size, read back in pieces of the same size
+    static const size_t sc_nBytes = 16 * 1024 * 1024;
+    static const size_t sc_bufferSize = 2 * 1024 * 1024;
+
+    for (size_t transferSize : { 8, 64, 512, 4 * 1024, 32 * 1024, 256 * 1024, 1024 * 1024 }) {
+      std::vector<uint8_t> src(transferSize, 0xAB);
+      std::vector<uint8_t> dst(transferSize);
+      double mbps[2];
+
+      for (auto mode : { CircularBufferEndpoint::Mode::Locked, CircularBufferEndpoint::Mode::SingleProducerSingleConsumer }) {
+        CircularBufferEndpoint cbuf(sc_bufferSize, mode);
+        const auto start = std::chrono::steady_clock::now();
+        std::thread writer([&] {
+          for (size_t i = 0; i < sc_nBytes; i += transferSize)
+            cbuf.WriteRaw(src.data(), transferSize);
+        });
+        for (size_t nRead = 0; nRead < sc_nBytes; ) {
+          const std::streamsize n = cbuf.ReadRaw(dst.data(), transferSize);
+          if (n <= 0) {
+            cbuf.Abort(IPCEndpoint::Reason::Unspecified);
+            writer.join();
+            return false;
+          }
+          nRead += static_cast<size_t>(n);
+        }
+        writer.join();
+
+        const auto dt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        mbps[mode == CircularBufferEndpoint::Mode::Locked ? 0 : 1] = static_cast<double>(sc_nBytes) / std::max<int64_t>(1, dt.count());
+      }
+
+      printf(
+        "  %8zu bytes/transfer: locked %8.1f MB/s, spsc %8.1f MB/s\n",
+        transferSize, mbps[0], mbps[1]
+      );
+    }
+    return true;
+  }
+
+#if !_WIN32
+  struct SocketLink {
+    std::shared_ptr<IPCEndpointUnix> sender;
+    std::shared_ptr<IPCEndpointUnix> receiver;
+  };
+
+  SocketLink MakeSocketLink(void) {
+    SocketLink link;
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0) {
+      link.sender = std::make_shared<IPCEndpointUnix>(sockets[0]);
+      link.receiver = std::make_shared<IPCEndpointUnix>(sockets[1]);
+    }
+    return link;
+  }
+
+  struct ReceiveStats {
+    size_t nMessages;
+    uint64_t nReceiveCalls;
+    std::chrono::nanoseconds dt;
+  };
+
+  // Sends a stream of small messages on channel 0 from another thread and measures what it costs the receiver
+  // to take them in
+  ReceiveStats MeasureReceive(const SocketLink& link, size_t nMessages, const std::function<bool(IPCEndpoint::Channel&)>& write) {
+    std::thread writer([&] {
+      auto channel = link.sender->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+      for (size_t i = 0; i < nMessages; i++)
+        if (!write(*channel))
+          return;
+    });
+
+    ReceiveStats stats{};
+    auto channel = link.receiver->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+    const auto nReceiveCalls = link.receiver->ReceiveCallCount();
+    const auto start = std::chrono::steady_clock::now();
+    for (; stats.nMessages < nMessages; stats.nMessages++)
+      if (channel->ReadMessageBuffers().empty())
+        break;
+    stats.dt = std::chrono::steady_clock::now() - start;
+    stats.nReceiveCalls = link.receiver->ReceiveCallCount() - nReceiveCalls;
+    link.sender->Abort(IPCEndpoint::Reason::UserAborted);
+    writer.join();
+    return stats;
+  }
+
+  void PrintReceiveStats(const char* label, const ReceiveStats& stats) {
+    printf(
+      "  %-10s %6.2f receive calls/message, %6lld ns/message\n",
+      label,
+      static_cast<double>(stats.nReceiveCalls) / std::max<size_t>(1, stats.nMessages),
+      static_cast<long long>(stats.dt.count() / std::max<size_t>(1, stats.nMessages))
+    );
+  }
+
+  // IPCEndpointUnixTest.ReceiveBufferingReducesSyscalls checks the call count on a batch that is already waiting
+  bool ReceiveBuffering(void) {
+    // Four small fragments per message, so unbuffered every frame costs a call for its header and its payload
+    static const size_t sc_nMessages = 20000;
+    MessageBuffers::Buffers buffers;
+    for (size_t i = 0; i < 4; i++)
+      buffers.push_back(std::make_shared<MessageBuffers::Buffer>(16));
+
+    bool ok = true;
+    for (size_t receiveBufferSize : { size_t(0), size_t(IPCEndpointUnix::DEFAULT_RECEIVE_BUFFER_SIZE) }) {
+      SocketLink link = MakeSocketLink();
+      if (!link.sender)
+        return false;
+      link.receiver->SetReceiveBufferSize(receiveBufferSize);
+      const ReceiveStats stats = MeasureReceive(
+        link, sc_nMessages,
+        [&buffers] (IPCEndpoint::Channel& channel) { return channel.WriteMessageBuffers(buffers); }
+      );
+      PrintReceiveStats(receiveBufferSize ? "buffered" : "unbuffered", stats);
+      ok = ok && stats.nMessages == sc_nMessages;
+    }
+    return ok;
+  }
+
+  // IPCChannelTest.BufferedWritesShareFrames checks which writes share a frame
+  bool WriteBuffering(void) {
+    // Serializer-style traffic, four small writes per message, received without buffering so that every frame
+    // shows up as receive calls
+    static const size_t sc_nMessages = 20000;
+    bool ok = true;
+    for (size_t threshold : { 0, 256 }) {
+      SocketLink link = MakeSocketLink();
+      if (!link.sender)
+        return false;
+      link.receiver->SetReceiveBufferSize(0);
+      const ReceiveStats stats = MeasureReceive(
+        link, sc_nMessages,
+        [threshold] (IPCEndpoint::Channel& channel) {
+          channel.SetWriteBuffering(threshold);
+          const uint32_t message[4] = { 1, 2, 3, 4 };
+          for (size_t j = 0; j < 4; j++)
+            channel.Write(message, sizeof(message));
+          return channel.WriteMessageComplete();
+        }
+      );
+      PrintReceiveStats(threshold ? "buffered" : "unbuffered", stats);
+      ok = ok && stats.nMessages == sc_nMessages;
+    }
+    return ok;
+  }
+
+  // IPCEndpointUnixTest.ReadRawIsOneReceiveCall checks that ReadRaw makes no calls besides the receive
+  bool ReadWithoutPoll(void) {
+    // Small reads with data already waiting, the common case on a busy link.  The poll-then-recv sequence that
+    // ReadRaw used to make is timed on a bare socket pair for comparison.
+    static const size_t sc_nBatches = 100;
+    static const size_t sc_nReads = 1000;
+    const std::vector<uint64_t> batch(sc_nReads, 0xDEADBEEF);
+    const std::streamsize batchBytes = static_cast<std::streamsize>(batch.size() * sizeof(uint64_t));
+    uint64_t value = 0;
+
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+      return false;
+    bool ok = true;
+    std::chrono::nanoseconds pollFirst{ 0 };
+    for (size_t i = 0; i < sc_nBatches && ok; i++) {
+      ok = ::send(sockets[0], batch.data(), batchBytes, 0) == batchBytes;
+      const auto start = std::chrono::steady_clock::now();
+      for (size_t j = 0; j < sc_nReads && ok; j++) {
+        pollfd fds = { sockets[1], POLLIN, 0 };
+        ok =
+          ::poll(&fds, 1, -1) == 1 &&
+          ::recv(sockets[1], &value, sizeof(value), 0) == static_cast<ssize_t>(sizeof(value));
+      }
+      pollFirst += std::chrono::steady_clock::now() - start;
+    }
+    ::close(sockets[0]);
+    ::close(sockets[1]);
+
+    // Buffering is off, so every ReadRaw is a real receive call
+    SocketLink link = MakeSocketLink();
+    if (!link.sender)
+      return false;
+    std::chrono::nanoseconds direct{ 0 };
+    for (size_t i = 0; i < sc_nBatches && ok; i++) {
+      ok = link.sender->WriteRaw(batch.data(), batchBytes);
+      const auto start = std::chrono::steady_clock::now();
+      for (size_t j = 0; j < sc_nReads && ok; j++)
+        ok = link.receiver->ReadRaw(&value, sizeof(value)) == static_cast<std::streamsize>(sizeof(value));
+      direct += std::chrono::steady_clock::now() - start;
+    }
+
+    printf(
+      "  poll+recv %6lld ns/read, ReadRaw %6lld ns/read\n",
+      static_cast<long long>(pollFirst.count() / (sc_nBatches * sc_nReads)),
+      static_cast<long long>(direct.count() / (sc_nBatches * sc_nReads))
+    );
+    return ok;
+  }
+
+  // IPCEndpointUnixTest.FragmentsInterleaveAcrossChannels checks that the small message overtakes the transfer
+  bool InterleavedLatency(void) {
+    // A bulk transfer is already underway on one channel when a small message is sent on another
+    static const size_t sc_bulkSize = 64 * 1024 * 1024;
+    SocketLink link = MakeSocketLink();
+    if (!link.sender)
+      return false;
+    link.sender->SetMaxFragmentSize(64 * 1024);
+    std::atomic<size_t> nBulkRead{ 0 };
+
+    // The control reader has to be in place before the bulk reader starts taking frames off the stream
+    auto control = link.receiver->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+    bool bulkWritten = false;
+    std::thread bulkWriter([&] {
+      auto channel = link.sender->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+      bulkWritten = channel->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(sc_bulkSize) });
+    });
+    std::thread bulkReader([&] {
+      auto channel = link.receiver->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+      std::vector<uint8_t> buf(256 * 1024);
+      while (nBulkRead < sc_bulkSize) {
+        const std::streamsize n = channel->Read(buf.data(), static_cast<std::streamsize>(buf.size()));
+        if (n <= 0)
+          return;
+        nBulkRead += static_cast<size_t>(n);
+      }
+    });
+    while (!nBulkRead)
+      std::this_thread::yield();
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool ok =
+      link.sender->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY)->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(16) }) &&
+      control->ReadMessageBuffers().size() == 1;
+    const auto latency = std::chrono::steady_clock::now() - start;
+    const size_t nBulkReadAtControl = nBulkRead;
+    if (!ok)
+      link.receiver->Abort(IPCEndpoint::Reason::Unspecified);
+    bulkWriter.join();
+    bulkReader.join();
+
+    printf(
+      "  small message %6lld us, after %zu of %zu bulk bytes\n",
+      static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count()),
+      nBulkReadAtControl, sc_bulkSize
+    );
+    return ok && bulkWritten;
+  }
+
+  // IPCChannelTest.HigherPriorityChannelsSendFirst checks the order in which waiting channels get the wire
+  bool PriorityLatency(void) {
+    // Small messages on channel 0 while several bulk writers keep the link saturated, with and without priority
+    static const size_t sc_nSamples = 200;
+    static const uint32_t sc_nBulkChannels = 3;
+    bool ok = true;
+    for (int priority : { 0, 1 }) {
+      SocketLink link = MakeSocketLink();
+      if (!link.sender)
+        return false;
+      auto sender = link.sender;
+      auto receiver = link.receiver;
+      sender->SetMaxFragmentSize(16 * 1024);
+      sender->SetChannelPriority(0, priority);
+
+      auto control = receiver->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+      std::atomic<size_t> nBulkMessages{ 0 };
+      std::vector<std::thread> bulk;
+      for (uint32_t i = 1; i <= sc_nBulkChannels; i++) {
+        bulk.emplace_back([sender, i] {
+          auto channel = sender->AcquireChannel(i, IPCEndpoint::Channel::WRITE_ONLY);
+          const MessageBuffers::Buffers buffers{ std::make_shared<MessageBuffers::Buffer>(1024 * 1024) };
+          while (channel->WriteMessageBuffers(buffers));
+        });
+        bulk.emplace_back([receiver, i, &nBulkMessages] {
+          auto channel = receiver->AcquireChannel(i, IPCEndpoint::Channel::READ_ONLY);
+          while (!channel->ReadMessageBuffers().empty())
+            nBulkMessages++;
+        });
+      }
+      while (nBulkMessages < sc_nBulkChannels)
+        std::this_thread::yield();
+
+      std::vector<std::chrono::nanoseconds> latencies;
+      auto channel = sender->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+      const MessageBuffers::Buffers buffers{ std::make_shared<MessageBuffers::Buffer>(16) };
+      for (size_t i = 0; i < sc_nSamples; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        if (!channel->WriteMessageBuffers(buffers) || control->ReadMessageBuffers().size() != 1)
+          break;
+        latencies.push_back(std::chrono::steady_clock::now() - start);
+      }
+
+      sender->Abort(IPCEndpoint::Reason::UserAborted);
+      receiver->Abort(IPCEndpoint::Reason::UserAborted);
+      for (auto& thread : bulk)
+        thread.join();
+      if (latencies.size() != sc_nSamples) {
+        ok = false;
+        continue;
+      }
+
+      std::sort(latencies.begin(), latencies.end());
+      printf(
+        "  %-14s p50 %6lld us, p99 %6lld us\n",
+        priority ? "high priority" : "equal priority",
+        static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(latencies[sc_nSamples / 2]).count()),
+        static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(latencies[sc_nSamples * 99 / 100]).count())
+      );
+    }
+    return ok;
+  }
+#endif
+
+#if __linux__
+  // SharedMemoryEndpointUnixTest.LargeMessagesWrapTheRing checks that messages larger than the ring arrive intact
+  bool SharedMemoryThroughput(void) {
+    // Messages several times larger than the ring, through the ring and through the socket it was negotiated over
+    static const size_t sc_nMessages = 32;
+    static const size_t sc_messageSize = 3 * 1024 * 1024 + 17;
+
+    bool ok = true;
+    for (bool isShared : { false, true }) {
+      int sockets[2];
+      if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+        return false;
+
+      std::shared_ptr<IPCEndpoint> client, server;
+      if (isShared) {
+        std::thread listener([&] { server = SharedMemoryEndpointUnix::Answer(sockets[1], SharedMemoryEndpointUnix::DEFAULT_RING_SIZE); });
+        client = SharedMemoryEndpointUnix::Offer(sockets[0], SharedMemoryEndpointUnix::DEFAULT_RING_SIZE);
+        listener.join();
+        if (!client)
+          ::close(sockets[0]);
+        if (!server)
+          ::close(sockets[1]);
+        if (!std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(client) || !std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(server)) {
+          printf("  shared memory was not negotiated\n");
+          return false;
+        }
+      }
+      else {
+        client = std::make_shared<IPCEndpointUnix>(sockets[0]);
+        server = std::make_shared<IPCEndpointUnix>(sockets[1]);
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      std::thread writer([&] {
+        auto channel = client->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+        auto buffer = std::make_shared<MessageBuffers::Buffer>(sc_messageSize);
+        for (size_t i = 0; i < sc_nMessages; i++)
+          if (!channel->WriteMessageBuffers({ buffer }))
+            return;
+      });
+
+      size_t nBytes = 0;
+      auto channel = server->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+      for (size_t i = 0; i < sc_nMessages; i++) {
+        auto buffers = channel->ReadMessageBuffers();
+        if (buffers.empty())
+          break;
+        for (const auto& buffer : buffers)
+          nBytes += buffer->Size();
+      }
+      const auto dt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+      client->Abort(IPCEndpoint::Reason::UserAborted);
+      writer.join();
+
+      ok = ok && nBytes == sc_nMessages * sc_messageSize;
+      printf(
+        "  %-14s %8.1f MB/s\n",
+        isShared ? "shared memory" : "socket",
+        static_cast<double>(nBytes) / std::max<int64_t>(1, dt.count())
+      );
+    }
+    return ok;
+  }
+#endif
+
+  const Scenario sc_scenarios[] = {
+    { "circular", "CircularBufferEndpoint throughput, locked against single producer/single consumer", &CircularBufferModes },
+#if !_WIN32
+    { "receive-buffering", "Receive calls and time per message, with and without receive buffering", &ReceiveBuffering },
+    { "write-buffering", "Receive calls and time per message, with and without Channel write buffering", &WriteBuffering },
+    { "read-poll", "Small reads with data waiting, poll+recv against ReadRaw", &ReadWithoutPoll },
+    { "interleave", "Latency of a small message sent while a bulk transfer is underway", &InterleavedLatency },
+    { "priority", "Tail latency of small messages on a saturated link, with and without channel priority", &PriorityLatency },
+#endif
+#if __linux__
+    { "shared-memory", "Throughput of large messages, shared memory ring against the socket", &SharedMemoryThroughput },
+#endif
+  };
+}
+
+int main(int argc, const char* argv[]) {
+  std::vector<const Scenario*> selected;
+  for (int i = 1; i < argc; i++) {
+    const Scenario* found = nullptr;
+    for (const auto& scenario : sc_scenarios)
+      if (argv[i] == std::string(scenario.name))
+        found = &scenario;
+    if (!found) {
+      fprintf(stderr, "Usage: %s [SCENARIO...]\n", argv[0]);
+      for (const auto& scenario : sc_scenarios)
+        fprintf(stderr, "  %-18s %s\n", scenario.name, scenario.description);
+      return 2;
+    }
+    selected.push_back(found);
+  }
+  if (selected.empty())
+    for (const auto& scenario : sc_scenarios)
+      selected.push_back(&scenario);
+
+  bool ok = true;
+  for (const Scenario* scenario : selected) {
+    printf("%s: %s\n", scenario->name, scenario->description);
+    fflush(stdout);
+    if (!scenario->run()) {
+      printf("  FAILED\n");
+      ok = false;
+    }
+    fflush(stdout);
+  }
+  return ok ? 0 : 1;
+}
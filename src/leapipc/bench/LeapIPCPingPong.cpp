@@ -0,0 +1,305 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include <autowiring/autowiring.h>
+#include <autowiring/CoreThread.h>
+#include <leapipc/IPCClient.h>
+#include <leapipc/IPCEndpoint.h>
+#include <leapipc/IPCListener.h>
+#include <leapipc/LatencyHistogram.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if __linux__
+#include <sched.h>
+#endif
+
+using namespace leap::ipc;
+
+// Round-trip latency between an IPCClient and an IPCListener.  The client sends a message of the requested
+// size and waits for the listener's side to echo it back, and the time for each round trip goes into a
+// histogram.  Either peer can run in a process of its own, so that the cost of crossing between processes
+// is part of the measurement.
+//
+// Usage: LeapIPCPingPong [--size=N] [--iterations=N] [--warmup=N] [--fork=none|server|both]
+//                        [--server-cpu=N] [--client-cpu=N] [--ring-size=N] [--output=FILE]
+
+namespace {
+  enum class Fork {
+    // Both peers are threads of this process
+    None,
+
+    // The echoing peer runs in a child process
+    Server,
+
+    // Both peers run in child processes of their own
+    Both
+  };
+
+  struct Options {
+    uint64_t size = 64;
+    uint64_t iterations = 1000000;
+    uint64_t warmup = 10000;
+    Fork fork = Fork::None;
+    int serverCpu = -1;
+    int clientCpu = -1;
+    size_t ringSize = 0;
+    std::string output;
+  };
+
+  const std::chrono::seconds sc_connectTimeout{ 10 };
+
+  void PinToCpu(int cpu) {
+    if (cpu < 0)
+      return;
+#if __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+      fprintf(stderr, "Could not pin to CPU %d\n", cpu);
+#else
+    fprintf(stderr, "CPU pinning is not supported on this platform\n");
+#endif
+  }
+
+  // Echoes every message back until the client goes away
+  int RunServer(const Options& options, const std::string& scope, const std::string& ns) {
+    PinToCpu(options.serverCpu);
+    AutoCurrentContext ctxt;
+    ctxt->Initiate();
+    AutoConstruct<IPCListener> listener(scope.c_str(), ns.c_str());
+    listener->EnableHandshake();
+    listener->SetSharedMemoryRingSize(options.ringSize);
+
+    std::mutex lock;
+    std::condition_variable connected;
+    std::shared_ptr<IPCEndpoint> endpoint;
+    listener->onClientConnected += [&](const std::shared_ptr<IPCEndpoint>& ep) {
+      std::lock_guard<std::mutex> lk(lock);
+      if (!endpoint)
+        endpoint = ep;
+      connected.notify_all();
+    };
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      if (!connected.wait_for(lk, sc_connectTimeout, [&] { return endpoint != nullptr; })) {
+        fprintf(stderr, "No client connected\n");
+        ctxt->SignalShutdown(true);
+        return 1;
+      }
+    }
+
+    auto channel = endpoint->AcquireChannel(0, IPCEndpoint::Channel::READ_WRITE);
+    for (;;) {
+      auto message = channel->ReadMessageBuffers();
+      if (message.empty() || !channel->WriteMessageBuffers(message))
+        break;
+    }
+    ctxt->SignalShutdown(true);
+    return 0;
+  }
+
+  // Sends the pings and reports on how long the pongs took
+  int RunClient(const Options& options, const std::string& scope, const std::string& ns) {
+    PinToCpu(options.clientCpu);
+    AutoCurrentContext ctxt;
+    ctxt->Initiate();
+    AutoConstruct<IPCClient> client(scope.c_str(), ns.c_str());
+    client->EnableHandshake();
+    client->SetSharedMemoryRingSize(options.ringSize);
+    auto endpoint = client->Connect(sc_connectTimeout);
+    if (!endpoint) {
+      fprintf(stderr, "Could not connect to the server\n");
+      return 1;
+    }
+
+    auto channel = endpoint->AcquireChannel(0, IPCEndpoint::Channel::READ_WRITE);
+    MessageBuffers::Buffers ping{ MessageBuffers::MakeBuffer(static_cast<size_t>(options.size)) };
+    memset(ping[0]->Data(), 0x5A, ping[0]->Size());
+
+    LatencyHistogram histogram;
+    auto fastest = std::chrono::nanoseconds::max();
+    for (uint64_t i = 0; i < options.warmup + options.iterations; i++) {
+      const auto start = std::chrono::steady_clock::now();
+      if (!channel->WriteMessageBuffers(ping)) {
+        fprintf(stderr, "Write failed after %llu round trips\n", static_cast<unsigned long long>(i));
+        return 1;
+      }
+      uint64_t nBytes = 0;
+      for (const auto& buffer : channel->ReadMessageBuffers())
+        nBytes += buffer->Size();
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      if (nBytes != options.size) {
+        fprintf(stderr, "Bad echo after %llu round trips\n", static_cast<unsigned long long>(i));
+        return 1;
+      }
+
+      if (i < options.warmup)
+        continue;
+      histogram.Record(elapsed);
+      fastest = std::min<std::chrono::nanoseconds>(fastest, elapsed);
+    }
+
+    // The server finishes when we hang up
+    channel.reset();
+    endpoint->Abort(IPCEndpoint::Reason::Unspecified);
+
+    const struct {
+      const char* name;
+      std::chrono::nanoseconds value;
+    } stats[] = {
+      { "min", histogram.Count() ? fastest : std::chrono::nanoseconds(0) },
+      { "p50", histogram.Percentile(0.5) },
+      { "p99", histogram.Percentile(0.99) },
+      { "p999", histogram.Percentile(0.999) },
+      { "max", histogram.Max() }
+    };
+    printf(
+      "%llu round trips of %llu bytes:",
+      static_cast<unsigned long long>(histogram.Count()),
+      static_cast<unsigned long long>(options.size)
+    );
+    for (const auto& stat : stats)
+      printf("  %s %.3fus", stat.name, stat.value.count() / 1e3);
+    printf("\n");
+
+    if (!options.output.empty()) {
+      std::ofstream out(options.output);
+      out << "{\n";
+      out << "  \"benchmark\": \"LeapIPCPingPong\",\n";
+      out << "  \"messageSize\": " << options.size << ",\n";
+      out << "  \"iterations\": " << histogram.Count() << ",\n";
+      out << "  \"fork\": \"" << (options.fork == Fork::None ? "none" : options.fork == Fork::Server ? "server" : "both") << "\",\n";
+      out << "  \"ringSize\": " << options.ringSize << ",\n";
+      out << "  \"latencyNs\": {";
+      for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+        out << (i ? ", " : " ") << "\"" << stats[i].name << "\": " << stats[i].value.count();
+      out << " }\n";
+      out << "}\n";
+      if (!out) {
+        fprintf(stderr, "Could not write %s\n", options.output.c_str());
+        return 1;
+      }
+    }
+    ctxt->SignalShutdown(true);
+    return 0;
+  }
+
+  // Runs one of the peers in a child process, returns the child's pid or -1 on failure
+  template<class Fn>
+  pid_t Spawn(Fn&& fn) {
+    fflush(stdout);
+    const pid_t pid = ::fork();
+    if (pid == 0) {
+      const int result = fn();
+      fflush(stdout);
+      _exit(result);
+    }
+    return pid;
+  }
+
+  int Join(pid_t pid) {
+    int status;
+    while (::waitpid(pid, &status, 0) < 0)
+      if (errno != EINTR)
+        return 1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+  }
+
+  bool ParseOptions(int argc, const char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+      const std::string arg = argv[i];
+      const size_t eq = arg.find('=');
+      const std::string key = arg.substr(0, eq);
+      const std::string value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+      if (key == "--size")
+        options.size = std::strtoull(value.c_str(), nullptr, 10);
+      else if (key == "--iterations")
+        options.iterations = std::strtoull(value.c_str(), nullptr, 10);
+      else if (key == "--warmup")
+        options.warmup = std::strtoull(value.c_str(), nullptr, 10);
+      else if (key == "--server-cpu")
+        options.serverCpu = std::atoi(value.c_str());
+      else if (key == "--client-cpu")
+        options.clientCpu = std::atoi(value.c_str());
+      else if (key == "--ring-size")
+        options.ringSize = static_cast<size_t>(std::strtoull(value.c_str(), nullptr, 10));
+      else if (key == "--output")
+        options.output = value;
+      else if (key == "--fork") {
+        if (value == "none")
+          options.fork = Fork::None;
+        else if (value == "server")
+          options.fork = Fork::Server;
+        else if (value == "both")
+          options.fork = Fork::Both;
+        else
+          return false;
+      }
+      else
+        return false;
+    }
+    return options.size && options.iterations;
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    fprintf(
+      stderr,
+      "Usage: %s [--size=N] [--iterations=N] [--warmup=N] [--fork=none|server|both]\n"
+      "       [--server-cpu=N] [--client-cpu=N] [--ring-size=N] [--output=FILE]\n",
+      argv[0]
+    );
+    return 2;
+  }
+
+  // Settled before anything is forked, so that both processes agree on where to meet
+  const std::string scope = IPCTestScope();
+  const std::string ns = "LeapIPCPingPong." + std::to_string(::getpid());
+  auto server = [&] { return RunServer(options, scope, ns); };
+  auto client = [&] { return RunClient(options, scope, ns); };
+
+  switch (options.fork) {
+  case Fork::None:
+    {
+      int serverResult = 1;
+      std::thread serverThread([&] { serverResult = server(); });
+      const int clientResult = client();
+      serverThread.join();
+      return clientResult ? clientResult : serverResult;
+    }
+  case Fork::Server:
+    {
+      const pid_t serverPid = Spawn(server);
+      if (serverPid < 0)
+        return 1;
+      const int clientResult = client();
+      const int serverResult = Join(serverPid);
+      return clientResult ? clientResult : serverResult;
+    }
+  case Fork::Both:
+    {
+      const pid_t serverPid = Spawn(server);
+      if (serverPid < 0)
+        return 1;
+      const pid_t clientPid = Spawn(client);
+      const int clientResult = clientPid < 0 ? 1 : Join(clientPid);
+      const int serverResult = Join(serverPid);
+      return clientResult ? clientResult : serverResult;
+    }
+  }
+  return 1;
+}
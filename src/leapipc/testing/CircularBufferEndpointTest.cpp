@@ -4,8 +4,11 @@
 #include <leapipc/CircularBufferEndpoint.h>
 #include <autowiring/autowiring.h>
 #include <autowiring/CoreThread.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <thread>
+#include <vector>
 #include <gtest/gtest.h>
 
 using namespace leap::ipc;
@@ -101,3 +104,110 @@ TEST_F(CircularBufferEndpointTest, IncreaseSize)
 
   reader.join();
 }
+
+TEST_F(CircularBufferEndpointTest, SingleProducerSingleConsumerSequence)
+{
+  // Buffer much smaller than the data, in odd-sized pieces so that reads and writes straddle the wrap point
+  CircularBufferEndpoint cbuf(64, CircularBufferEndpoint::Mode::SingleProducerSingleConsumer);
+  static const size_t sc_nBytes = 1024 * 1024;
+
+  std::thread writer([&cbuf] {
+    uint8_t chunk[37];
+    for (size_t i = 0; i < sc_nBytes; ) {
+      const size_t n = std::min(sizeof(chunk), sc_nBytes - i);
+      for (size_t j = 0; j < n; j++)
+        chunk[j] = static_cast<uint8_t>(i + j);
+      ASSERT_TRUE(cbuf.WriteRaw(chunk, n));
+      i += n;
+    }
+  });
+
+  uint8_t chunk[29];
+  for (size_t i = 0; i < sc_nBytes; ) {
+    const std::streamsize n = cbuf.ReadRaw(chunk, std::min(sizeof(chunk), sc_nBytes - i));
+    ASSERT_LT(0, n);
+    for (std::streamsize j = 0; j < n; j++, i++)
+      ASSERT_EQ(static_cast<uint8_t>(i), chunk[j]) << "Corruption at offset " << i;
+  }
+  writer.join();
+}
+
+TEST_F(CircularBufferEndpointTest, SingleProducerSingleConsumerAbort)
+{
+  CircularBufferEndpoint cbuf(64, CircularBufferEndpoint::Mode::SingleProducerSingleConsumer);
+  std::thread reader([&cbuf] {
+    char t[4];
+    ASSERT_EQ(0, cbuf.ReadRaw(t, sizeof(t)));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  cbuf.Abort(IPCEndpoint::Reason::UserAborted);
+  reader.join();
+  ASSERT_FALSE(cbuf.WriteRaw("abcd", 4));
+}
+
+TEST_F(CircularBufferEndpointTest, ReserveCommitPeekConsume)
+{
+  static const size_t sc_nBytes = 256 * 1024;
+
+  for (auto mode : { CircularBufferEndpoint::Mode::Locked, CircularBufferEndpoint::Mode::SingleProducerSingleConsumer }) {
+    // Reservation sizes that don't divide the buffer evenly, so that the writer regularly runs out of room at the end
+    CircularBufferEndpoint cbuf(256, mode);
+    std::thread writer([&cbuf] {
+      size_t sizes[] = { 1, 7, 64, 100, 33, 250 };
+      for (size_t i = 0, k = 0; i < sc_nBytes; k++) {
+        const size_t n = std::min(sizes[k % (sizeof(sizes) / sizeof(*sizes))], sc_nBytes - i);
+        uint8_t* pBuf = cbuf.Reserve(n);
+        ASSERT_NE(nullptr, pBuf);
+        for (size_t j = 0; j < n; j++)
+          pBuf[j] = static_cast<uint8_t>(i + j);
+        cbuf.Commit(n);
+        i += n;
+      }
+    });
+
+    size_t nRead = 0;
+    for (size_t k = 0; nRead < sc_nBytes; k++) {
+      CircularBufferEndpoint::Span spans[2];
+      const size_t available = cbuf.Peek(spans);
+      ASSERT_LT(0UL, available);
+      ASSERT_EQ(available, spans[0].size + spans[1].size);
+
+      // Don't always take everything, so that a peek can start anywhere
+      const size_t n = k % 3 ? available : (available + 1) / 2;
+      size_t offset = 0;
+      for (const auto& span : spans)
+        for (size_t j = 0; j < span.size && offset < n; j++, offset++)
+          ASSERT_EQ(static_cast<uint8_t>(nRead + offset), span.data[j]) << "Corruption at offset " << nRead + offset;
+      cbuf.Consume(n);
+      nRead += n;
+    }
+    writer.join();
+  }
+}
+
+TEST_F(CircularBufferEndpointTest, ReserveWithCopyingReader)
+{
+  CircularBufferEndpoint cbuf(64, CircularBufferEndpoint::Mode::SingleProducerSingleConsumer);
+  std::thread writer([&cbuf] {
+    for (int i = 0; i < 1000; i++) {
+      uint8_t* pBuf = cbuf.Reserve(sizeof(i));
+      ASSERT_NE(nullptr, pBuf);
+      memcpy(pBuf, &i, sizeof(i));
+      cbuf.Commit(sizeof(i));
+
+      // Skews the alignment so reservations don't land evenly at the end of the ring
+      ASSERT_TRUE(cbuf.WriteRaw("x", 1));
+    }
+  });
+
+  for (int i = 0; i < 1000; i++) {
+    int value;
+    char x;
+    for (size_t n = 0; n < sizeof(value); )
+      n += static_cast<size_t>(cbuf.ReadRaw(reinterpret_cast<uint8_t*>(&value) + n, sizeof(value) - n));
+    ASSERT_EQ(i, value);
+    ASSERT_EQ(1, cbuf.ReadRaw(&x, 1));
+    ASSERT_EQ('x', x);
+  }
+  writer.join();
+}
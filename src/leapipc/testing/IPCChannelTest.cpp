@@ -1,12 +1,14 @@
 // Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
 #include "stdafx.h"
 #include "IPCTestUtils.h"
+#include <leapipc/CircularBufferEndpoint.h>
 #include <leapipc/IPCClient.h>
 #include <leapipc/IPCEndpoint.h>
 #include <leapipc/IPCListener.h>
 #include <autowiring/autowiring.h>
 #include <autowiring/CoreThread.h>
 #include <gtest/gtest.h>
+#include FUTURE_HEADER
 
 using namespace leap::ipc;
 
@@ -62,3 +64,395 @@ TEST_F(IPCChannelTest, MultipleChannelInstances)
     ASSERT_NE(nullptr, channel) << "Failed to reobtain a channel for read/write after releasing it";
   }
 }
+
+TEST_F(IPCChannelTest, ReadAheadAvoidsHeadOfLineBlocking)
+{
+  // The endpoint reads back whatever it writes
+  auto ep = std::make_shared<CircularBufferEndpoint>(64 * 1024);
+  ep->SetReadAheadLimit(1024);
+
+  auto writer0 = ep->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+  auto writer1 = ep->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+  auto reader0 = ep->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+  auto reader1 = ep->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+
+  // Channel 0's reader is not reading yet, but its message must not hold up channel 1
+  auto payload = std::make_shared<MessageBuffers::Buffer>(1024);
+  ASSERT_TRUE(writer0->WriteMessageBuffers({ payload }));
+  ASSERT_TRUE(writer1->Write("abc", 3));
+  ASSERT_TRUE(writer1->WriteMessageComplete());
+
+  char buf[8];
+  ASSERT_EQ(3, reader1->Read(buf, sizeof(buf)));
+  ASSERT_EQ(0, memcmp(buf, "abc", 3));
+  reader1->ReadMessageComplete();
+
+  // Channel 0 is now full, so anything more for it stops the stream until its reader catches up
+  for (size_t i = 0; i < 3; i++)
+    ASSERT_TRUE(writer0->WriteMessageBuffers({ payload }));
+  ASSERT_TRUE(writer1->WriteMessageBuffers({ payload }));
+
+  auto blocked = std::async(
+    std::launch::async,
+    [&reader1] { return reader1->ReadMessageBuffers().size(); }
+  );
+  ASSERT_EQ(std::future_status::timeout, blocked.wait_for(std::chrono::milliseconds(100))) << "Read-ahead limit was not enforced";
+
+  for (size_t i = 0; i < 4; i++) {
+    auto buffers = reader0->ReadMessageBuffers();
+    ASSERT_EQ(1UL, buffers.size());
+    ASSERT_EQ(1024UL, buffers[0]->Size());
+  }
+  ASSERT_EQ(std::future_status::ready, blocked.wait_for(std::chrono::seconds(5))) << "Reader was not released by backpressure";
+  ASSERT_EQ(1UL, blocked.get());
+}
+
+TEST_F(IPCChannelTest, ExtendedChannels)
+{
+  auto ep = std::make_shared<CircularBufferEndpoint>(64 * 1024);
+  ASSERT_EQ(nullptr, ep->AcquireChannel(IPCEndpoint::Header::MAX_CHANNEL + 1, IPCEndpoint::Channel::READ_WRITE)) << "Obtained a channel beyond the largest channel number";
+
+  // Channels that differ only above the two bits in the fixed header must not be confused with each other
+  static const uint32_t sc_channels[] = { 1, 5, 1001, IPCEndpoint::Header::MAX_CHANNEL };
+  std::vector<std::unique_ptr<IPCEndpoint::Channel>> channels;
+  for (uint32_t channel : sc_channels) {
+    channels.push_back(ep->AcquireChannel(channel, IPCEndpoint::Channel::READ_WRITE));
+    ASSERT_NE(nullptr, channels.back()) << "Failed to obtain channel " << channel;
+  }
+  for (size_t i = 0; i < channels.size(); i++) {
+    auto buffer = std::make_shared<MessageBuffers::Buffer>(sizeof(uint32_t));
+    memcpy(buffer->Data(), &sc_channels[i], sizeof(uint32_t));
+    ASSERT_TRUE(channels[i]->WriteMessageBuffers({ buffer }));
+  }
+
+  for (size_t i = 0; i < channels.size(); i++) {
+    auto buffers = channels[i]->ReadMessageBuffers();
+    ASSERT_EQ(1UL, buffers.size());
+    uint32_t value = 0;
+    memcpy(&value, buffers[0]->Data(), sizeof(value));
+    ASSERT_EQ(sc_channels[i], value) << "Message was delivered to the wrong channel";
+  }
+}
+
+TEST_F(IPCChannelTest, BaseChannelsUseVersionZeroFrames)
+{
+  // Peers that predate extended channels must keep seeing plain 8-byte headers on the first four channels
+  auto ep = std::make_shared<CircularBufferEndpoint>(1024);
+  auto channel = ep->AcquireChannel(3, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(channel->Write("abc", 3));
+
+  IPCEndpoint::Header header;
+  ASSERT_EQ(static_cast<std::streamsize>(sizeof(header)), ep->ReadRaw(&header, sizeof(header)));
+  ASSERT_TRUE(header.Validate());
+  ASSERT_EQ(0u, header.Version());
+  ASSERT_EQ(3u, header.Channel());
+  ASSERT_EQ(sizeof(header), header.Size());
+  ASSERT_EQ(3u, header.PayloadSize());
+}
+
+TEST_F(IPCChannelTest, HigherPriorityChannelsSendFirst)
+{
+  // The buffer fills up partway through channel 1's message, and the other writers line up behind it one at a time
+  auto ep = std::make_shared<CircularBufferEndpoint>(256, CircularBufferEndpoint::Mode::SingleProducerSingleConsumer);
+  ep->SetMaxFragmentSize(128);
+  ep->SetChannelPriority(0, 1);
+
+  // Waits until the buffer is full and nWriters have the wire or are waiting for it.  Once the buffer is full the
+  // writer that has the wire can't give it up, so everyone who arrives after that has to queue for a turn.
+  auto lineUp = [&ep](size_t nWriters) {
+    for (auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(5); std::chrono::steady_clock::now() < limit;) {
+      CircularBufferEndpoint::Span spans[2];
+      const size_t nBuffered = ep->Peek(spans);
+      ep->Consume(0);
+      if (nBuffered == 256 && ep->GetWritersInLine() == nWriters)
+        return true;
+      std::this_thread::yield();
+    }
+    ep->Abort(IPCEndpoint::Reason::UserAborted);
+    return false;
+  };
+
+  std::vector<std::future<bool>> writers;
+  for (uint32_t channel : { 1, 2, 3, 0 }) {
+    writers.push_back(std::async(
+      std::launch::async,
+      [ep, channel] {
+        auto writer = ep->AcquireChannel(channel, IPCEndpoint::Channel::WRITE_ONLY);
+        return writer->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(channel == 1 ? 1024 : 16) });
+      }
+    ));
+    ASSERT_TRUE(lineUp(writers.size())) << "Writer on channel " << channel << " never lined up for its turn";
+  }
+
+  auto readN = [&ep](void* buf, std::streamsize size) {
+    for (uint8_t* p = static_cast<uint8_t*>(buf); size;) {
+      const std::streamsize n = ep->ReadRaw(p, size);
+      if (n <= 0)
+        return false;
+      p += n;
+      size -= n;
+    }
+    return true;
+  };
+
+  // Record the order in which the small messages arrive, draining channel 1 along the way
+  std::vector<uint32_t> order;
+  std::vector<uint8_t> payload;
+  size_t nComplete = 0;
+  while (nComplete < 4) {
+    IPCEndpoint::Header header;
+    ASSERT_TRUE(readN(&header, sizeof(header)));
+    ASSERT_TRUE(header.Validate());
+    payload.resize(header.PayloadSize());
+    ASSERT_TRUE(readN(payload.data(), payload.size()));
+    if (header.IsEndOfMessage()) {
+      nComplete++;
+      if (header.Channel() != 1)
+        order.push_back(header.Channel());
+    }
+  }
+  for (auto& writer : writers)
+    ASSERT_TRUE(writer.get());
+
+  const std::vector<uint32_t> expected{ 0, 2, 3 };
+  ASSERT_EQ(expected, order) << "Channels were not given the wire in order of priority";
+}
+
+TEST_F(IPCChannelTest, BufferedWritesShareFrames)
+{
+  auto ep = std::make_shared<CircularBufferEndpoint>(1024);
+  auto channel = ep->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+  channel->SetWriteBuffering(16);
+
+  // Small writes and the end of the message go out together
+  for (size_t i = 0; i < 4; i++)
+    ASSERT_TRUE(channel->Write("abc", 3));
+  ASSERT_TRUE(channel->WriteMessageComplete());
+
+  // A write that doesn't fit pushes out what was buffered, and one bigger than the buffer goes out by itself
+  const char large[32] = {};
+  ASSERT_TRUE(channel->Write("0123456789", 10));
+  ASSERT_TRUE(channel->Write("0123456789", 10));
+  ASSERT_TRUE(channel->Write(large, sizeof(large)));
+  ASSERT_TRUE(channel->WriteMessageComplete());
+
+  const std::vector<std::pair<uint32_t, bool>> expected{ { 12, true }, { 10, false }, { 10, false }, { 32, false }, { 0, true } };
+  for (const auto& frame : expected) {
+    IPCEndpoint::Header header;
+    ASSERT_EQ(static_cast<std::streamsize>(sizeof(header)), ep->ReadRaw(&header, sizeof(header)));
+    ASSERT_TRUE(header.Validate());
+    ASSERT_EQ(frame.first, header.PayloadSize());
+    ASSERT_EQ(frame.second, header.IsEndOfMessage());
+    char payload[64];
+    if (frame.first) {
+      ASSERT_EQ(static_cast<std::streamsize>(frame.first), ep->ReadRaw(payload, frame.first));
+    }
+  }
+}
+
+TEST_F(IPCChannelTest, ReadMessageIsContiguous)
+{
+  for (bool isReadAhead : { false, true }) {
+    auto ep = std::make_shared<CircularBufferEndpoint>(256 * 1024);
+    if (isReadAhead)
+      ep->SetReadAheadLimit(256 * 1024);
+    ep->SetMaxFragmentSize(IPCEndpoint::MIN_FRAGMENT_SIZE);
+    auto channel = ep->AcquireChannel(1, IPCEndpoint::Channel::READ_WRITE);
+
+    // Many fragments, with and without a hint, and with one that is too small
+    std::vector<uint8_t> expected(100 * 1000);
+    for (size_t i = 0; i < expected.size(); i++)
+      expected[i] = static_cast<uint8_t>(i * 7);
+    auto payload = MessageBuffers::MakeBuffer(expected.size());
+    memcpy(payload->Data(), expected.data(), expected.size());
+    for (size_t sizeHint : { size_t(0), expected.size(), size_t(1000) }) {
+      ASSERT_TRUE(channel->WriteMessageBuffers({ payload }));
+      auto message = channel->ReadMessage(sizeHint);
+      ASSERT_NE(nullptr, message);
+      ASSERT_EQ(expected.size(), message->Size());
+      ASSERT_EQ(0, memcmp(expected.data(), message->Data(), expected.size())) << "Message was not reassembled in order";
+    }
+
+    // Messages written a piece at a time, and empty ones
+    ASSERT_TRUE(channel->Write("abc", 3));
+    ASSERT_TRUE(channel->Write("defg", 4));
+    ASSERT_TRUE(channel->WriteMessageComplete());
+    ASSERT_TRUE(channel->WriteMessageComplete());
+    auto message = channel->ReadMessage();
+    ASSERT_EQ(7UL, message->Size());
+    ASSERT_EQ(0, memcmp("abcdefg", message->Data(), 7));
+    message = channel->ReadMessage(16);
+    ASSERT_NE(nullptr, message);
+    ASSERT_EQ(0UL, message->Size());
+  }
+}
+
+TEST_F(IPCChannelTest, MessageLengthsAreAnnounced)
+{
+  auto ep = std::make_shared<CircularBufferEndpoint>(1024);
+  ep->SetMaxFragmentSize(IPCEndpoint::MIN_FRAGMENT_SIZE);
+  ep->SetSendMessageLengths(true);
+  auto channel = ep->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+
+  // Only the first frame of a message that needs more than one says how long it is
+  ASSERT_TRUE(channel->WriteMessageBuffers({ MessageBuffers::MakeBuffer(100), MessageBuffers::MakeBuffer(20) }));
+  ASSERT_TRUE(channel->WriteMessageBuffers({ MessageBuffers::MakeBuffer(10) }));
+  uint32_t nPayload = 0;
+  for (size_t i = 0; nPayload < 130; i++) {
+    IPCEndpoint::Header header;
+    ASSERT_EQ(static_cast<std::streamsize>(sizeof(header)), ep->ReadRaw(&header, sizeof(header)));
+    ASSERT_TRUE(header.Validate());
+    uint8_t extensions[256];
+    const size_t nExtensions = header.Size() - sizeof(header);
+    if (nExtensions) {
+      ASSERT_EQ(static_cast<std::streamsize>(nExtensions), ep->ReadRaw(extensions, nExtensions));
+    }
+    if (i == 0) {
+      const uint8_t expected[] = { IPCEndpoint::Header::EXTENSION_MESSAGE_LENGTH, 8, 0, 0, 0, 0, 0, 0, 0, 120 };
+      ASSERT_EQ(sizeof(expected), nExtensions);
+      ASSERT_EQ(0, memcmp(expected, extensions, sizeof(expected)));
+    }
+    else
+      ASSERT_EQ(0UL, nExtensions) << "Frame " << i << " carried extensions";
+
+    uint8_t payload[IPCEndpoint::MIN_FRAGMENT_SIZE];
+    ASSERT_EQ(static_cast<std::streamsize>(header.PayloadSize()), ep->ReadRaw(payload, header.PayloadSize()));
+    nPayload += header.PayloadSize();
+  }
+  ASSERT_EQ(130UL, nPayload);
+}
+
+TEST_F(IPCChannelTest, MessageLengthSizesReadMessage)
+{
+  static const size_t sc_size = 200 * 1000;
+  for (bool isReadAhead : { false, true }) {
+    auto ep = std::make_shared<CircularBufferEndpoint>(1024 * 1024);
+    if (isReadAhead)
+      ep->SetReadAheadLimit(1024 * 1024);
+    ep->SetMaxFragmentSize(4096);
+    ep->SetSendMessageLengths(true);
+    auto channel = ep->AcquireChannel(1, IPCEndpoint::Channel::READ_WRITE);
+
+    auto payload = MessageBuffers::MakeBuffer(sc_size);
+    for (size_t i = 0; i < sc_size; i++)
+      payload->Data()[i] = static_cast<uint8_t>(i * 13);
+
+    // Neither a missing nor a wrong hint gets in the way of allocating exactly what was announced
+    for (size_t sizeHint : { size_t(0), size_t(1000) }) {
+      ASSERT_TRUE(channel->WriteMessageBuffers({ payload }));
+      auto message = channel->ReadMessage(sizeHint);
+      ASSERT_NE(nullptr, message);
+      ASSERT_EQ(sc_size, message->Size());
+      ASSERT_EQ(sc_size, message->AllocatedSize()) << "Message buffer was not allocated at the announced length";
+      ASSERT_EQ(0, memcmp(payload->Data(), message->Data(), sc_size));
+    }
+  }
+}
+
+TEST_F(IPCChannelTest, AnnouncedLengthsAreOnlyHints)
+{
+  // Frames as a peer might send them, announcing far more than it sends, or less than it sends
+  auto sendFrame = [](CircularBufferEndpoint& ep, uint64_t announced, const char* payload, bool eom) {
+    IPCEndpoint::Header header;
+    header.SetChannel(1);
+    header.SetPayloadSize(4);
+    header.SetEndOfMessage(eom);
+    uint8_t extension[10] = { IPCEndpoint::Header::EXTENSION_MESSAGE_LENGTH, 8 };
+    for (size_t i = 0; i < 8; i++)
+      extension[2 + i] = static_cast<uint8_t>(announced >> (56 - 8 * i));
+    if (announced)
+      header.size += sizeof(extension);
+    return
+      ep.WriteRaw(&header, sizeof(header)) &&
+      (!announced || ep.WriteRaw(extension, sizeof(extension))) &&
+      ep.WriteRaw(payload, 4);
+  };
+
+  for (bool isReadAhead : { false, true }) {
+    auto ep = std::make_shared<CircularBufferEndpoint>(1024);
+    if (isReadAhead)
+      ep->SetReadAheadLimit(1024);
+    ep->SetMaxAnnouncedLength(4096);
+    auto channel = ep->AcquireChannel(1, IPCEndpoint::Channel::READ_WRITE);
+
+    ASSERT_TRUE(sendFrame(*ep, 1ULL << 40, "abcd", false));
+    ASSERT_TRUE(sendFrame(*ep, 0, "efgh", true));
+    auto message = channel->ReadMessage();
+    ASSERT_NE(nullptr, message);
+    ASSERT_EQ(8UL, message->Size());
+    ASSERT_EQ(0, memcmp("abcdefgh", message->Data(), 8));
+    ASSERT_GT(2 * 4096UL, message->AllocatedSize()) << "Announced length was not clamped";
+
+    // An announcement shorter than what has arrived doesn't stop the buffer from growing
+    ASSERT_TRUE(sendFrame(*ep, 2, "ijkl", false));
+    ASSERT_TRUE(sendFrame(*ep, 0, "mnop", true));
+    message = channel->ReadMessage();
+    ASSERT_NE(nullptr, message);
+    ASSERT_EQ(8UL, message->Size());
+    ASSERT_EQ(0, memcmp("ijklmnop", message->Data(), 8));
+  }
+}
+
+TEST_F(IPCChannelTest, TrafficCounters)
+{
+  auto ep = std::make_shared<CircularBufferEndpoint>(64 * 1024);
+  auto channel = ep->AcquireChannel(1, IPCEndpoint::Channel::READ_WRITE);
+  ASSERT_TRUE(channel->Write("abc", 3));
+  ASSERT_TRUE(channel->WriteMessageComplete());
+  ASSERT_EQ(1UL, channel->ReadMessageBuffers().size());
+
+  const auto counters = ep->GetCounters();
+  const auto channelCounters = ep->GetChannelCounters(1);
+  const auto otherCounters = ep->GetChannelCounters(2);
+  if (!IPCEndpoint::CountersEnabled()) {
+    // Compiled out, nothing is ever counted
+    ASSERT_EQ(0UL, counters.framesSent);
+    ASSERT_EQ(0UL, channelCounters.framesSent);
+    return;
+  }
+
+  // One payload frame and one end of message marker each way
+  for (const IPCEndpoint::TrafficCounters* traffic : { static_cast<const IPCEndpoint::TrafficCounters*>(&counters), &channelCounters }) {
+    ASSERT_EQ(2UL, traffic->framesSent);
+    ASSERT_EQ(2UL, traffic->framesReceived);
+    ASSERT_EQ(1UL, traffic->messagesSent);
+    ASSERT_EQ(1UL, traffic->messagesReceived);
+    ASSERT_EQ(2 * sizeof(IPCEndpoint::Header) + 3, traffic->bytesSent);
+    ASSERT_EQ(2 * sizeof(IPCEndpoint::Header) + 3, traffic->bytesReceived);
+  }
+  ASSERT_EQ(0UL, otherCounters.framesSent);
+  ASSERT_EQ(2UL, counters.writeCalls);
+  ASSERT_EQ(3UL, counters.readCalls);
+  ASSERT_EQ(0UL, counters.bytesDrained);
+}
+
+TEST_F(IPCChannelTest, SendTimestampsRecordLatency)
+{
+  auto ep = std::make_shared<CircularBufferEndpoint>(64 * 1024);
+  auto base = ep->AcquireChannel(1, IPCEndpoint::Channel::READ_WRITE);
+  auto extended = ep->AcquireChannel(10, IPCEndpoint::Channel::READ_WRITE);
+
+  // Nothing is measured until the sender starts stamping
+  ASSERT_TRUE(base->Write("abc", 3));
+  ASSERT_TRUE(base->WriteMessageComplete());
+  ASSERT_EQ(1UL, base->ReadMessageBuffers().size());
+  ASSERT_EQ(0UL, ep->GetLatency(1).count);
+
+  ep->SetSendTimestamps(true);
+  ASSERT_TRUE(base->Write("abc", 3));
+  ASSERT_TRUE(base->WriteMessageComplete());
+  ASSERT_TRUE(extended->Write("defg", 4));
+  ASSERT_TRUE(extended->WriteMessageComplete());
+  auto buffers = base->ReadMessageBuffers();
+  ASSERT_EQ(1UL, buffers.size());
+  ASSERT_EQ(3UL, buffers[0]->Size());
+  buffers = extended->ReadMessageBuffers();
+  ASSERT_EQ(1UL, buffers.size());
+  ASSERT_EQ(4UL, buffers[0]->Size());
+
+  const auto latency = ep->GetLatency(1);
+  ASSERT_EQ(1UL, ep->GetLatency(10).count);
+  ASSERT_EQ(1UL, latency.count);
+  ASSERT_LE(latency.p50.count(), latency.max.count());
+  ASSERT_EQ(0UL, ep->GetLatency(2).count);
+}
@@ -0,0 +1,459 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include <leapipc/IPCEndpointUnix.h>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include FUTURE_HEADER
+
+using namespace leap::ipc;
+
+class IPCEndpointUnixTest:
+  public testing::Test
+{
+public:
+  IPCEndpointUnixTest(void) {
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0) {
+      m_sender = std::make_shared<IPCEndpointUnix>(sockets[0]);
+      m_receiver = std::make_shared<IPCEndpointUnix>(sockets[1]);
+    }
+  }
+
+  std::shared_ptr<IPCEndpointUnix> m_sender;
+  std::shared_ptr<IPCEndpointUnix> m_receiver;
+
+  // Sends a batch of small four-fragment messages over a fresh connection and counts the receive calls it takes
+  // to read them back.  The whole batch fits in the socket buffer, so it is all waiting before the first read.
+  static uint64_t CountReceiveCalls(size_t receiveBufferSize) {
+    static const size_t sc_nMessages = 100;
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets))
+      return 0;
+    auto sender = std::make_shared<IPCEndpointUnix>(sockets[0]);
+    auto receiver = std::make_shared<IPCEndpointUnix>(sockets[1]);
+    if (!receiver->SetReceiveBufferSize(receiveBufferSize))
+      return 0;
+
+    auto writer = sender->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+    MessageBuffers::Buffers buffers;
+    for (size_t i = 0; i < 4; i++)
+      buffers.push_back(std::make_shared<MessageBuffers::Buffer>(16));
+    for (size_t i = 0; i < sc_nMessages; i++)
+      if (!writer->WriteMessageBuffers(buffers))
+        return 0;
+
+    auto channel = receiver->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+    for (size_t i = 0; i < sc_nMessages; i++)
+      if (channel->ReadMessageBuffers().size() != 4)
+        return 0;
+    return receiver->ReceiveCallCount();
+  }
+};
+
+TEST_F(IPCEndpointUnixTest, ReceiveBufferingReducesSyscalls) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  const uint64_t unbuffered = CountReceiveCalls(0);
+  const uint64_t buffered = CountReceiveCalls(IPCEndpointUnix::DEFAULT_RECEIVE_BUFFER_SIZE);
+  ASSERT_NE(0UL, unbuffered) << "Not all messages were received";
+  ASSERT_NE(0UL, buffered) << "Not all messages were received";
+  ASSERT_LT(buffered, unbuffered) << "Receive buffering did not reduce the number of receive calls";
+}
+
+TEST_F(IPCEndpointUnixTest, ReceiveBufferIsFixedOnceReadingBegins) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+  ASSERT_TRUE(m_receiver->SetReceiveBufferSize(IPCEndpointUnix::DEFAULT_RECEIVE_BUFFER_SIZE));
+
+  auto writer = m_sender->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(writer->Write("abcdef", 6));
+  ASSERT_TRUE(writer->WriteMessageComplete());
+  auto reader = m_receiver->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+  char buf[3];
+  ASSERT_EQ(3, reader->Read(buf, sizeof(buf)));
+
+  // The rest of the message is sitting in the buffer, which must not change under the reader
+  ASSERT_FALSE(m_receiver->SetReceiveBufferSize(0));
+  ASSERT_EQ(3, reader->Read(buf, sizeof(buf)));
+  ASSERT_EQ(0, memcmp(buf, "def", 3));
+}
+
+TEST_F(IPCEndpointUnixTest, ReadRawIsOneReceiveCall) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  // With data already waiting, and buffering off, each read is a single receive call and nothing else
+  const std::vector<uint64_t> batch(16, 0xDEADBEEF);
+  ASSERT_TRUE(m_sender->WriteRaw(batch.data(), static_cast<std::streamsize>(batch.size() * sizeof(uint64_t))));
+  const auto nReceiveCalls = m_receiver->ReceiveCallCount();
+  for (size_t i = 0; i < batch.size(); i++) {
+    uint64_t value = 0;
+    ASSERT_EQ(static_cast<std::streamsize>(sizeof(value)), m_receiver->ReadRaw(&value, sizeof(value)));
+    ASSERT_EQ(0xDEADBEEF, value);
+  }
+  ASSERT_EQ(batch.size(), m_receiver->ReceiveCallCount() - nReceiveCalls);
+}
+
+TEST_F(IPCEndpointUnixTest, AbortWakesBlockedReader) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  auto reader = std::async(
+    std::launch::async,
+    [this] {
+      uint8_t buf[8];
+      return m_receiver->ReadRaw(buf, sizeof(buf));
+    }
+  );
+
+  // Give the reader time to block in the kernel before aborting
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ASSERT_TRUE(m_receiver->Abort(IPCEndpoint::Reason::UserAborted));
+  ASSERT_EQ(std::future_status::ready, reader.wait_for(std::chrono::seconds(5))) << "Abort did not wake up a blocked reader";
+  ASSERT_GE(0, reader.get()) << "A read on an aborted endpoint unexpectedly returned data";
+  ASSERT_TRUE(m_receiver->IsClosed());
+  ASSERT_FALSE(m_receiver->Abort(IPCEndpoint::Reason::UserAborted)) << "Second abort unexpectedly succeeded";
+}
+
+TEST_F(IPCEndpointUnixTest, PassesFileDescriptors) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+  ASSERT_NE(0u, m_sender->EnableCapabilities(IPCEndpoint::CAPABILITY_FILE_DESCRIPTORS));
+
+  int ends[2];
+  ASSERT_EQ(0, ::pipe(ends));
+
+  // Send the write end of the pipe along with a message, then a message with no payload at all
+  auto writer = m_sender->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+  auto payload = std::make_shared<MessageBuffers::Buffer>(5);
+  memcpy(payload->Data(), "hello", 5);
+  ASSERT_TRUE(writer->WriteMessageBuffers({ payload }, { ends[1] }));
+  ASSERT_TRUE(writer->WriteMessageBuffers({}, { ends[0], ends[1] }));
+  ::close(ends[1]);
+
+  auto reader = m_receiver->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+  std::vector<FileDescriptor> fds;
+  auto buffers = reader->ReadMessageBuffers(fds);
+  ASSERT_EQ(1UL, buffers.size());
+  ASSERT_EQ(0, memcmp(buffers[0]->Data(), "hello", 5));
+  ASSERT_EQ(1UL, fds.size());
+
+  // The received descriptor must refer to the same pipe
+  ASSERT_EQ(1, ::write(fds[0].Get(), "x", 1));
+  char c = 0;
+  ASSERT_EQ(1, ::read(ends[0], &c, 1));
+  ASSERT_EQ('x', c);
+
+  buffers = reader->ReadMessageBuffers(fds);
+  ASSERT_TRUE(buffers.empty());
+  ASSERT_EQ(2UL, fds.size());
+  ::close(ends[0]);
+}
+
+TEST_F(IPCEndpointUnixTest, DescriptorsNeedAgreement) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  // Refused up front, and the connection carries on as though nothing happened
+  auto writer = m_sender->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+  auto payload = std::make_shared<MessageBuffers::Buffer>(4);
+  ASSERT_FALSE(writer->WriteMessageBuffers({ payload }, { 0 }));
+  ASSERT_FALSE(m_sender->IsClosed()) << "A refused descriptor closed the endpoint";
+  m_sender->EnableAsyncSend(1024, IPCEndpoint::SendOverflow::Fail);
+  ASSERT_FALSE(writer->WriteMessageBuffers({ payload }, { 0 }));
+  ASSERT_TRUE(writer->WriteMessageBuffers({ payload }));
+
+  auto reader = m_receiver->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+  ASSERT_EQ(1UL, reader->ReadMessageBuffers().size());
+  ASSERT_FALSE(m_sender->IsClosed());
+}
+
+TEST_F(IPCEndpointUnixTest, UnclaimedDescriptorsAreClosed) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+  ASSERT_NE(0u, m_sender->EnableCapabilities(IPCEndpoint::CAPABILITY_FILE_DESCRIPTORS));
+
+  int ends[2];
+  ASSERT_EQ(0, ::pipe(ends));
+
+  // Nobody reads channel 2, so the descriptor sent there has to be dropped rather than handed to channel 3
+  auto writer2 = m_sender->AcquireChannel(2, IPCEndpoint::Channel::WRITE_ONLY);
+  auto writer3 = m_sender->AcquireChannel(3, IPCEndpoint::Channel::WRITE_ONLY);
+  auto payload = std::make_shared<MessageBuffers::Buffer>(4);
+  ASSERT_TRUE(writer2->WriteMessageBuffers({ payload }, { ends[1] }));
+  ASSERT_TRUE(writer3->WriteMessageBuffers({ payload }));
+  ::close(ends[1]);
+
+  auto reader = m_receiver->AcquireChannel(3, IPCEndpoint::Channel::READ_ONLY);
+  std::vector<FileDescriptor> fds;
+  ASSERT_EQ(1UL, reader->ReadMessageBuffers(fds).size());
+  ASSERT_TRUE(fds.empty()) << "A descriptor was delivered with the wrong message";
+
+  // With every copy of the write end closed, the read end sees end of file
+  char c;
+  ASSERT_EQ(0, ::read(ends[0], &c, 1)) << "The dropped descriptor was leaked";
+  ::close(ends[0]);
+}
+
+TEST_F(IPCEndpointUnixTest, UnannouncedDescriptorsAreBounded) {
+  int sockets[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  auto receiver = std::make_shared<IPCEndpointUnix>(sockets[1]);
+  IPCEndpoint::Reason reason = IPCEndpoint::Reason::Unspecified;
+  receiver->onConnectionLost += [&reason] (IPCEndpoint::Reason r) { reason = r; };
+  int ends[2];
+  ASSERT_EQ(0, ::pipe(ends));
+
+  // A peer that attaches a descriptor to every message without ever announcing one
+  auto writer = std::async(
+    std::launch::async,
+    [&] {
+      struct {
+        IPCEndpoint::Header header;
+        uint8_t payload;
+      } frame;
+      frame.header.SetEndOfMessage();
+      frame.header.SetPayloadSize(1);
+      frame.payload = 0;
+      for (size_t i = 0; i <= IPCEndpoint::MAX_DESCRIPTORS; i++) {
+        iovec iov = { &frame, sizeof(IPCEndpoint::Header) + 1 };
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        union {
+          cmsghdr align;
+          char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &ends[1], sizeof(int));
+        if (::sendmsg(sockets[0], &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(iov.iov_len))
+          return;
+      }
+    }
+  );
+
+  // Every message is delivered until a frame's worth of descriptors is waiting, then the connection is dropped
+  auto reader = receiver->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+  size_t nMessages = 0;
+  while (!reader->ReadMessageBuffers().empty())
+    nMessages++;
+  writer.get();
+  ::close(sockets[0]);
+  ::close(ends[0]);
+  ::close(ends[1]);
+  ASSERT_EQ(static_cast<size_t>(IPCEndpoint::MAX_DESCRIPTORS), nMessages);
+  ASSERT_EQ(IPCEndpoint::Reason::StreamIntegrityViolation, reason);
+}
+
+TEST_F(IPCEndpointUnixTest, HeaderExtensionsNeedAgreement) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  // Nothing has been agreed with the other end of a bare socket pair, so nothing is stamped
+  ASSERT_FALSE(m_sender->SetSendTimestamps(true));
+  ASSERT_FALSE(m_sender->SetSendMessageLengths(true));
+  auto writer = m_sender->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+  auto reader = m_receiver->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+  ASSERT_TRUE(writer->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(4) }));
+  ASSERT_EQ(1UL, reader->ReadMessageBuffers().size());
+  ASSERT_EQ(0UL, m_receiver->GetLatency(1).count);
+
+  // Once both ends are known to understand them, they are sent
+  const uint32_t agreed = m_sender->EnableCapabilities(~0u);
+  ASSERT_EQ(0u, agreed & IPCEndpoint::CAPABILITY_SHARED_MEMORY) << "Shared memory can only be agreed by a handshake";
+  ASSERT_NE(0u, agreed & IPCEndpoint::CAPABILITY_TIMESTAMPS);
+  ASSERT_TRUE(m_sender->SetSendTimestamps(true));
+  ASSERT_TRUE(writer->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(4) }));
+  ASSERT_EQ(1UL, reader->ReadMessageBuffers().size());
+  ASSERT_EQ(1UL, m_receiver->GetLatency(1).count);
+}
+
+TEST_F(IPCEndpointUnixTest, ExtendedChannelsNeedAgreement) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  // An older peer would fold channel 6 into channel 2
+  ASSERT_EQ(nullptr, m_sender->AcquireChannel(6, IPCEndpoint::Channel::WRITE_ONLY));
+  ASSERT_NE(nullptr, m_sender->AcquireChannel(2, IPCEndpoint::Channel::WRITE_ONLY));
+
+  m_sender->EnableCapabilities(IPCEndpoint::CAPABILITY_EXTENDED_CHANNELS);
+  m_receiver->EnableCapabilities(IPCEndpoint::CAPABILITY_EXTENDED_CHANNELS);
+  auto writer = m_sender->AcquireChannel(6, IPCEndpoint::Channel::WRITE_ONLY);
+  auto reader = m_receiver->AcquireChannel(6, IPCEndpoint::Channel::READ_ONLY);
+  ASSERT_NE(nullptr, writer);
+  ASSERT_NE(nullptr, reader);
+  ASSERT_TRUE(writer->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(4) }));
+  ASSERT_EQ(1UL, reader->ReadMessageBuffers().size());
+}
+
+TEST_F(IPCEndpointUnixTest, FragmentsInterleaveAcrossChannels) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  // A bulk transfer is already underway on one channel when a small message is sent on another
+  static const size_t sc_bulkSize = 16 * 1024 * 1024;
+  m_sender->SetMaxFragmentSize(64 * 1024);
+  std::atomic<size_t> nBulkRead{ 0 };
+
+  // The control reader has to be in place before the bulk reader starts taking frames off the stream
+  auto control = m_receiver->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+
+  auto bulkWriter = std::async(
+    std::launch::async,
+    [this] {
+      auto channel = m_sender->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+      return channel->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(sc_bulkSize) });
+    }
+  );
+  auto bulkReader = std::async(
+    std::launch::async,
+    [this, &nBulkRead] {
+      auto channel = m_receiver->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+      std::vector<uint8_t> buf(256 * 1024);
+      while (nBulkRead < sc_bulkSize) {
+        const std::streamsize n = channel->Read(buf.data(), static_cast<std::streamsize>(buf.size()));
+        if (n < 0)
+          return false;
+        nBulkRead += static_cast<size_t>(n);
+      }
+      return true;
+    }
+  );
+  while (!nBulkRead)
+    std::this_thread::yield();
+
+  ASSERT_TRUE(m_sender->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY)->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(16) }));
+  ASSERT_EQ(1U, control->ReadMessageBuffers().size());
+  const size_t nBulkReadAtControl = nBulkRead;
+
+  ASSERT_TRUE(bulkWriter.get());
+  ASSERT_TRUE(bulkReader.get());
+  ASSERT_LT(nBulkReadAtControl, sc_bulkSize) << "Small message waited for the whole bulk transfer";
+}
+
+TEST_F(IPCEndpointUnixTest, AsyncSendDoesNotWaitForPeer) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  static const size_t sc_nMessages = 16;
+  static const size_t sc_messageSize = 1024 * 1024;
+  m_sender->EnableAsyncSend(64 * 1024 * 1024, IPCEndpoint::SendOverflow::Block, 4 * 1024 * 1024, 1024 * 1024);
+  std::mutex lock;
+  std::vector<bool> watermarks;
+  m_sender->onSendWatermark += [&](bool isHigh) {
+    std::lock_guard<std::mutex> lk(lock);
+    watermarks.push_back(isHigh);
+  };
+
+  // Far more than the socket can hold, with nobody reading yet
+  auto writer = std::async(
+    std::launch::async,
+    [this] {
+      auto channel = m_sender->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+      for (size_t i = 0; i < sc_nMessages; i++) {
+        auto buffer = std::make_shared<MessageBuffers::Buffer>(sc_messageSize);
+        buffer->Data()[0] = static_cast<uint8_t>(i);
+        if (!channel->WriteMessageBuffers({ buffer }))
+          return false;
+      }
+      return true;
+    }
+  );
+  ASSERT_EQ(std::future_status::ready, writer.wait_for(std::chrono::seconds(5))) << "Writer waited for the peer";
+  ASSERT_TRUE(writer.get());
+
+  auto channel = m_receiver->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+  for (size_t i = 0; i < sc_nMessages; i++) {
+    auto buffers = channel->ReadMessageBuffers();
+    ASSERT_EQ(1UL, buffers.size());
+    ASSERT_EQ(sc_messageSize, buffers[0]->Size());
+    ASSERT_EQ(i, buffers[0]->Data()[0]) << "Messages were reordered";
+  }
+
+  std::lock_guard<std::mutex> lk(lock);
+  const std::vector<bool> expected{ true, false };
+  ASSERT_EQ(expected, watermarks) << "Watermarks were not signalled once each";
+}
+
+TEST_F(IPCEndpointUnixTest, AsyncSendOverflowPolicies) {
+  static const size_t sc_nMessages = 16;
+  static const size_t sc_messageSize = 1024 * 1024;
+
+  // Writes as many messages as the policy allows with nobody reading, then reads back what was sent
+  struct Result {
+    size_t nWritten = 0;
+    std::vector<size_t> received;
+  };
+  auto run = [](IPCEndpoint::SendOverflow overflow) {
+    Result result;
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+      return result;
+    auto sender = std::make_shared<IPCEndpointUnix>(sockets[0]);
+    auto receiver = std::make_shared<IPCEndpointUnix>(sockets[1]);
+    sender->EnableAsyncSend(4 * sc_messageSize, overflow);
+
+    auto writer = sender->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+    for (size_t i = 0; i < sc_nMessages; i++) {
+      auto buffer = std::make_shared<MessageBuffers::Buffer>(sc_messageSize);
+      buffer->Data()[0] = static_cast<uint8_t>(i);
+      if (writer->WriteMessageBuffers({ buffer }))
+        result.nWritten++;
+    }
+
+    // The last message written is always the last one to arrive
+    auto reader = receiver->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+    const size_t last = overflow == IPCEndpoint::SendOverflow::Fail ? result.nWritten - 1 : sc_nMessages - 1;
+    while (result.received.empty() || result.received.back() != last) {
+      auto buffers = reader->ReadMessageBuffers();
+      if (buffers.size() != 1)
+        break;
+      result.received.push_back(buffers[0]->Data()[0]);
+    }
+    return result;
+  };
+
+  const Result fail = run(IPCEndpoint::SendOverflow::Fail);
+  ASSERT_LE(4UL, fail.nWritten) << "Writes failed while there was room in the queue";
+  ASSERT_GT(sc_nMessages, fail.nWritten) << "No write failed even though the queue was full";
+  ASSERT_EQ(fail.nWritten, fail.received.size()) << "A message that was accepted was not sent";
+  for (size_t i = 0; i < fail.received.size(); i++)
+    ASSERT_EQ(i, fail.received[i]);
+
+  const Result dropOldest = run(IPCEndpoint::SendOverflow::DropOldest);
+  ASSERT_EQ(sc_nMessages, dropOldest.nWritten) << "Writes failed instead of dropping old messages";
+  ASSERT_GT(sc_nMessages, dropOldest.received.size()) << "No messages were dropped even though the queue was full";
+  ASSERT_TRUE(std::is_sorted(dropOldest.received.begin(), dropOldest.received.end())) << "Messages were reordered";
+  ASSERT_EQ(sc_nMessages - 1, dropOldest.received.back()) << "Newest message was dropped";
+}
+
+TEST_F(IPCEndpointUnixTest, DroppingMessagesSignalsLowWatermark) {
+  ASSERT_NE(nullptr, m_sender) << "Failed to create a socket pair";
+
+  static const size_t sc_messageSize = 1024 * 1024;
+  m_sender->EnableAsyncSend(4 * sc_messageSize, IPCEndpoint::SendOverflow::DropOldest, 4 * sc_messageSize, 7 * sc_messageSize / 2);
+  std::mutex lock;
+  std::vector<bool> watermarks;
+  m_sender->onSendWatermark += [&](bool isHigh) {
+    std::lock_guard<std::mutex> lk(lock);
+    watermarks.push_back(isHigh);
+  };
+  auto isHigh = [&] {
+    std::lock_guard<std::mutex> lk(lock);
+    return !watermarks.empty();
+  };
+
+  // Nobody reads, so the background writer is stuck on the first message and the queue fills up
+  auto writer = m_sender->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+  for (size_t i = 0; i < 8 && !isHigh(); i++)
+    ASSERT_TRUE(writer->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(sc_messageSize) }));
+  ASSERT_TRUE(isHigh()) << "Full queue did not reach its high watermark";
+
+  // Two of the queued messages have to go to make room for this one, which leaves the queue below the low mark
+  ASSERT_TRUE(writer->WriteMessageBuffers({ std::make_shared<MessageBuffers::Buffer>(sc_messageSize + 1) }));
+
+  std::lock_guard<std::mutex> lk(lock);
+  const std::vector<bool> expected{ true, false };
+  ASSERT_EQ(expected, watermarks) << "Dropping messages did not bring the queue back down";
+}
@@ -0,0 +1,169 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include <autowiring/autowiring.h>
+#include <leapipc/IPCEndpointUnix.h>
+#include <leapipc/IPCHandshakeUnix.h>
+#if __linux__
+#include <leapipc/IPCReactor.h>
+#include <leapipc/SharedMemoryEndpointUnix.h>
+#endif
+#include "IPCTestUtils.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace leap::ipc;
+
+class IPCHandshakeUnixTest:
+  public SocketPairTest
+{
+public:
+  // Performs both sides of the handshake as a client and listener would
+  void Handshake(size_t clientRingSize, size_t listenerRingSize, std::shared_ptr<IPCEndpoint>& client, std::shared_ptr<IPCEndpoint>& server) {
+    Connect(
+      [clientRingSize] (int socket) { return IPCHandshakeUnix::Connect(socket, clientRingSize); },
+      [listenerRingSize] (int socket) { return IPCHandshakeUnix::Accept(socket, listenerRingSize); },
+      client,
+      server
+    );
+  }
+
+  // Wraps a socket in an endpoint that predates the handshake
+  std::shared_ptr<IPCEndpoint> TakePlain(size_t index) {
+    return Take(index, [] (int socket) { return std::make_shared<IPCEndpointUnix>(socket); });
+  }
+};
+
+TEST_F(IPCHandshakeUnixTest, AgreesOnCommonCapabilities) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  std::shared_ptr<IPCEndpoint> client, server;
+  Handshake(0, 0, client, server);
+  ASSERT_NE(nullptr, client);
+  ASSERT_NE(nullptr, server);
+  ASSERT_EQ(IPCHandshakeUnix::LocalCapabilities(0), client->Capabilities());
+  ASSERT_EQ(client->Capabilities(), server->Capabilities());
+  ASSERT_TRUE(client->HasCapability(IPCEndpoint::CAPABILITY_EXTENDED_CHANNELS));
+  ASSERT_TRUE(client->HasCapability(IPCEndpoint::CAPABILITY_TIMESTAMPS));
+  ASSERT_TRUE(client->HasCapability(IPCEndpoint::CAPABILITY_MESSAGE_LENGTHS));
+  ASSERT_FALSE(client->HasCapability(IPCEndpoint::CAPABILITY_SHARED_MEMORY)) << "Shared memory was agreed without being requested";
+
+  // The hello frames must not be visible as traffic
+  auto writer = client->AcquireChannel(3, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(writer->Write("abc", 3));
+  ASSERT_TRUE(writer->WriteMessageComplete());
+  auto reader = server->AcquireChannel(3, IPCEndpoint::Channel::READ_ONLY);
+  char buf[8];
+  ASSERT_EQ(3, reader->Read(buf, sizeof(buf)));
+  ASSERT_EQ(0, memcmp(buf, "abc", 3));
+}
+
+#if __linux__
+TEST_F(IPCHandshakeUnixTest, NegotiatesSharedMemoryWhenBothSidesWantIt) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  std::shared_ptr<IPCEndpoint> client, server;
+  Handshake(SharedMemoryEndpointUnix::DEFAULT_RING_SIZE, SharedMemoryEndpointUnix::DEFAULT_RING_SIZE, client, server);
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(client)) << "Client did not switch to shared memory";
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(server)) << "Server did not switch to shared memory";
+  ASSERT_TRUE(client->HasCapability(IPCEndpoint::CAPABILITY_SHARED_MEMORY));
+  ASSERT_FALSE(client->HasCapability(IPCEndpoint::CAPABILITY_FILE_DESCRIPTORS)) << "Shared memory endpoints cannot pass descriptors";
+  ASSERT_EQ(client->Capabilities(), server->Capabilities());
+}
+
+TEST_F(IPCHandshakeUnixTest, SharedMemoryNeedsBothSides) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  // The listener isn't interested, so the client must not offer a ring that would never be answered
+  std::shared_ptr<IPCEndpoint> client, server;
+  Handshake(SharedMemoryEndpointUnix::DEFAULT_RING_SIZE, 0, client, server);
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<IPCEndpointUnix>(client));
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<IPCEndpointUnix>(server));
+  ASSERT_FALSE(client->HasCapability(IPCEndpoint::CAPABILITY_SHARED_MEMORY));
+  ASSERT_TRUE(client->HasCapability(IPCEndpoint::CAPABILITY_FILE_DESCRIPTORS));
+
+  // An offer is an empty message on the last channel, so the first message the listener reads there has to be
+  // the client's own
+  auto writer = client->AcquireChannel(3, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(writer->Write("abc", 3));
+  ASSERT_TRUE(writer->WriteMessageComplete());
+  auto reader = server->AcquireChannel(3, IPCEndpoint::Channel::READ_ONLY);
+  auto buffers = reader->ReadMessageBuffers();
+  ASSERT_EQ(1u, buffers.size()) << "Client sent a ring offer the listener did not ask for";
+  ASSERT_EQ(3u, buffers[0]->Size());
+  ASSERT_EQ(0, memcmp(buffers[0]->Data(), "abc", 3));
+}
+#endif
+
+TEST_F(IPCHandshakeUnixTest, LateHelloDoesNotSplitTheAgreement) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  // The listener only gets to the client's hello after the client has given up on an answer
+  auto client = Take(0, [] (int socket) { return IPCHandshakeUnix::Connect(socket, 0); });
+  ASSERT_NE(nullptr, client);
+  auto server = Take(1, [] (int socket) { return IPCHandshakeUnix::Accept(socket, 0); });
+  ASSERT_NE(nullptr, server);
+  ASSERT_EQ(0u, client->Capabilities());
+  ASSERT_EQ(0u, server->Capabilities()) << "Listener used capabilities the client did not confirm";
+
+  // The listener's hello is still on its way to the client, and must not show up as traffic
+  auto writer = server->AcquireChannel(3, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(writer->Write("abc", 3));
+  ASSERT_TRUE(writer->WriteMessageComplete());
+  auto reader = client->AcquireChannel(3, IPCEndpoint::Channel::READ_ONLY);
+  auto buffers = reader->ReadMessageBuffers();
+  ASSERT_EQ(1u, buffers.size());
+  ASSERT_EQ(3u, buffers[0]->Size());
+  ASSERT_EQ(0, memcmp(buffers[0]->Data(), "abc", 3));
+}
+
+TEST_F(IPCHandshakeUnixTest, ListenerWorksWithOlderClients) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  // A client that predates the handshake just starts talking
+  auto client = TakePlain(0);
+  auto writer = client->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(writer->Write("abc", 3));
+  ASSERT_TRUE(writer->WriteMessageComplete());
+
+  auto server = Take(1, [] (int socket) { return IPCHandshakeUnix::Accept(socket, 0); });
+  ASSERT_NE(nullptr, server);
+  ASSERT_EQ(0u, server->Capabilities());
+
+  auto reader = server->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+  char buf[8];
+  ASSERT_EQ(3, reader->Read(buf, sizeof(buf))) << "Client traffic was disturbed by the handshake";
+  ASSERT_EQ(0, memcmp(buf, "abc", 3));
+}
+
+#if __linux__
+TEST_F(IPCHandshakeUnixTest, ReactorReceivesWhatTheHandshakeReadAhead) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+  AutoCurrentContext()->Initiate();
+  AutoConstruct<IPCReactor> reactor;
+
+  // An older client sends an empty message, nothing but a header, which the listener takes off the socket while
+  // looking for a hello.  Nothing else arrives to wake the reactor up for it.
+  auto client = TakePlain(0);
+  auto writer = client->AcquireChannel(2, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(writer->WriteMessageComplete());
+
+  auto server = Take(1, [] (int socket) { return IPCHandshakeUnix::Accept(socket, 0); });
+  ASSERT_NE(nullptr, server);
+
+  std::mutex lock;
+  std::condition_variable cv;
+  bool received = false;
+  reactor->onMessage += [&] (const std::shared_ptr<IPCEndpoint>&, uint32_t channel, MessageBuffers::Buffers& buffers) {
+    std::lock_guard<std::mutex> lk(lock);
+    received = channel == 2 && buffers.empty();
+    cv.notify_all();
+  };
+  ASSERT_TRUE(reactor->Add(server));
+
+  std::unique_lock<std::mutex> lk(lock);
+  ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] { return received; })) << "Reactor did not deliver the message";
+}
+#endif
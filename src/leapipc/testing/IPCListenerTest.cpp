@@ -9,10 +9,20 @@
 #include <leapipc/IPCClient.h>
 #include <leapipc/IPCEndpoint.h>
 #include <leapipc/IPCListener.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#include <vector>
 #include <gtest/gtest.h>
 #include <system_error>
 #include FUTURE_HEADER
+#if !defined(_MSC_VER)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 using namespace leap::ipc;
 
@@ -166,6 +176,178 @@ public:
   }
 };
 
+#if !defined(_MSC_VER) && !USE_NETWORK_SOCKETS
+TEST_F(IPCListenerTest, SilentClientDoesNotHoldUpOthers) {
+  AutoConstruct<IPCListener> listener(IPCTestScope(), m_namespaceName.c_str());
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<uint32_t> connected;
+  listener->EnableHandshake();
+  listener->onClientConnected += [&](const std::shared_ptr<IPCEndpoint>& ep) {
+    std::lock_guard<std::mutex> lk(lock);
+    connected.push_back(ep->Capabilities());
+    cv.notify_all();
+  };
+
+  // Wait for the listener to be up
+  AutoConstruct<IPCClient> client(IPCTestScope(), m_namespaceName.c_str());
+  client->EnableHandshake();
+  ASSERT_NE(nullptr, client->Connect(std::chrono::seconds(1))) << "Client took too long to connect to the server";
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] { return !connected.empty(); }));
+    connected.clear();
+  }
+
+  // A client that connects but never says anything, followed by one that does
+  sockaddr_un addr = {};
+  addr.sun_family = AF_LOCAL;
+  (std::string(IPCTestScope()) + m_namespaceName).copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+  const int silent = ::socket(PF_LOCAL, SOCK_STREAM, 0);
+  ASSERT_EQ(0, ::connect(silent, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+  auto endpoint = client->Connect(std::chrono::seconds(1));
+  ASSERT_NE(nullptr, endpoint);
+  ASSERT_NE(0u, endpoint->Capabilities());
+
+  // The second client's handshake had to finish before the listener gave up on the first
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] { return !connected.empty(); }));
+    ASSERT_NE(0u, connected.front()) << "Listener waited on the silent client before taking the next one";
+  }
+  ::close(silent);
+  listener->Stop();
+  ASSERT_TRUE(listener->WaitFor(std::chrono::seconds(5))) << "Listener did not shut down in a timely fashion";
+}
+
+TEST_F(IPCListenerTest, ClientsAreConnectedOneAtATime) {
+  AutoConstruct<IPCListener> listener(IPCTestScope(), m_namespaceName.c_str());
+  listener->EnableHandshake();
+  std::mutex lock;
+  std::condition_variable cv;
+  size_t nConnected = 0;
+  size_t nActive = 0;
+  size_t maxActive = 0;
+  bool release = false;
+  std::vector<std::thread::id> threads;
+  listener->onClientConnected += [&](const std::shared_ptr<IPCEndpoint>&) {
+    std::unique_lock<std::mutex> lk(lock);
+    threads.push_back(std::this_thread::get_id());
+    maxActive = std::max(maxActive, ++nActive);
+    nConnected++;
+    cv.notify_all();
+
+    // The first client holds the signal up while the second one finishes its handshake
+    cv.wait_for(lk, std::chrono::seconds(5), [&] { return release; });
+    nActive--;
+  };
+
+  AutoConstruct<IPCClient> client(IPCTestScope(), m_namespaceName.c_str());
+  client->EnableHandshake();
+  auto first = client->Connect(std::chrono::seconds(1));
+  ASSERT_NE(nullptr, first) << "Client took too long to connect to the server";
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] { return nConnected == 1; }));
+  }
+  auto second = client->Connect(std::chrono::seconds(1));
+  ASSERT_NE(nullptr, second) << "Handshake was held up by a subscriber";
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    release = true;
+    cv.notify_all();
+    ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] { return nConnected == 2 && !nActive; }));
+    ASSERT_EQ(1u, maxActive) << "Subscribers were called for two clients at once";
+    ASSERT_EQ(threads[0], threads[1]) << "Subscribers were called from more than one thread";
+  }
+  listener->Stop();
+  ASSERT_TRUE(listener->WaitFor(std::chrono::seconds(5))) << "Listener did not shut down in a timely fashion";
+}
+
+namespace {
+  // Reads the first frame header off a raw socket, which is what a peer that predates the handshake sees first
+  IPCEndpoint::Header FirstHeader(int socket) {
+    IPCEndpoint::Header header;
+    size_t nRead = 0;
+    while (nRead < sizeof(header)) {
+      const ssize_t n = ::recv(socket, reinterpret_cast<uint8_t*>(&header) + nRead, sizeof(header) - nRead, 0);
+      if (n <= 0)
+        break;
+      nRead += static_cast<size_t>(n);
+    }
+    return header;
+  }
+}
+
+TEST_F(IPCListenerTest, ClientsSendNothingButTrafficByDefault) {
+  // A listener that predates the handshake, at the level of what arrives on its socket
+  sockaddr_un addr = {};
+  addr.sun_family = AF_LOCAL;
+  (std::string(IPCTestScope()) + m_namespaceName).copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+  ::mkdir(IPCTestScope(), S_IRWXU);
+  const int listening = ::socket(PF_LOCAL, SOCK_STREAM, 0);
+  ASSERT_EQ(0, ::bind(listening, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+  ASSERT_EQ(0, ::listen(listening, 1));
+
+  AutoConstruct<IPCClient> client(IPCTestScope(), m_namespaceName.c_str());
+  auto endpoint = client->Connect(std::chrono::seconds(1));
+  ASSERT_NE(nullptr, endpoint);
+  ASSERT_EQ(0u, endpoint->Capabilities());
+  const int accepted = ::accept(listening, nullptr, nullptr);
+  ::close(listening);
+  ::unlink(addr.sun_path);
+  ASSERT_LE(0, accepted);
+
+  auto channel = endpoint->AcquireChannel(3, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(channel->Write("abc", 3));
+  ASSERT_TRUE(channel->WriteMessageComplete());
+  const auto header = FirstHeader(accepted);
+  ::close(accepted);
+  ASSERT_TRUE(header.Validate());
+  ASSERT_TRUE(header.IsChannel(3)) << "Something other than the message arrived first";
+  ASSERT_EQ(sizeof(header), header.Size());
+  ASSERT_EQ(3u, header.PayloadSize());
+}
+
+TEST_F(IPCListenerTest, ListenersSendNothingButTrafficByDefault) {
+  AutoConstruct<IPCListener> listener(IPCTestScope(), m_namespaceName.c_str());
+  std::mutex lock;
+  std::condition_variable cv;
+  std::shared_ptr<IPCEndpoint> endpoint;
+  listener->onClientConnected += [&](const std::shared_ptr<IPCEndpoint>& ep) {
+    std::lock_guard<std::mutex> lk(lock);
+    endpoint = ep;
+    cv.notify_all();
+  };
+
+  // A client that predates the handshake, at the level of what arrives on its socket
+  sockaddr_un addr = {};
+  addr.sun_family = AF_LOCAL;
+  (std::string(IPCTestScope()) + m_namespaceName).copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+  const int raw = ::socket(PF_LOCAL, SOCK_STREAM, 0);
+  const auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (::connect(raw, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 && std::chrono::steady_clock::now() < limit)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] { return endpoint != nullptr; })) << "Listener did not accept the client";
+  }
+  ASSERT_EQ(0u, endpoint->Capabilities());
+
+  auto channel = endpoint->AcquireChannel(3, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(channel->Write("abc", 3));
+  ASSERT_TRUE(channel->WriteMessageComplete());
+  const auto header = FirstHeader(raw);
+  ::close(raw);
+  ASSERT_TRUE(header.Validate());
+  ASSERT_TRUE(header.IsChannel(3)) << "Something other than the message arrived first";
+  ASSERT_EQ(sizeof(header), header.Size());
+  ASSERT_EQ(3u, header.PayloadSize());
+  listener->Stop();
+  ASSERT_TRUE(listener->WaitFor(std::chrono::seconds(5))) << "Listener did not shut down in a timely fashion";
+}
+#endif
+
 TEST_F(IPCListenerTest, BandwidthSaturationTest) {
   AutoCurrentContext ctxt;
   AutoRequired<TerminatesEnclosingScopeOnException> exceptionChecker;
@@ -80,3 +80,59 @@ TEST_F(IPCMessagingTest, SequentialMessageTransmission)
   ASSERT_EQ(300, f.get()) << "Not all messages were received as expected";
 }
 
+TEST_F(IPCMessagingTest, MessageBuffersTransmission)
+{
+  AutoCurrentContext ctxt;
+  std::string ns = GenerateNamespaceName();
+
+  // Create client and server
+  AutoConstruct<IPCClient> client(IPCTestScope(), ns.c_str());
+  AutoConstruct<IPCListener> listener(IPCTestScope(), ns.c_str());
+
+  auto val = std::make_shared<std::promise<int>>();
+  listener->onClientConnected += [&val](const std::shared_ptr<IPCEndpoint>& ep) {
+    AutoCreateContext ctxt;
+    ctxt->Add(ep);
+
+    // Every message must arrive intact, with no empty messages in between
+    auto channel = ep->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+    int nMessages = 0;
+    while (!ep->IsClosed()) {
+      auto buffers = channel->ReadMessageBuffers();
+      bool intact = buffers.size() == 4;
+      for (auto& buffer : buffers)
+        intact = intact &&
+          buffer->Size() == sizeof(Message) &&
+          reinterpret_cast<const Message*>(buffer->Data())->id1 == static_cast<uint32_t>(nMessages);
+      if (!intact)
+        break;
+      nMessages++;
+    }
+    val->set_value(nMessages);
+  };
+
+  auto ep = client->Connect(std::chrono::minutes(1));
+  ASSERT_NE(nullptr, ep) << " Failed to connect in time";
+
+  {
+    auto channel = ep->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+    for (uint32_t i = 0; i < 300; i++) {
+      MessageBuffers::Buffers buffers;
+      for (uint32_t j = 0; j < 4; j++) {
+        auto buffer = std::make_shared<MessageBuffers::Buffer>(sizeof(Message));
+        *reinterpret_cast<Message*>(buffer->Data()) = Message{ i, i + 1, i + 2, i + j };
+        buffers.push_back(buffer);
+      }
+      ASSERT_TRUE(channel->WriteMessageBuffers(buffers));
+    }
+  }
+
+  // Close connection, shut down context:
+  ep.reset();
+  ctxt->SignalShutdown();
+
+  // Block until gatherer stops:
+  auto f = val->get_future();
+  ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::minutes(1))) << "Server did not receive messages in a timely fashion";
+  ASSERT_EQ(300, f.get()) << "Not all messages were received as expected";
+}
@@ -0,0 +1,208 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include <autowiring/autowiring.h>
+#include <leapipc/IPCClient.h>
+#include <leapipc/IPCEndpointUnix.h>
+#include <leapipc/IPCListener.h>
+#include <leapipc/IPCReactor.h>
+#include "IPCTestUtils.h"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace leap::ipc;
+
+class IPCReactorTest:
+  public testing::Test
+{
+public:
+  IPCReactorTest(void) {
+    AutoCurrentContext()->Initiate();
+  }
+
+  // Makes a connected pair of endpoints, the second of which is handed to the reactor
+  bool MakePair(std::shared_ptr<IPCEndpointUnix>& sender, std::shared_ptr<IPCEndpointUnix>& receiver) {
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets))
+      return false;
+    sender = std::make_shared<IPCEndpointUnix>(sockets[0]);
+    receiver = std::make_shared<IPCEndpointUnix>(sockets[1]);
+    return true;
+  }
+
+  std::mutex m_lock;
+  std::condition_variable m_cv;
+};
+
+TEST_F(IPCReactorTest, ReceivesOnAllChannels) {
+  AutoConstruct<IPCReactor> reactor;
+  std::shared_ptr<IPCEndpointUnix> sender, receiver;
+  ASSERT_TRUE(MakePair(sender, receiver)) << "Failed to create a socket pair";
+
+  static const int sc_nMessages = 100;
+  std::vector<int> received[IPCEndpoint::Header::NUMBER_OF_CHANNELS];
+  size_t nReceived = 0;
+  reactor->onMessage += [&] (const std::shared_ptr<IPCEndpoint>& endpoint, uint32_t channel, MessageBuffers::Buffers& buffers) {
+    ASSERT_EQ(receiver, endpoint);
+    size_t nBytes = 0;
+    int value = 0;
+    for (const auto& buffer : buffers) {
+      ASSERT_GE(sizeof(value), nBytes + buffer->Size());
+      memcpy(reinterpret_cast<uint8_t*>(&value) + nBytes, buffer->Data(), buffer->Size());
+      nBytes += buffer->Size();
+    }
+    std::lock_guard<std::mutex> lk(m_lock);
+    received[channel].push_back(value);
+    nReceived++;
+    m_cv.notify_all();
+  };
+  ASSERT_TRUE(reactor->Add(receiver));
+
+  for (uint32_t channelNumber = 0; channelNumber < IPCEndpoint::Header::NUMBER_OF_CHANNELS; channelNumber++) {
+    auto channel = sender->AcquireChannel(channelNumber, IPCEndpoint::Channel::WRITE_ONLY);
+    for (int i = 0; i < sc_nMessages; i++) {
+      const int value = static_cast<int>(channelNumber) * sc_nMessages + i;
+      ASSERT_TRUE(channel->Write(&value, sizeof(value)));
+      ASSERT_TRUE(channel->WriteMessageComplete());
+    }
+  }
+
+  std::unique_lock<std::mutex> lk(m_lock);
+  ASSERT_TRUE(
+    m_cv.wait_for(lk, std::chrono::seconds(5), [&] { return nReceived == IPCEndpoint::Header::NUMBER_OF_CHANNELS * sc_nMessages; })
+  ) << "Reactor did not deliver all messages";
+  for (uint32_t channelNumber = 0; channelNumber < IPCEndpoint::Header::NUMBER_OF_CHANNELS; channelNumber++) {
+    ASSERT_EQ(static_cast<size_t>(sc_nMessages), received[channelNumber].size());
+    for (int i = 0; i < sc_nMessages; i++)
+      ASSERT_EQ(static_cast<int>(channelNumber) * sc_nMessages + i, received[channelNumber][i]) << "Messages arrived out of order";
+  }
+}
+
+TEST_F(IPCReactorTest, ManyEndpointsOneThread) {
+  AutoConstruct<IPCReactor> reactor;
+
+  static const size_t sc_nEndpoints = 64;
+  std::vector<std::shared_ptr<IPCEndpointUnix>> senders(sc_nEndpoints);
+  std::vector<std::shared_ptr<IPCEndpointUnix>> receivers(sc_nEndpoints);
+  for (size_t i = 0; i < sc_nEndpoints; i++)
+    ASSERT_TRUE(MakePair(senders[i], receivers[i])) << "Failed to create a socket pair";
+
+  std::vector<std::thread::id> threads;
+  size_t nReceived = 0;
+  reactor->onMessage += [&] (const std::shared_ptr<IPCEndpoint>&, uint32_t, MessageBuffers::Buffers&) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (std::find(threads.begin(), threads.end(), std::this_thread::get_id()) == threads.end())
+      threads.push_back(std::this_thread::get_id());
+    nReceived++;
+    m_cv.notify_all();
+  };
+  for (auto& receiver : receivers)
+    ASSERT_TRUE(reactor->Add(receiver));
+
+  for (auto& sender : senders) {
+    auto channel = sender->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+    ASSERT_TRUE(channel->Write("ping", 4));
+    ASSERT_TRUE(channel->WriteMessageComplete());
+  }
+
+  std::unique_lock<std::mutex> lk(m_lock);
+  ASSERT_TRUE(m_cv.wait_for(lk, std::chrono::seconds(5), [&] { return nReceived == sc_nEndpoints; })) << "Not every endpoint was serviced";
+  ASSERT_EQ(1UL, threads.size()) << "Messages were delivered on more than one thread";
+  ASSERT_NE(std::this_thread::get_id(), threads[0]);
+}
+
+TEST_F(IPCReactorTest, PeerCloseAbortsEndpoint) {
+  AutoConstruct<IPCReactor> reactor;
+  std::shared_ptr<IPCEndpointUnix> sender, receiver;
+  ASSERT_TRUE(MakePair(sender, receiver)) << "Failed to create a socket pair";
+
+  bool lost = false;
+  receiver->onConnectionLost += [&] (IPCEndpoint::Reason) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    lost = true;
+    m_cv.notify_all();
+  };
+  ASSERT_TRUE(reactor->Add(receiver));
+  sender.reset();
+
+  std::unique_lock<std::mutex> lk(m_lock);
+  ASSERT_TRUE(m_cv.wait_for(lk, std::chrono::seconds(5), [&] { return lost; })) << "Reactor did not notice that the peer went away";
+  ASSERT_TRUE(receiver->IsClosed());
+}
+
+TEST_F(IPCReactorTest, ListenerAddsConnectionsWhenAsked) {
+  AutoConstruct<IPCReactor> reactor;
+  const std::string namespaceName = GenerateNamespaceName();
+  AutoConstruct<IPCListener> listener(IPCTestScope(), namespaceName.c_str());
+  listener->SetReactor(reactor);
+
+  std::vector<int> received;
+  reactor->onMessage += [&] (const std::shared_ptr<IPCEndpoint>&, uint32_t channel, MessageBuffers::Buffers& buffers) {
+    int value = 0;
+    if (buffers.size() == 1 && buffers[0]->Size() == sizeof(value))
+      memcpy(&value, buffers[0]->Data(), sizeof(value));
+    std::lock_guard<std::mutex> lk(m_lock);
+    received.push_back(value);
+    m_cv.notify_all();
+  };
+
+  AutoConstruct<IPCClient> client(IPCTestScope(), namespaceName.c_str());
+  auto endpoint = client->Connect(std::chrono::seconds(1));
+  ASSERT_NE(nullptr, endpoint) << "Client took too long to connect to the server";
+  auto channel = endpoint->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+  const int value = 1234;
+  ASSERT_TRUE(channel->Write(&value, sizeof(value)));
+  ASSERT_TRUE(channel->WriteMessageComplete());
+
+  std::unique_lock<std::mutex> lk(m_lock);
+  ASSERT_TRUE(m_cv.wait_for(lk, std::chrono::seconds(5), [&] { return !received.empty(); })) << "Accepted connection was not added to the reactor";
+  ASSERT_EQ(value, received[0]);
+  lk.unlock();
+  listener->Stop();
+  ASSERT_TRUE(listener->WaitFor(std::chrono::seconds(5))) << "Listener did not shut down in a timely fashion";
+}
+
+TEST_F(IPCReactorTest, ListenerLeavesConnectionsToSubscribersByDefault) {
+  // A reactor in the same context must not compete with subscribers for the connections they read from
+  AutoConstruct<IPCReactor> reactor;
+  const std::string namespaceName = GenerateNamespaceName();
+  AutoConstruct<IPCListener> listener(IPCTestScope(), namespaceName.c_str());
+
+  bool stolen = false;
+  reactor->onMessage += [&] (const std::shared_ptr<IPCEndpoint>&, uint32_t, MessageBuffers::Buffers&) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    stolen = true;
+  };
+  std::shared_ptr<IPCEndpoint> server;
+  listener->onClientConnected += [&](const std::shared_ptr<IPCEndpoint>& ep) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    server = ep;
+    m_cv.notify_all();
+  };
+
+  AutoConstruct<IPCClient> client(IPCTestScope(), namespaceName.c_str());
+  auto endpoint = client->Connect(std::chrono::seconds(1));
+  ASSERT_NE(nullptr, endpoint) << "Client took too long to connect to the server";
+  {
+    std::unique_lock<std::mutex> lk(m_lock);
+    ASSERT_TRUE(m_cv.wait_for(lk, std::chrono::seconds(5), [&] { return server != nullptr; }));
+  }
+
+  auto writer = endpoint->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(writer->Write("abc", 3));
+  ASSERT_TRUE(writer->WriteMessageComplete());
+  auto reader = server->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+  auto buffers = reader->ReadMessageBuffers();
+  ASSERT_EQ(1u, buffers.size()) << "Subscriber did not receive the message";
+  ASSERT_EQ(3u, buffers[0]->Size());
+  {
+    std::lock_guard<std::mutex> lk(m_lock);
+    ASSERT_FALSE(stolen) << "Reactor read from a connection it was not given";
+  }
+  listener->Stop();
+  ASSERT_TRUE(listener->WaitFor(std::chrono::seconds(5))) << "Listener did not shut down in a timely fashion";
+}
@@ -4,7 +4,10 @@
 #include <cstdlib>
 #include <ctime>
 #if !defined(_MSC_VER)
+#include <leapipc/IPCEndpoint.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include FUTURE_HEADER
 #endif
 
 std::string GenerateNamespaceName(void) {
@@ -25,3 +28,37 @@ std::string GenerateNamespaceName(void) {
     retVal.push_back(table[rand() % 16]);
   return retVal;
 }
+
+#if !defined(_MSC_VER)
+SocketPairTest::SocketPairTest(void) {
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, m_sockets) != 0)
+    m_sockets[0] = m_sockets[1] = -1;
+}
+
+SocketPairTest::~SocketPairTest(void) {
+  for (int socket : m_sockets)
+    if (socket != -1)
+      ::close(socket);
+}
+
+std::shared_ptr<leap::ipc::IPCEndpoint> SocketPairTest::Take(size_t index, const Setup& setup) {
+  auto endpoint = setup(m_sockets[index]);
+  if (endpoint)
+    m_sockets[index] = -1;
+  return endpoint;
+}
+
+void SocketPairTest::Connect(
+  const Setup& clientSetup,
+  const Setup& listenerSetup,
+  std::shared_ptr<leap::ipc::IPCEndpoint>& client,
+  std::shared_ptr<leap::ipc::IPCEndpoint>& server
+) {
+  auto listener = std::async(
+    std::launch::async,
+    [this, &listenerSetup] { return Take(1, listenerSetup); }
+  );
+  client = Take(0, clientSetup);
+  server = listener.get();
+}
+#endif
@@ -1,5 +1,53 @@
 // Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
 #pragma once
 #include <string>
+#if !defined(_MSC_VER)
+#include <gtest/gtest.h>
+#include <functional>
+#include <memory>
+
+namespace leap {
+namespace ipc {
+  class IPCEndpoint;
+}}
+#endif
 
 std::string GenerateNamespaceName(void);
+
+#if !defined(_MSC_VER)
+/// <summary>
+/// Fixture for tests that need both ends of a freshly connected socket
+/// </summary>
+/// <remarks>
+/// Sockets that have not been taken over by an endpoint are closed when the test ends, however it ends.
+/// </remarks>
+class SocketPairTest:
+  public testing::Test
+{
+public:
+  SocketPairTest(void);
+  ~SocketPairTest(void);
+
+  // Builds an endpoint on one of the sockets, or returns nullptr if it couldn't
+  typedef std::function<std::shared_ptr<leap::ipc::IPCEndpoint>(int)> Setup;
+
+  // The client end and the listener end.  An entry is -1 once an endpoint owns the socket or the test has
+  // closed it itself.
+  int m_sockets[2];
+
+  /// <summary>
+  /// Runs setup on the socket at the given index, the returned endpoint takes ownership of the socket
+  /// </summary>
+  std::shared_ptr<leap::ipc::IPCEndpoint> Take(size_t index, const Setup& setup);
+
+  /// <summary>
+  /// Runs the listener's setup on another thread and the client's on this one, as a real connection would
+  /// </summary>
+  void Connect(
+    const Setup& clientSetup,
+    const Setup& listenerSetup,
+    std::shared_ptr<leap::ipc::IPCEndpoint>& client,
+    std::shared_ptr<leap::ipc::IPCEndpoint>& server
+  );
+};
+#endif
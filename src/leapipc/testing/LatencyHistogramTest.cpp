@@ -0,0 +1,60 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include <leapipc/LatencyHistogram.h>
+#include <gtest/gtest.h>
+
+using namespace leap::ipc;
+
+class LatencyHistogramTest:
+  public testing::Test
+{};
+
+TEST_F(LatencyHistogramTest, EmptyHistogram)
+{
+  LatencyHistogram histogram;
+  ASSERT_EQ(0UL, histogram.Count());
+  ASSERT_EQ(0, histogram.Percentile(0.5).count());
+  ASSERT_EQ(0, histogram.Max().count());
+}
+
+TEST_F(LatencyHistogramTest, SmallValuesAreExact)
+{
+  LatencyHistogram histogram;
+  for (int i = 1; i <= 10; i++)
+    histogram.Record(std::chrono::nanoseconds(i));
+  ASSERT_EQ(10UL, histogram.Count());
+  ASSERT_EQ(5, histogram.Percentile(0.5).count());
+  ASSERT_EQ(10, histogram.Percentile(1.0).count());
+  ASSERT_EQ(10, histogram.Max().count());
+}
+
+TEST_F(LatencyHistogramTest, PercentilesWithinBucketWidth)
+{
+  LatencyHistogram histogram;
+  for (int i = 1; i <= 1000; i++)
+    histogram.Record(std::chrono::microseconds(i));
+
+  const struct {
+    double fraction;
+    int64_t expected;
+  } cases[] = {
+    { 0.5, 500000 },
+    { 0.99, 990000 },
+    { 0.999, 999000 }
+  };
+  for (const auto& c : cases) {
+    const int64_t reported = histogram.Percentile(c.fraction).count();
+    ASSERT_LE(c.expected, reported) << "Percentile " << c.fraction;
+    ASSERT_GE(c.expected + c.expected / 8, reported) << "Percentile " << c.fraction;
+  }
+  ASSERT_EQ(1000000, histogram.Max().count());
+  ASSERT_EQ(1000000, histogram.Percentile(1.0).count());
+}
+
+TEST_F(LatencyHistogramTest, NegativeIsZero)
+{
+  LatencyHistogram histogram;
+  histogram.Record(std::chrono::nanoseconds(-5));
+  ASSERT_EQ(1UL, histogram.Count());
+  ASSERT_EQ(0, histogram.Max().count());
+}
@@ -0,0 +1,309 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include <leapipc/MessageBuffers.h>
+#include <autowiring/autowiring.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <gtest/gtest.h>
+
+using namespace leap::ipc;
+
+class MessageBuffersTest:
+  public testing::Test
+{};
+
+TEST_F(MessageBuffersTest, MoveTransfersOwnership)
+{
+  MessageBuffers::Buffer original(16);
+  uint8_t* data = original.Data();
+  MessageBuffers::Buffer moved(std::move(original));
+  ASSERT_EQ(data, moved.Data());
+  ASSERT_EQ(16UL, moved.Size());
+  ASSERT_EQ(16UL, moved.AllocatedSize());
+  ASSERT_TRUE(moved.HasOwnership());
+  ASSERT_FALSE(original.HasOwnership());
+}
+
+TEST_F(MessageBuffersTest, MovedInlineBuffersOutliveTheirAllocation)
+{
+  auto shared = MessageBuffers::MakeBuffer(100);
+  for (size_t i = 0; i < shared->Size(); i++)
+    shared->Data()[i] = static_cast<uint8_t>(i);
+
+  // The inline payload goes away with the shared buffer, the moved-to buffer needs storage of its own
+  MessageBuffers::Buffer moved(std::move(*shared));
+  const uint8_t* inlineData = shared->Data();
+  shared.reset();
+  ASSERT_NE(inlineData, moved.Data());
+  ASSERT_EQ(100UL, moved.Size());
+  ASSERT_TRUE(moved.HasOwnership());
+  for (size_t i = 0; i < moved.Size(); i++)
+    ASSERT_EQ(static_cast<uint8_t>(i), moved.Data()[i]);
+
+  // The same goes for assignment, in both directions
+  auto target = MessageBuffers::MakeBuffer(10);
+  *target = std::move(moved);
+  MessageBuffers::Buffer assigned;
+  assigned = std::move(*target);
+  target.reset();
+  ASSERT_EQ(100UL, assigned.Size());
+  for (size_t i = 0; i < assigned.Size(); i++)
+    ASSERT_EQ(static_cast<uint8_t>(i), assigned.Data()[i]);
+}
+
+TEST_F(MessageBuffersTest, InlineStorageSharesTheAllocation)
+{
+  auto buffer = MessageBuffers::MakeBuffer(100);
+  ASSERT_EQ(100UL, buffer->Size());
+  ASSERT_LE(100UL, buffer->AllocatedSize());
+  ASSERT_TRUE(buffer->HasOwnership());
+
+  // The payload follows the control block, aligned for any type
+  const uintptr_t object = reinterpret_cast<uintptr_t>(buffer.get());
+  const uintptr_t data = reinterpret_cast<uintptr_t>(buffer->Data());
+  ASSERT_EQ(0UL, data % alignof(std::max_align_t));
+  ASSERT_LT(object, data);
+  ASSERT_GE(object + sizeof(MessageBuffers::Buffer) + 2 * alignof(std::max_align_t) + 64, data);
+  memset(buffer->Data(), 0xCC, buffer->AllocatedSize());
+
+  // Slack at the end of the block is usable, past that the payload moves out to the heap
+  uint8_t* original = buffer->Data();
+  ASSERT_TRUE(buffer->Resize(buffer->AllocatedSize()));
+  ASSERT_EQ(original, buffer->Data());
+  ASSERT_TRUE(buffer->Resize(SlabAllocator::MAX_BLOCK_SIZE * 2));
+  ASSERT_NE(original, buffer->Data());
+  ASSERT_EQ(0xCC, buffer->Data()[99]);
+}
+
+TEST_F(MessageBuffersTest, SmallBuffersAreReused)
+{
+  AutoRequired<MessageBuffers::SharedBufferPool> pool;
+
+  auto buffer = pool->Get(100);
+  ASSERT_EQ(100UL, buffer->Size());
+  ASSERT_LE(100UL, buffer->AllocatedSize());
+  uint8_t* data = buffer->Data();
+  buffer.reset();
+
+  // Freed on this thread, so the very same block comes straight back
+  const auto before = pool->GetStatistics();
+  buffer = pool->Get(80);
+  ASSERT_EQ(data, buffer->Data());
+  ASSERT_EQ(80UL, buffer->Size());
+  const auto after = pool->GetStatistics();
+  ASSERT_EQ(before.hits + 1, after.hits);
+  ASSERT_EQ(before.misses, after.misses);
+
+  // Growing within the block keeps it, growing beyond it moves to the heap
+  ASSERT_TRUE(buffer->Resize(buffer->AllocatedSize()));
+  ASSERT_EQ(data, buffer->Data());
+  ASSERT_TRUE(buffer->Resize(SlabAllocator::MAX_BLOCK_SIZE + 1));
+  ASSERT_NE(data, buffer->Data());
+}
+
+TEST_F(MessageBuffersTest, SteadyStateAcrossThreads)
+{
+  AutoRequired<MessageBuffers::SharedBufferPool> pool;
+
+  // One thread allocates and another frees, the way received fragments travel to the threads that read them
+  static const size_t sc_nWarmup = 10000;
+  static const size_t sc_nMeasured = 50000;
+  static const size_t sc_maxInFlight = 64;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<MessageBuffers::SharedBuffer> queue;
+  bool done = false;
+
+  std::thread consumer([&] {
+    std::unique_lock<std::mutex> lk(lock);
+    for (;;) {
+      cv.wait(lk, [&] { return done || !queue.empty(); });
+      if (queue.empty())
+        return;
+      queue.pop_front();
+      cv.notify_all();
+    }
+  });
+
+  const auto before = pool->GetStatistics();
+  auto warm = before;
+  for (size_t i = 0; i < sc_nWarmup + sc_nMeasured; i++) {
+    if (i == sc_nWarmup)
+      warm = pool->GetStatistics();
+    auto buffer = pool->Get(1000);
+    std::unique_lock<std::mutex> lk(lock);
+    cv.wait(lk, [&] { return queue.size() < sc_maxInFlight; });
+    queue.push_back(std::move(buffer));
+    cv.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    done = true;
+    cv.notify_all();
+  }
+  consumer.join();
+
+  // Blocks are only allocated until there are enough of them to fill both threads' caches and the queue, a
+  // late straggler is possible but the count doesn't grow with the number of buffers
+  const auto measured = pool->GetStatistics();
+  ASSERT_EQ(sc_nWarmup + sc_nMeasured, (measured.hits + measured.misses) - (before.hits + before.misses));
+  ASSERT_GT(1024UL, measured.misses - before.misses) << "Buffers were allocated in proportion to their use";
+  ASSERT_GT(sc_nMeasured / 100, measured.misses - warm.misses) << "Buffers were still being allocated once the pool had warmed up";
+}
+
+TEST_F(MessageBuffersTest, LargeBuffersAreReused)
+{
+  AutoRequired<MessageBuffers::SharedBufferPool> pool;
+  static const size_t sc_size = 1024 * 1024;
+
+  auto buffer = pool->Get(sc_size);
+  uint8_t* data = buffer->Data();
+  ASSERT_EQ(sc_size, pool->GetStatistics().residentBytes);
+  buffer.reset();
+  ASSERT_EQ(sc_size, pool->GetStatistics().idleBytes);
+
+  // Anything that uses at least half of the idle buffer gets it
+  buffer = pool->Get(sc_size - 1000);
+  ASSERT_EQ(data, buffer->Data());
+  ASSERT_EQ(sc_size - 1000, buffer->Size());
+  ASSERT_EQ(0UL, pool->GetStatistics().idleBytes);
+  buffer.reset();
+
+  // A much smaller request doesn't tie the big buffer up
+  buffer = pool->Get(sc_size / 4);
+  ASSERT_NE(data, buffer->Data());
+  const auto statistics = pool->GetStatistics();
+  ASSERT_EQ(sc_size, statistics.idleBytes);
+  ASSERT_EQ(sc_size + sc_size / 4, statistics.residentBytes);
+  ASSERT_EQ(sc_size + sc_size / 4, statistics.peakResidentBytes);
+}
+
+TEST_F(MessageBuffersTest, BudgetBoundsIdleBuffers)
+{
+  AutoRequired<MessageBuffers::SharedBufferPool> pool;
+  static const size_t sc_size = 1024 * 1024;
+  pool->SetBudget(4 * sc_size);
+
+  MessageBuffers::Buffers buffers;
+  for (size_t i = 0; i < 8; i++)
+    buffers.push_back(pool->Get(sc_size));
+  buffers.clear();
+
+  auto statistics = pool->GetStatistics();
+  ASSERT_EQ(4 * sc_size, statistics.idleBytes);
+  ASSERT_EQ(4 * sc_size, statistics.residentBytes);
+  ASSERT_EQ(8 * sc_size, statistics.peakResidentBytes);
+
+  // A single buffer larger than the whole budget is never kept
+  pool->Get(8 * sc_size).reset();
+  ASSERT_EQ(4 * sc_size, pool->GetStatistics().idleBytes);
+
+  // Lowering the budget gives back memory straight away
+  pool->SetBudget(sc_size);
+  ASSERT_EQ(sc_size, pool->GetStatistics().idleBytes);
+}
+
+TEST_F(MessageBuffersTest, SlabDepotIsBounded)
+{
+  // A burst of small buffers, all freed by a thread that then exits and hands its cache over to the depot
+  static const size_t sc_nBuffers = 4096;
+  const auto before = SlabAllocator::GetStatistics();
+  std::thread([] {
+    MessageBuffers::Buffers buffers;
+    for (size_t i = 0; i < sc_nBuffers; i++)
+      buffers.push_back(MessageBuffers::MakeBuffer(1024));
+  }).join();
+  const auto after = SlabAllocator::GetStatistics();
+  ASSERT_GE(before.residentBytes + 2 * SlabAllocator::DEFAULT_DEPOT_LIMIT, after.residentBytes) << "The depot kept the whole burst";
+
+  // Lowering the limit gives back memory straight away
+  SlabAllocator::SetDepotLimit(0);
+  const auto limited = SlabAllocator::GetStatistics();
+  SlabAllocator::SetDepotLimit(SlabAllocator::DEFAULT_DEPOT_LIMIT);
+  ASSERT_GT(after.depotBytes, limited.depotBytes);
+  ASSERT_EQ(after.residentBytes - limited.residentBytes, after.depotBytes - limited.depotBytes);
+}
+
+TEST_F(MessageBuffersTest, BudgetCoversSlabDepot)
+{
+  AutoRequired<MessageBuffers::SharedBufferPool> pool;
+  std::thread([] {
+    MessageBuffers::Buffers buffers;
+    for (size_t i = 0; i < 256; i++)
+      buffers.push_back(MessageBuffers::MakeBuffer(1024));
+  }).join();
+  ASSERT_LT(0UL, pool->GetStatistics().slabIdleBytes);
+
+  // Small blocks go first, then idle large buffers
+  pool->Get(1024 * 1024).reset();
+  pool->SetBudget(1024 * 1024);
+  auto statistics = pool->GetStatistics();
+  ASSERT_EQ(0UL, statistics.slabIdleBytes);
+  ASSERT_EQ(1024UL * 1024, statistics.idleBytes);
+}
+
+TEST_F(MessageBuffersTest, BudgetCoversThreadCaches)
+{
+  // A thread that frees a batch of small buffers and then sits idle, still holding its cache
+  std::mutex lock;
+  std::condition_variable cv;
+  bool freed = false;
+  bool done = false;
+  std::thread idler([&] {
+    {
+      MessageBuffers::Buffers buffers;
+      for (size_t i = 0; i < 64; i++)
+        buffers.push_back(MessageBuffers::MakeBuffer(1024));
+    }
+    std::unique_lock<std::mutex> lk(lock);
+    freed = true;
+    cv.notify_all();
+    cv.wait(lk, [&] { return done; });
+  });
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    cv.wait(lk, [&] { return freed; });
+  }
+  ASSERT_LE(64UL * 1024, SlabAllocator::GetStatistics().cachedBytes) << "Blocks held by an idle thread were not counted";
+
+  AutoRequired<MessageBuffers::SharedBufferPool> pool;
+  pool->SetBudget(0);
+  const auto statistics = pool->GetStatistics();
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    done = true;
+    cv.notify_all();
+  }
+  idler.join();
+  ASSERT_EQ(0UL, statistics.slabIdleBytes) << "Trimming did not reach the idle thread's cache";
+}
+
+TEST_F(MessageBuffersTest, IdleBuffersExpire)
+{
+  AutoRequired<MessageBuffers::SharedBufferPool> pool;
+  pool->SetIdleTimeout(std::chrono::milliseconds(10));
+  pool->Get(1024 * 1024).reset();
+  ASSERT_EQ(1024UL * 1024, pool->GetStatistics().idleBytes);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  pool->Trim();
+  const auto statistics = pool->GetStatistics();
+  ASSERT_EQ(0UL, statistics.idleBytes);
+  ASSERT_EQ(0UL, statistics.residentBytes);
+}
+
+TEST_F(MessageBuffersTest, BuffersOutliveTheirPool)
+{
+  MessageBuffers::SharedBuffer large, small;
+  {
+    auto pool = std::make_shared<MessageBuffers::SharedBufferPool>();
+    large = pool->Get(1024 * 1024);
+    small = pool->Get(16);
+  }
+  memset(large->Data(), 0, large->Size());
+  memset(small->Data(), 0, small->Size());
+}
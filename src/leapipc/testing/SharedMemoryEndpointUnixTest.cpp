@@ -0,0 +1,204 @@
+// Copyright (C) 2012-2018 Leap Motion, Inc. All rights reserved.
+#include "stdafx.h"
+#include <leapipc/IPCEndpointUnix.h>
+#include <leapipc/SharedMemoryEndpointUnix.h>
+#include "IPCTestUtils.h"
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include FUTURE_HEADER
+
+using namespace leap::ipc;
+
+class SharedMemoryEndpointUnixTest:
+  public SocketPairTest
+{
+public:
+  // Negotiates both ends of the socket pair as a client and listener would
+  void Negotiate(size_t clientRingSize, size_t listenerRingSize, std::shared_ptr<IPCEndpoint>& client, std::shared_ptr<IPCEndpoint>& server) {
+    Connect(
+      [clientRingSize] (int socket) { return SharedMemoryEndpointUnix::Offer(socket, clientRingSize); },
+      [listenerRingSize] (int socket) { return SharedMemoryEndpointUnix::Answer(socket, listenerRingSize); },
+      client,
+      server
+    );
+  }
+
+  void Negotiate(size_t ringSize, std::shared_ptr<IPCEndpoint>& client, std::shared_ptr<IPCEndpoint>& server) {
+    Negotiate(ringSize, ringSize, client, server);
+  }
+};
+
+TEST_F(SharedMemoryEndpointUnixTest, NegotiatesRings) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  std::shared_ptr<IPCEndpoint> client, server;
+  Negotiate(SharedMemoryEndpointUnix::DEFAULT_RING_SIZE, client, server);
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(client)) << "Client did not switch to shared memory";
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(server)) << "Server did not switch to shared memory";
+  ASSERT_EQ(static_cast<uint32_t>(::getpid()), client->PeerProcessId());
+
+  // Messages in both directions
+  for (auto& pair : { std::make_pair(client, server), std::make_pair(server, client) }) {
+    auto writer = pair.first->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+    auto reader = pair.second->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+    ASSERT_TRUE(writer->Write("hello", 5));
+    ASSERT_TRUE(writer->WriteMessageComplete());
+
+    char buf[16];
+    ASSERT_EQ(5, reader->Read(buf, sizeof(buf)));
+    ASSERT_EQ(0, memcmp(buf, "hello", 5));
+    ASSERT_EQ(0, reader->Read(buf, sizeof(buf)));
+  }
+}
+
+TEST_F(SharedMemoryEndpointUnixTest, LargeMessagesWrapTheRing) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  // Messages several times larger than the ring, so the writer has to wait for the reader over and over
+  std::shared_ptr<IPCEndpoint> client, server;
+  Negotiate(64 * 1024, client, server);
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(client)) << "Client did not switch to shared memory";
+
+  static const size_t sc_nMessages = 8;
+  static const size_t sc_messageSize = 3 * 1024 * 1024 + 17;
+  auto writer = std::async(
+    std::launch::async,
+    [client] {
+      auto channel = client->AcquireChannel(1, IPCEndpoint::Channel::WRITE_ONLY);
+      for (size_t i = 0; i < sc_nMessages; i++) {
+        auto buffer = std::make_shared<MessageBuffers::Buffer>(sc_messageSize);
+        for (size_t j = 0; j < sc_messageSize; j++)
+          buffer->Data()[j] = static_cast<uint8_t>(i + j);
+        if (!channel->WriteMessageBuffers({ buffer }))
+          return false;
+      }
+      return true;
+    }
+  );
+
+  auto channel = server->AcquireChannel(1, IPCEndpoint::Channel::READ_ONLY);
+  for (size_t i = 0; i < sc_nMessages; i++) {
+    auto buffers = channel->ReadMessageBuffers();
+    ASSERT_FALSE(buffers.empty()) << "Connection lost while reading message " << i;
+
+    size_t offset = 0;
+    for (const auto& buffer : buffers) {
+      for (size_t j = 0; j < buffer->Size(); j++, offset++)
+        ASSERT_EQ(static_cast<uint8_t>(i + offset), buffer->Data()[j]) << "Corruption in message " << i << " at offset " << offset;
+    }
+    ASSERT_EQ(sc_messageSize, offset);
+  }
+  ASSERT_TRUE(writer.get());
+}
+
+TEST_F(SharedMemoryEndpointUnixTest, DeclinedOfferFallsBack) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  // The listener declines, both sides have to end up on the socket
+  std::shared_ptr<IPCEndpoint> client, server;
+  Negotiate(SharedMemoryEndpointUnix::DEFAULT_RING_SIZE, 0, client, server);
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<IPCEndpointUnix>(client)) << "Client did not fall back to the socket";
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<IPCEndpointUnix>(server)) << "Server did not fall back to the socket";
+
+  auto writer = client->AcquireChannel(0, IPCEndpoint::Channel::WRITE_ONLY);
+  ASSERT_TRUE(writer->Write("xyz", 3));
+  ASSERT_TRUE(writer->WriteMessageComplete());
+
+  auto reader = server->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+  char buf[8];
+  ASSERT_EQ(3, reader->Read(buf, sizeof(buf))) << "Traffic was disturbed by the negotiation";
+  ASSERT_EQ(0, memcmp(buf, "xyz", 3));
+}
+
+TEST_F(SharedMemoryEndpointUnixTest, ClientThatGoesAwayFailsTheNegotiation) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  // Half an offer and then nothing, the listener has to give up as soon as the client is gone
+  auto answer = std::async(
+    std::launch::async,
+    [this] {
+      return Take(1, [] (int socket) { return SharedMemoryEndpointUnix::Answer(socket, SharedMemoryEndpointUnix::DEFAULT_RING_SIZE); });
+    }
+  );
+  IPCEndpoint::Header header;
+  header.SetChannel(IPCEndpoint::Header::NUMBER_OF_CHANNELS - 1);
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(header)), ::send(m_sockets[0], &header, sizeof(header), MSG_NOSIGNAL));
+  ::close(m_sockets[0]);
+  m_sockets[0] = -1;
+  ASSERT_EQ(std::future_status::ready, answer.wait_for(std::chrono::milliseconds(500))) << "Listener waited on a peer that was gone";
+  ASSERT_EQ(nullptr, answer.get());
+}
+
+TEST_F(SharedMemoryEndpointUnixTest, UnsealedRingsAreRefused) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  // A well-formed ring whose size the client could still change after the listener has mapped it
+  static const size_t sc_ringSize = 4096;
+  int fd = ::memfd_create("unsealed-ring", MFD_CLOEXEC);
+  ASSERT_LE(0, fd);
+  ASSERT_EQ(0, ::ftruncate(fd, 4096 + sc_ringSize));
+  const uint32_t ringHeader[] = { 0x474E524C, 0, sc_ringSize, 0 };
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(ringHeader)), ::pwrite(fd, ringHeader, sizeof(ringHeader), 0));
+
+  struct {
+    IPCEndpoint::Header header;
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t ringSize;
+  } frame;
+  frame.header.SetChannel(IPCEndpoint::Header::NUMBER_OF_CHANNELS - 1);
+  frame.header.SetEndOfMessage();
+  frame.header.size = sizeof(frame);
+  frame.magic = 0x474E524C;
+  frame.flags = 1;
+  frame.ringSize = sc_ringSize;
+
+  iovec iov = { &frame, sizeof(frame) };
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  union {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(frame)), ::sendmsg(m_sockets[0], &msg, MSG_NOSIGNAL));
+  ::close(fd);
+
+  auto server = Take(1, [] (int socket) { return SharedMemoryEndpointUnix::Answer(socket, SharedMemoryEndpointUnix::DEFAULT_RING_SIZE); });
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<IPCEndpointUnix>(server)) << "Listener mapped a ring that can still be resized";
+}
+
+TEST_F(SharedMemoryEndpointUnixTest, PeerAbortWakesReader) {
+  ASSERT_LE(0, m_sockets[0]) << "Failed to create a socket pair";
+
+  std::shared_ptr<IPCEndpoint> client, server;
+  Negotiate(SharedMemoryEndpointUnix::DEFAULT_RING_SIZE, client, server);
+  ASSERT_NE(nullptr, std::dynamic_pointer_cast<SharedMemoryEndpointUnix>(server)) << "Server did not switch to shared memory";
+
+  auto reader = std::async(
+    std::launch::async,
+    [server] {
+      auto channel = server->AcquireChannel(0, IPCEndpoint::Channel::READ_ONLY);
+      char c;
+      return channel->Read(&c, 1);
+    }
+  );
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ASSERT_TRUE(client->Abort(IPCEndpoint::Reason::UserAborted));
+  ASSERT_EQ(std::future_status::ready, reader.wait_for(std::chrono::seconds(5))) << "Peer abort did not wake up a blocked reader";
+  ASSERT_EQ(-1, reader.get());
+  ASSERT_TRUE(server->IsClosed());
+}